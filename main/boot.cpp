@@ -0,0 +1,106 @@
+/*
+  Asynchronous boot. setup() brings up storage and sampling right away, then the network, the
+  database sink and NTP come up in a background task that sampling never waits on.
+*/
+#include <M5Core2.h>
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "boot.h"
+#include "network.h"
+#include "webserver.h"
+#include "helper.h"
+#include "logger.h"
+
+static const char* stageNames[BOOT_STAGES] = {"storage", "sampling", "first sample", "network", "database", "time"};
+// Milliseconds since power on at which each stage was reached, 0 if it hasn't been yet
+static uint32_t stageTimes[BOOT_STAGES];
+
+/*
+  Once booted the station shouldn't allocate anything but short lived SD file handles, so the free
+  heap at the end of boot is the baseline and staying well below it means something allocates in
+  steady state (or leaks). Some allocation is outside our control: lwIP and the WiFi driver hold
+  buffers while packets are in flight, and WiFiClient::connect allocates a socket on every
+  reconnect and frees it on close. Those come and go, so the current free heap has to stay low for
+  HEAP_CHECKS samples in a row before it counts. The allocator's lifetime minimum would include
+  every such transient and can't tell a leak from a busy moment, boot_report only shows it.
+*/
+#define HEAP_SLACK (8 * 1024)
+#define HEAP_CHECKS 6
+#define BOOT_NETWORK_STACK 4096
+static uint32_t heapBaseline = 0;
+static uint32_t heapWarned = UINT32_MAX;
+static int heapLow = 0;
+static StaticTask_t bootTask;
+static StackType_t bootStack[BOOT_NETWORK_STACK];
+
+// Only the first time a stage is reached counts
+void boot_mark(boot_stage stage) {
+  if(stageTimes[stage] != 0)
+    return;
+  uint32_t now = millis();
+  stageTimes[stage] = now == 0 ? 1 : now;
+  if(stage == BOOT_FIRST_SAMPLE)
+    LOG_INFO(LOG_MAIN, "Time to first sample: %u ms", (unsigned) stageTimes[stage]);
+}
+
+uint32_t boot_elapsed(boot_stage stage) {
+  return stageTimes[stage];
+}
+
+void boot_report() {
+  for(int i = 0; i < BOOT_STAGES; i++) {
+    if(stageTimes[i] != 0)
+      printf("%-13s %8u ms\n", stageNames[i], (unsigned) stageTimes[i]);
+    else
+      printf("%-13s %11s\n", stageNames[i], "pending");
+  }
+  printf("Heap: %u free, %u minimum, %u largest block, %u at end of boot\n",
+         (unsigned) esp_get_free_heap_size(), (unsigned) esp_get_minimum_free_heap_size(),
+         (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), (unsigned) heapBaseline);
+}
+
+// Cheap enough for every sample. Warns again each time the heap falls another HEAP_SLACK
+void boot_heap_check() {
+  if(heapBaseline == 0)
+    return;
+  uint32_t current = esp_get_free_heap_size();
+  if(current + HEAP_SLACK >= heapBaseline) {
+    heapLow = 0;
+    return;
+  }
+  heapLow++;
+  if(heapLow >= HEAP_CHECKS && (heapWarned == UINT32_MAX || current + HEAP_SLACK < heapWarned)) {
+    LOG_WARN(LOG_MAIN, "Heap has stayed at %u bytes free, %u below the boot baseline",
+             (unsigned) current, (unsigned) (heapBaseline - current));
+    heapWarned = current;
+  }
+}
+
+/*
+  Network first, the database sink depends on it. NTP runs as part of station mode setup. Calls
+  what the setWifi and setDB commands do directly, running the commands would share their static
+  argument tables with the console task.
+*/
+static void boot_network(void* _) {
+  if(!start_wifi_cmd("m5core2", "password1234", true)) {
+    writeToScreen(M5.Lcd.width(), M5.Lcd.height()-10, "Couldn't start AP", RED, BLACK, right);
+  }
+  else {
+    boot_mark(BOOT_NETWORK);
+    if(!start_webserver())
+      LOG_ERROR(LOG_MAIN, "Failed to start HTTP server");
+  }
+  // Registered even without a network, the sink keeps retrying until it's up. The defaults point
+  // at the first client of the access point
+  influx_config config;
+  influxDefaults(&config);
+  if(start_influx_sink(&config))
+    boot_mark(BOOT_DB);
+  // Everything is allocated by now, later allocations are what the heap check looks for
+  heapBaseline = esp_get_free_heap_size();
+  vTaskDelete(NULL);
+}
+
+void boot_start_network() {
+  xTaskCreateStatic(boot_network, "boot_network", BOOT_NETWORK_STACK, NULL, 1, bootStack, &bootTask);
+}
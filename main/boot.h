@@ -0,0 +1,18 @@
+#include <stdint.h>
+
+// Boot milestones, in the order they're expected to happen
+enum boot_stage {
+  BOOT_STORAGE,      // Log recovered and CSV sink running
+  BOOT_SAMPLING,     // Sample timer started
+  BOOT_FIRST_SAMPLE,
+  BOOT_NETWORK,
+  BOOT_DB,
+  BOOT_TIME,         // RTC synchronized over NTP
+  BOOT_STAGES
+};
+
+void boot_mark(boot_stage stage);
+uint32_t boot_elapsed(boot_stage stage);
+void boot_report();
+void boot_start_network();
+void boot_heap_check();
@@ -0,0 +1,288 @@
+/*
+  Sparkline charts of the last few hours of pressure, temperature and wind, on the second screen.
+
+  The display task feeds them from the RAM history, whichever screen is shown, averaging the
+  samples in each CHART_COLUMN_SECONDS into one pixel column (wind keeps its peak instead, so
+  gusts show).
+
+  The charts sweep instead of scrolling: column slot x of the ring is always drawn at x, and a dim
+  cursor after the newest column marks where the next one goes. A new column then only touches two
+  pixel columns of the LCD, drawn straight onto it. Scrolling would move every pixel, and the
+  Core2 panel can't scroll sideways in hardware, so that meant pushing the whole 272x60 chart
+  (about 32 KB over SPI) every 40 s per chart.
+
+  Every chart also keeps a copy of itself in a sprite, pushed whole only when the charts are shown
+  again or a value falls outside the current scale. At most one sprite is pushed per frame, so a
+  frame never pays for more than one chart.
+*/
+#include <M5Core2.h>
+#include "chart.h"
+#include "history.h"
+#include "logger.h"
+#include "global.h"
+
+#define CHART_COUNT 3
+#define CHART_TOP 34
+#define CHART_SPACING (CHART_HEIGHT + 6)
+#define CHART_GRID_COLOR 0x2104
+#define CHART_CURSOR_COLOR DARKGREY
+// Columns left to draw past which the whole sprite is pushed instead
+#define CHART_CATCHUP_MAX 8
+// Columns between grid dots, 15 minutes
+#define CHART_GRID_COLUMNS (900 / CHART_COLUMN_SECONDS)
+
+typedef struct {
+  const char* label;
+  int field;
+  bool peak;        // Keep the highest sample of a column rather than the mean
+  float minSpan;    // Smallest range shown, so sensor noise doesn't fill the chart
+  uint16_t color;
+  float columns[CHART_WIDTH]; // Ring of committed columns, NAN where nothing was sampled
+  float lo;
+  float hi;
+  float sum;
+  float peakValue;
+  int samples;
+  float latest;
+  bool dirty;       // The sprite needs pushing whole
+  int drawnHead;    // Ring slot the LCD has the cursor at, when the chart isn't dirty
+} chart;
+
+static chart charts[CHART_COUNT] = {
+  {.label = "hPa", .field = 5, .peak = false, .minSpan = 2, .color = CYAN},
+  {.label = "C", .field = 3, .peak = false, .minSpan = 2, .color = YELLOW},
+  {.label = "km/h", .field = 1, .peak = true, .minSpan = 5, .color = GREEN},
+};
+static TFT_eSprite sprites[CHART_COUNT] = {TFT_eSprite(&M5.Lcd), TFT_eSprite(&M5.Lcd), TFT_eSprite(&M5.Lcd)};
+static bool ready = false;
+static int head = 0;           // Ring slot of the oldest column, where the cursor is
+static time_t columnTimes[CHART_WIDTH]; // Start of the column in every ring slot
+static time_t column = 0;      // Column the accumulators belong to, 0 before the first sample
+static time_t lastSeen = 0;    // Newest history sample already fed
+static bool labelsDirty = false;
+static bool visible = false;
+
+// Sprites are allocated once at boot, like every other buffer the display needs
+bool chart_init() {
+  for(int i = 0; i < CHART_COUNT; i++) {
+    for(int x = 0; x < CHART_WIDTH; x++)
+      charts[i].columns[x] = NAN;
+    charts[i].lo = NAN;
+    charts[i].hi = NAN;
+    charts[i].latest = NAN;
+    sprites[i].setColorDepth(8);
+    if(sprites[i].createSprite(CHART_WIDTH, CHART_HEIGHT) == NULL) {
+      LOG_ERROR(LOG_MAIN, "Not enough memory for chart sprites");
+      return false;
+    }
+    sprites[i].fillSprite(BLACK);
+  }
+  ready = true;
+  return true;
+}
+
+static int toY(const chart* c, float value) {
+  int y = (CHART_HEIGHT - 1) - (int) ((value - c->lo) * (CHART_HEIGHT - 1) / (c->hi - c->lo));
+  return constrain(y, 0, CHART_HEIGHT - 1);
+}
+
+/*
+  Draws ring slot x at (left + x, top) of the sprite or the LCD, joined to the column before it
+  unless that one is under the cursor. Grid dots follow absolute time.
+*/
+static void drawColumn(TFT_eSPI* target, int left, int top, int index, int x) {
+  chart* c = &charts[index];
+  if(x == head) {
+    target->drawFastVLine(left + x, top, CHART_HEIGHT, CHART_CURSOR_COLOR);
+    return;
+  }
+  target->drawFastVLine(left + x, top, CHART_HEIGHT, BLACK);
+  if(columnTimes[x] != 0 && (columnTimes[x] / CHART_COLUMN_SECONDS) % CHART_GRID_COLUMNS == 0)
+    target->drawFastVLine(left + x, top, CHART_HEIGHT, CHART_GRID_COLOR);
+  float value = c->columns[x];
+  if(isnan(value))
+    return;
+  float previous = x > 0 && x - 1 != head ? c->columns[x - 1] : NAN;
+  if(isnan(previous))
+    target->drawPixel(left + x, top + toY(c, value), c->color);
+  else
+    target->drawLine(left + x - 1, top + toY(c, previous), left + x, top + toY(c, value), c->color);
+}
+
+// Fits the scale to every column shown, returns false if there's nothing to fit
+static bool rescale(chart* c) {
+  float lo = NAN;
+  float hi = NAN;
+  for(int x = 0; x < CHART_WIDTH; x++) {
+    float value = c->columns[x];
+    if(isnan(value))
+      continue;
+    lo = isnan(lo) ? value : min(lo, value);
+    hi = isnan(hi) ? value : max(hi, value);
+  }
+  if(isnan(lo))
+    return false;
+  float span = max((hi - lo) * 1.2f, c->minSpan);
+  float middle = (hi + lo) / 2;
+  c->lo = middle - span / 2;
+  c->hi = middle + span / 2;
+  return true;
+}
+
+static void redraw(int index) {
+  sprites[index].fillSprite(BLACK);
+  for(int x = 0; x < CHART_WIDTH; x++)
+    drawColumn(&sprites[index], 0, 0, index, x);
+}
+
+// Closes the column at columnTime on every chart
+static void commitColumn(time_t columnTime) {
+  for(int i = 0; i < CHART_COUNT; i++) {
+    chart* c = &charts[i];
+    float value = c->samples == 0 ? NAN : c->peak ? c->peakValue : c->sum / c->samples;
+    c->columns[head] = value;
+    c->sum = 0;
+    c->samples = 0;
+  }
+  int newest = head;
+  columnTimes[newest] = columnTime;
+  head = (head + 1) % CHART_WIDTH;
+  for(int i = 0; i < CHART_COUNT; i++) {
+    chart* c = &charts[i];
+    float value = c->columns[newest];
+    if(!isnan(value) && (isnan(c->lo) || value < c->lo || value > c->hi)) {
+      // Off the scale, this is the only time a whole chart is drawn again
+      if(rescale(c))
+        redraw(i);
+      c->dirty = true;
+      labelsDirty = true;
+    }
+    else {
+      drawColumn(&sprites[i], 0, 0, i, newest);
+      drawColumn(&sprites[i], 0, 0, i, head);
+      // The one after the cursor was joined to the column it now covers
+      drawColumn(&sprites[i], 0, 0, i, (head + 1) % CHART_WIDTH);
+    }
+  }
+}
+
+static void addSample(const sensor_data* data) {
+  time_t sampleColumn = data->timestamp - data->timestamp % CHART_COLUMN_SECONDS;
+  if(column != 0 && sampleColumn > column) {
+    commitColumn(column);
+    // Nothing was sampled in between, the station was off or the clock moved
+    time_t missing = min((time_t) CHART_WIDTH, (sampleColumn - column) / CHART_COLUMN_SECONDS - 1);
+    for(time_t i = 1; i <= missing; i++)
+      commitColumn(column + i * CHART_COLUMN_SECONDS);
+  }
+  if(sampleColumn >= column)
+    column = sampleColumn;
+  for(int i = 0; i < CHART_COUNT; i++) {
+    chart* c = &charts[i];
+    float value = getSensorField(data, c->field);
+    if(isnan(value))
+      continue;
+    c->peakValue = c->samples == 0 ? value : max(c->peakValue, value);
+    c->sum += value;
+    c->samples++;
+    c->latest = value;
+  }
+  labelsDirty = true;
+}
+
+// Takes every sample added to the history since the last call
+void chart_feed() {
+  sensor_data data;
+  if(!ready)
+    return;
+  int count = history_count();
+  int first = count;
+  while(first > 0 && history_get(first - 1, &data) && data.timestamp > lastSeen)
+    first--;
+  for(int i = first; i < count; i++) {
+    if(!history_get(i, &data))
+      break;
+    addSample(&data);
+    lastSeen = data.timestamp;
+  }
+}
+
+// Switches the LCD to the charts, the next frames push them one by one
+void chart_show() {
+  visible = true;
+  labelsDirty = true;
+  for(int i = 0; i < CHART_COUNT; i++)
+    charts[i].dirty = true;
+  xSemaphoreTake(displayMutex, portMAX_DELAY);
+  M5.Lcd.fillRect(0, CHART_TOP - 4, M5.Lcd.width(), CHART_COUNT * CHART_SPACING, BLACK);
+  xSemaphoreGive(displayMutex);
+}
+
+static void drawLabels() {
+  char buf[12];
+  for(int i = 0; i < CHART_COUNT; i++) {
+    chart* c = &charts[i];
+    int y = CHART_TOP + i * CHART_SPACING;
+    M5.Lcd.fillRect(0, y, CHART_X - 2, CHART_HEIGHT, BLACK);
+    M5.Lcd.setTextColor(c->color, BLACK);
+    M5.Lcd.setCursor(0, y + CHART_HEIGHT / 2 - 8);
+    M5.Lcd.print(c->label);
+    snprintf(buf, sizeof(buf), "%.1f", c->latest);
+    M5.Lcd.setCursor(0, y + CHART_HEIGHT / 2 + 1);
+    M5.Lcd.print(isnan(c->latest) ? "-" : buf);
+    if(!isnan(c->lo)) {
+      M5.Lcd.setTextColor(DARKGREY, BLACK);
+      snprintf(buf, sizeof(buf), "%.1f", c->hi);
+      M5.Lcd.setCursor(0, y);
+      M5.Lcd.print(buf);
+      snprintf(buf, sizeof(buf), "%.1f", c->lo);
+      M5.Lcd.setCursor(0, y + CHART_HEIGHT - 8);
+      M5.Lcd.print(buf);
+    }
+  }
+  M5.Lcd.setTextColor(WHITE, BLACK);
+}
+
+// Called every frame while the charts are shown. Draws new columns, and pushes at most one chart whole
+void chart_draw() {
+  if(!ready || !visible)
+    return;
+  uint32_t started = micros();
+  xSemaphoreTake(displayMutex, portMAX_DELAY);
+  if(labelsDirty) {
+    drawLabels();
+    labelsDirty = false;
+  }
+  int pushed = -1;
+  for(int i = 0; i < CHART_COUNT; i++) {
+    chart* c = &charts[i];
+    int top = CHART_TOP + i * CHART_SPACING;
+    int behind = (head - c->drawnHead + CHART_WIDTH) % CHART_WIDTH;
+    if(!c->dirty && behind > CHART_CATCHUP_MAX)
+      c->dirty = true;
+    if(c->dirty) {
+      if(pushed >= 0)
+        continue;
+      sprites[i].pushSprite(CHART_X, top);
+      c->dirty = false;
+      c->drawnHead = head;
+      pushed = i;
+      continue;
+    }
+    // Only what changed since the last frame: the new columns, the cursor and the column after it
+    for(int x = c->drawnHead; x != head; x = (x + 1) % CHART_WIDTH)
+      drawColumn(&M5.Lcd, CHART_X, top, i, x);
+    if(behind > 0) {
+      drawColumn(&M5.Lcd, CHART_X, top, i, head);
+      drawColumn(&M5.Lcd, CHART_X, top, i, (head + 1) % CHART_WIDTH);
+      c->drawnHead = head;
+    }
+  }
+  xSemaphoreGive(displayMutex);
+  if(pushed >= 0)
+    LOG_DEBUG(LOG_MAIN, "Chart %s frame took %u us", charts[pushed].label, (unsigned) (micros() - started));
+}
+
+void chart_hide() {
+  visible = false;
+}
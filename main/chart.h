@@ -0,0 +1,12 @@
+// Plot area of each chart on the LCD, the labels go to its left
+#define CHART_X 44
+#define CHART_WIDTH 272
+#define CHART_HEIGHT 60
+// Seconds of data per pixel column, about three hours across
+#define CHART_COLUMN_SECONDS 40
+
+bool chart_init();
+void chart_feed();
+void chart_show();
+void chart_hide();
+void chart_draw();
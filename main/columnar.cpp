@@ -0,0 +1,463 @@
+/*
+  Columnar compaction of closed daily logs.
+
+  Once a day is over, the maintain_storage task converts weather-data_YYYY-MM-DD.csv into
+  weather-data_YYYY-MM-DD.col so readers only decode the columns they need. Layout:
+    header:  "WCOL", version, column count, rows per group (u16)
+    data:    row groups of COLUMN_GROUP_ROWS rows, each holding one chunk per column
+    footer:  one entry per chunk with its offset, length, row count, column, min, max and time range
+    trailer: entry count (u32), footer offset (u32), "WCOL"
+  Timestamps are stored as a varint followed by zigzag varint deltas. Fields are stored in
+  thousandths as zigzag varint deltas, well below the resolution of the sensors.
+  All integers are little endian.
+*/
+#include <M5Core2.h>
+#include <algorithm>
+#include "columnar.h"
+#include "storage.h"
+#include "helper.h"
+#include "global.h"
+#include "logger.h"
+
+#define COLUMN_VERSION 1
+#define COLUMN_FOOTER_ENTRY 28
+#define COLUMN_TRAILER 12
+#define COLUMN_CHUNK_MAX (COLUMN_GROUP_ROWS * 5)
+// Rows handed to a reader's callback at a time, from its own stack with columnMutex released
+#define COLUMN_DELIVER_ROWS 16
+
+typedef struct {
+  uint32_t offset;
+  uint16_t length;
+  uint16_t rows;
+  uint8_t column;
+  float min;
+  float max;
+  uint32_t time_start;
+  uint32_t time_end;
+} column_chunk;
+
+// Decoding buffers shared by the compaction task and readers, guarded by columnMutex
+static uint32_t groupTimes[COLUMN_GROUP_ROWS];
+static int32_t groupValues[SENSOR_FIELDS][COLUMN_GROUP_ROWS];
+static uint8_t chunkBuf[COLUMN_CHUNK_MAX];
+// Bumped whenever the buffers are overwritten, so a reader can tell if its group is still there
+static uint32_t bufferGeneration = 0;
+
+static void putU16(uint8_t* buf, uint16_t value) {
+  buf[0] = value & 0xff;
+  buf[1] = value >> 8;
+}
+
+static void putU32(uint8_t* buf, uint32_t value) {
+  for(int i = 0; i < 4; i++)
+    buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint16_t getU16(const uint8_t* buf) {
+  return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t getU32(const uint8_t* buf) {
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static size_t putVarint(uint8_t* buf, uint32_t value) {
+  size_t len = 0;
+  while(value >= 0x80) {
+    buf[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+  return len;
+}
+
+// Returns the amount of bytes consumed, 0 if the varint runs past the end of the buffer
+static size_t getVarint(const uint8_t* buf, size_t len, uint32_t* value) {
+  *value = 0;
+  for(size_t i = 0; i < len && i < 5; i++) {
+    *value |= (uint32_t) (buf[i] & 0x7f) << (7 * i);
+    if(!(buf[i] & 0x80))
+      return i + 1;
+  }
+  return 0;
+}
+
+static uint32_t zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static void serializeChunk(uint8_t* buf, const column_chunk* chunk) {
+  memset(buf, 0, COLUMN_FOOTER_ENTRY);
+  putU32(buf, chunk->offset);
+  putU16(buf + 4, chunk->length);
+  putU16(buf + 6, chunk->rows);
+  buf[8] = chunk->column;
+  memcpy(buf + 12, &chunk->min, 4);
+  memcpy(buf + 16, &chunk->max, 4);
+  putU32(buf + 20, chunk->time_start);
+  putU32(buf + 24, chunk->time_end);
+}
+
+static void deserializeChunk(const uint8_t* buf, column_chunk* chunk) {
+  chunk->offset = getU32(buf);
+  chunk->length = getU16(buf + 4);
+  chunk->rows = getU16(buf + 6);
+  chunk->column = buf[8];
+  memcpy(&chunk->min, buf + 12, 4);
+  memcpy(&chunk->max, buf + 16, 4);
+  chunk->time_start = getU32(buf + 20);
+  chunk->time_end = getU32(buf + 24);
+}
+
+void columnFilePath(time_t timestamp, char* buf, size_t len) {
+  struct tm date;
+  localtime_r(&timestamp, &date);
+  snprintf(buf, len, "/weather-data_%d-%02d-%02d.col", date.tm_year+1900,
+          date.tm_mon+1, date.tm_mday);
+}
+
+// Encodes the buffered row group and appends its chunks to the data file and footer entries to the index
+static bool writeGroup(File& out, File& index, int rows, uint32_t* chunks) {
+  uint8_t entry[COLUMN_FOOTER_ENTRY];
+  for(int column = 0; column < COLUMN_COUNT; column++) {
+    column_chunk chunk = {0};
+    size_t len = 0;
+    int32_t previous = 0;
+    int32_t low = INT32_MAX;
+    int32_t high = INT32_MIN;
+    for(int row = 0; row < rows; row++) {
+      int32_t value = column == 0 ? (int32_t) groupTimes[row] : groupValues[column - 1][row];
+      if(column == 0 && row == 0)
+        len += putVarint(chunkBuf + len, groupTimes[0]);
+      else
+        len += putVarint(chunkBuf + len, zigzag(value - previous));
+      previous = value;
+      low = std::min(low, value);
+      high = std::max(high, value);
+    }
+    chunk.offset = out.position();
+    chunk.length = len;
+    chunk.rows = rows;
+    chunk.column = column;
+    chunk.min = column == 0 ? low : low / 1000.0;
+    chunk.max = column == 0 ? high : high / 1000.0;
+    chunk.time_start = groupTimes[0];
+    chunk.time_end = groupTimes[rows - 1];
+    serializeChunk(entry, &chunk);
+    if(out.write(chunkBuf, len) != len || index.write(entry, sizeof(entry)) != sizeof(entry))
+      return false;
+    (*chunks)++;
+  }
+  return true;
+}
+
+/*
+  Converts the daily log holding the timestamp into its columnar file. The data and the footer are
+  written to temporary files and only renamed once complete, so a reader never sees a partial file.
+*/
+bool compactDataFile(time_t timestamp) {
+  char path[40];
+  char colPath[40];
+  char tmpPath[40];
+  char indexPath[40];
+  char line[256];
+  uint8_t header[8] = {'W', 'C', 'O', 'L', COLUMN_VERSION, COLUMN_COUNT};
+  uint8_t buf[COLUMN_FOOTER_ENTRY];
+  uint32_t chunks = 0;
+  int rows = 0;
+  bool ok = true;
+
+  dataFilePath(timestamp, path, sizeof(path));
+  columnFilePath(timestamp, colPath, sizeof(colPath));
+  strcpy(tmpPath, colPath);
+  strcpy(strrchr(tmpPath, '.'), ".ctmp");
+  strcpy(indexPath, colPath);
+  strcpy(strrchr(indexPath, '.'), ".itmp");
+  putU16(header + 6, COLUMN_GROUP_ROWS);
+
+  xSemaphoreTake(columnMutex, portMAX_DELAY);
+  bufferGeneration++;
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File in = SD.open(path, FILE_READ);
+  File out = SD.open(tmpPath, FILE_WRITE);
+  File index = SD.open(indexPath, FILE_WRITE);
+  xSemaphoreGive(storageMutex);
+  if(!in || !out || !index) {
+    LOG_ERROR(LOG_COLUMNAR, "Failed to open files to compact %s", path);
+    ok = false;
+  }
+  else {
+    out.write(header, sizeof(header));
+  }
+  while(ok) {
+    size_t read = readDataLine(in, line, sizeof(line));
+    if(read > 0) {
+      sensor_data data = deserializeSensorData(line);
+      if(!data.init)
+        continue;
+      groupTimes[rows] = data.timestamp;
+      for(int i = 0; i < SENSOR_FIELDS; i++)
+        groupValues[i][rows] = lroundf(getSensorField(&data, i) * 1000);
+      rows++;
+    }
+    if(rows == COLUMN_GROUP_ROWS || (read == 0 && rows > 0)) {
+      xSemaphoreTake(storageMutex, portMAX_DELAY);
+      ok = writeGroup(out, index, rows, &chunks);
+      xSemaphoreGive(storageMutex);
+      rows = 0;
+      // Let anything else that wants to run go first
+      vTaskDelay(1);
+    }
+    if(read == 0)
+      break;
+  }
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  if(ok) {
+    // Copy the footer entries after the data and finish with the trailer
+    uint32_t footerOffset = out.position();
+    index.close();
+    index = SD.open(indexPath, FILE_READ);
+    while(index.read(buf, sizeof(buf)) == sizeof(buf))
+      out.write(buf, sizeof(buf));
+    putU32(buf, chunks);
+    putU32(buf + 4, footerOffset);
+    memcpy(buf + 8, "WCOL", 4);
+    ok = out.write(buf, COLUMN_TRAILER) == COLUMN_TRAILER;
+  }
+  in.close();
+  out.close();
+  index.close();
+  SD.remove(indexPath);
+  if(ok)
+    ok = SD.rename(tmpPath, colPath);
+  else
+    SD.remove(tmpPath);
+  xSemaphoreGive(storageMutex);
+  xSemaphoreGive(columnMutex);
+  if(ok)
+    LOG_INFO(LOG_COLUMNAR, "Compacted %s into %s", path, colPath);
+  return ok;
+}
+
+// Decodes one chunk into the group buffers, returns false if it is corrupt
+static bool readChunk(File& file, const column_chunk* chunk, size_t* bytesRead) {
+  if(chunk->length > COLUMN_CHUNK_MAX || chunk->rows > COLUMN_GROUP_ROWS || chunk->column >= COLUMN_COUNT)
+    return false;
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  file.seek(chunk->offset);
+  size_t read = file.read(chunkBuf, chunk->length);
+  xSemaphoreGive(storageMutex);
+  *bytesRead += read;
+  if(read != chunk->length)
+    return false;
+  size_t pos = 0;
+  int32_t value = 0;
+  for(int row = 0; row < chunk->rows; row++) {
+    uint32_t raw;
+    size_t len = getVarint(chunkBuf + pos, chunk->length - pos, &raw);
+    if(len == 0)
+      return false;
+    pos += len;
+    value = (chunk->column == 0 && row == 0) ? (int32_t) raw : value + unzigzag(raw);
+    if(chunk->column == 0)
+      groupTimes[row] = value;
+    else
+      groupValues[chunk->column - 1][row] = value;
+  }
+  return true;
+}
+
+/*
+  Decodes the timestamps and the fields set in fieldMask of a row group into the group buffers,
+  holding columnMutex. Returns false if it is corrupt, and sets *rows to 0 if the footer shows it
+  has nothing within [from, to].
+*/
+static bool decodeGroup(File& file, uint32_t footerOffset, uint32_t group, time_t from, time_t to,
+                        uint8_t fieldMask, int* rows, size_t* bytesRead) {
+  uint8_t buf[COLUMN_FOOTER_ENTRY];
+  column_chunk chunk;
+  int count = 0;
+  *rows = 0;
+  // Footer entries are stored group by group, starting with the timestamp column
+  for(int column = 0; column < COLUMN_COUNT; column++) {
+    xSemaphoreTake(storageMutex, portMAX_DELAY);
+    file.seek(footerOffset + (group + column) * COLUMN_FOOTER_ENTRY);
+    bool ok = file.read(buf, sizeof(buf)) == sizeof(buf);
+    xSemaphoreGive(storageMutex);
+    *bytesRead += sizeof(buf);
+    if(!ok)
+      return false;
+    deserializeChunk(buf, &chunk);
+    if(column == 0) {
+      if((time_t) chunk.time_end < from || (time_t) chunk.time_start > to)
+        return true;
+      count = chunk.rows;
+    }
+    else if(!(fieldMask & (1 << (column - 1)))) {
+      continue;
+    }
+    if(chunk.rows != count || !readChunk(file, &chunk, bytesRead))
+      return false;
+  }
+  bufferGeneration++;
+  *rows = count;
+  return true;
+}
+
+/*
+  Reads the rows of a columnar file stamped within [*from, to], decoding only the timestamps and the
+  fields set in fieldMask (bit i for field i). Row groups outside the range are skipped using the footer.
+  Returns false if the file doesn't exist, has no valid trailer or turns out to be corrupt, so the
+  caller reads the day log instead. *from is moved past the last row delivered, which is where
+  that should start.
+
+  The callback may block on a queue or the network, so it runs with columnMutex released, a few
+  rows at a time copied out of the shared buffers. Should another reader or the compaction have
+  used the buffers meanwhile, the rest of the group is decoded again.
+*/
+bool columnar_read(const char* path, time_t* from, time_t to, uint8_t fieldMask,
+                   columnar_callback callback, void* ctx, size_t* bytesRead) {
+  uint8_t buf[COLUMN_TRAILER];
+  sensor_data slice[COLUMN_DELIVER_ROWS];
+  xSemaphoreTake(columnMutex, portMAX_DELAY);
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(path, FILE_READ);
+  bool ok = file && file.size() >= COLUMN_FOOTER_ENTRY + COLUMN_TRAILER;
+  if(ok) {
+    file.seek(file.size() - COLUMN_TRAILER);
+    ok = file.read(buf, COLUMN_TRAILER) == COLUMN_TRAILER && memcmp(buf + 8, "WCOL", 4) == 0;
+  }
+  xSemaphoreGive(storageMutex);
+  if(!ok) {
+    if(file)
+      file.close();
+    xSemaphoreGive(columnMutex);
+    return false;
+  }
+  *bytesRead += COLUMN_TRAILER;
+  uint32_t chunks = getU32(buf);
+  uint32_t footerOffset = getU32(buf + 4);
+
+  for(uint32_t group = 0; ok && group + COLUMN_COUNT <= chunks; group += COLUMN_COUNT) {
+    int rows;
+    ok = decodeGroup(file, footerOffset, group, *from, to, fieldMask, &rows, bytesRead);
+    uint32_t generation = bufferGeneration;
+    int row = 0;
+    while(ok && row < rows) {
+      if(bufferGeneration != generation) {
+        ok = decodeGroup(file, footerOffset, group, *from, to, fieldMask, &rows, bytesRead);
+        generation = bufferGeneration;
+        continue;
+      }
+      int count = 0;
+      for(; row < rows && count < COLUMN_DELIVER_ROWS; row++) {
+        if((time_t) groupTimes[row] < *from || (time_t) groupTimes[row] > to)
+          continue;
+        float values[SENSOR_FIELDS] = {0};
+        for(int i = 0; i < SENSOR_FIELDS; i++) {
+          if(fieldMask & (1 << i))
+            values[i] = groupValues[i][row] / 1000.0;
+        }
+        sensor_data* data = &slice[count++];
+        memset(data, 0, sizeof(*data));
+        data->timestamp = groupTimes[row];
+        data->rain_fall = values[0];
+        data->wind_speed = values[1];
+        data->wind_direction = values[2];
+        data->temperature = values[3];
+        data->humidity = values[4];
+        data->pressure = values[5];
+        data->init = true;
+      }
+      if(count == 0)
+        break;
+      xSemaphoreGive(columnMutex);
+      for(int i = 0; i < count; i++) {
+        callback(&slice[i], ctx);
+        *from = slice[i].timestamp + 1;
+      }
+      xSemaphoreTake(columnMutex, portMAX_DELAY);
+    }
+  }
+  file.close();
+  xSemaphoreGive(columnMutex);
+  if(!ok)
+    LOG_WARN(LOG_COLUMNAR, "Columnar file %s is corrupt, stopped reading", path);
+  return ok;
+}
+
+// Days whose compaction failed since boot, skipped until the next so one bad log doesn't hold up the rest
+#define COMPACT_FAILED_MAX 8
+static int failedDays[COMPACT_FAILED_MAX];
+static int failedCount = 0;
+
+static bool compactionFailed(int key) {
+  for(int i = 0; i < failedCount; i++) {
+    if(failedDays[i] == key)
+      return true;
+  }
+  return false;
+}
+
+/*
+  Finds the oldest daily log that is closed (any day before today), has no columnar file yet and
+  didn't fail to compact before. Returns false if there is none.
+*/
+static bool findUncompactedDay(time_t* timestamp, int* dayKey) {
+  char colPath[40];
+  struct tm today;
+  time_t now = getUnixTimestamp();
+  localtime_r(&now, &today);
+  int todayKey = (today.tm_year + 1900) * 10000 + (today.tm_mon + 1) * 100 + today.tm_mday;
+  int oldestKey = todayKey;
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File root = SD.open("/");
+  while(root) {
+    File entry = root.openNextFile();
+    if(!entry)
+      break;
+    const char* name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    int year, month, day;
+    if(sscanf(name, "weather-data_%d-%d-%d.csv", &year, &month, &day) == 3 && strstr(name, ".csv")) {
+      int key = year * 10000 + month * 100 + day;
+      struct tm date = {0};
+      date.tm_year = year - 1900;
+      date.tm_mon = month - 1;
+      date.tm_mday = day;
+      date.tm_hour = 12;
+      date.tm_isdst = -1;
+      time_t dayTime = mktime(&date);
+      columnFilePath(dayTime, colPath, sizeof(colPath));
+      if(key < oldestKey && !compactionFailed(key) && !SD.exists(colPath)) {
+        oldestKey = key;
+        *timestamp = dayTime;
+      }
+    }
+    entry.close();
+  }
+  if(root)
+    root.close();
+  xSemaphoreGive(storageMutex);
+  *dayKey = oldestKey;
+  return oldestKey < todayKey;
+}
+
+// Converts every closed day that has no columnar file yet, a day that fails is left to the day log
+void compactClosedDays() {
+  time_t timestamp;
+  int key;
+  while(findUncompactedDay(&timestamp, &key)) {
+    if(compactDataFile(timestamp))
+      continue;
+    if(failedCount == COMPACT_FAILED_MAX)
+      break;
+    failedDays[failedCount++] = key;
+  }
+}
@@ -0,0 +1,16 @@
+#include <stdint.h>
+#include <time.h>
+#include "record.h"
+
+// Rows per row group, every column of a group is encoded as one chunk
+#define COLUMN_GROUP_ROWS 256
+// Columns per row group, the timestamp followed by every sensor field
+#define COLUMN_COUNT (SENSOR_FIELDS + 1)
+
+typedef void (*columnar_callback)(const sensor_data* data, void* ctx);
+
+void columnFilePath(time_t timestamp, char* buf, size_t len);
+bool compactDataFile(time_t timestamp);
+bool columnar_read(const char* path, time_t* from, time_t to, uint8_t fieldMask,
+                   columnar_callback callback, void* ctx, size_t* bytesRead);
+void compactClosedDays();
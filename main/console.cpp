@@ -5,6 +5,17 @@
 #include "console.h"
 #include "network.h"
 #include "storage.h"
+#include "rollup.h"
+#include "query.h"
+#include "sink.h"
+#include "mqtt.h"
+#include "boot.h"
+#include "upload.h"
+#include "sampling.h"
+#include "logger.h"
+#include "webserver.h"
+#include "export.h"
+#include "tasks.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h"
 #include <M5Core2.h>
@@ -44,10 +55,67 @@ static struct {
   struct arg_end *end;
 } setRTC_args;
 
+static struct {
+  struct arg_str *timestamp_start;
+  struct arg_str *timestamp_end;
+  struct arg_end *end;
+} rebuildRollups_args;
+
+static struct {
+  struct arg_str *timestamp_start;
+  struct arg_str *timestamp_end;
+  struct arg_int *bucket;
+  struct arg_str *fields;
+  struct arg_str *aggregates;
+  struct arg_end *end;
+} query_args;
+
+static struct {
+  struct arg_str *prealloc;
+  struct arg_int *minfree;
+  struct arg_end *end;
+} setStorage_args;
+
+static struct {
+  struct arg_int *min;
+  struct arg_int *max;
+  struct arg_dbl *rain;
+  struct arg_dbl *pressure;
+  struct arg_dbl *gust;
+  struct arg_int *hold;
+  struct arg_end *end;
+} setSampling_args;
+
+static struct {
+  struct arg_str *module;
+  struct arg_str *level;
+  struct arg_end *end;
+} log_args;
+
+static struct {
+  struct arg_str *timestamp_start;
+  struct arg_str *timestamp_end;
+  struct arg_int *baud;
+  struct arg_int *offset;
+  struct arg_end *end;
+} exportSerial_args;
+
+static struct {
+  struct arg_str *profile;
+  struct arg_end *end;
+} tasks_args;
+
+static struct {
+  struct arg_str *action;
+  struct arg_str *args;
+  struct arg_end *end;
+} sink_args;
+
 
 void init_console() {
   esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
   esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+  repl_config.task_stack_size = 8192; // query and rebuildRollups keep line buffers on the stack
 
   esp_console_new_repl_uart(&uart_config, &repl_config, &repl);
   esp_console_register_help_command();
@@ -58,6 +126,16 @@ void init_console() {
   register_setFreq_cmd();
   register_recoverData_cmd();
   register_setRTC_cmd();
+  register_rebuildRollups_cmd();
+  register_query_cmd();
+  register_setStorage_cmd();
+  register_sink_cmd();
+  register_boot_cmd();
+  register_resync_cmd();
+  register_setSampling_cmd();
+  register_log_cmd();
+  register_exportSerial_cmd();
+  register_tasks_cmd();
 }
 
 /* 
@@ -97,6 +175,9 @@ static int setWifi_impl(int argc, char** argv) {
     return 1;
   }
   printf("Configured wifi\n");
+  // Exports and the live feed are served on whichever interface came up
+  if(!start_webserver())
+    printf("Failed to start HTTP server\n");
   return 0;
 }
 
@@ -123,8 +204,15 @@ static int setDB_impl(int argc, char** argv) {
   }
   printf("Connecting to DB with ip '%s' and port %d\n",
            setDB_args.ip->sval[0], setDB_args.port->ival[0]);
-           
-  start_http_server(setDB_args.ip->sval[0], setDB_args.port->ival[0]);
+
+  influx_config config;
+  influxDefaults(&config);
+  strncpy(config.host, setDB_args.ip->sval[0], sizeof(config.host) - 1);
+  config.port = setDB_args.port->ival[0];
+  if(!start_influx_sink(&config)) {
+    printf("Failed to start InfluxDB sink\n");
+    return 1;
+  }
   return 0;
 }
 
@@ -155,7 +243,16 @@ static int setFreq_impl(int argc, char** argv) {
   }
   printf("Changing data storage frequency to %d\n",
            setFreq_args.time->ival[0]);
-           
+  if(setFreq_args.time->ival[0] < 1 || setFreq_args.time->ival[0] > UINT16_MAX) {
+    printf("Frequency must be between 1 and %d seconds\n", UINT16_MAX);
+    return 1;
+  }
+  // A fixed rate is an adaptive policy that can't move
+  sampling_policy policy;
+  sampling_get_policy(&policy);
+  policy.minInterval = setFreq_args.time->ival[0];
+  policy.maxInterval = setFreq_args.time->ival[0];
+  sampling_set_policy(&policy);
   if(xTimerChangePeriod(threadTimer, pdMS_TO_TICKS(setFreq_args.time->ival[0] * 1000), 300) == pdFAIL) {
     printf("Failed to change timer period\n");
     return 1;
@@ -257,4 +354,462 @@ void register_setRTC_cmd() {
   };
 
   esp_console_cmd_register(&setRTC_cmd);
-}
\ No newline at end of file
+}
+
+/*
+  Implementation of rebuildRollups command. Regenerates the minute/hour/day rollups from the raw logs
+*/
+static int rebuildRollups_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &rebuildRollups_args);
+  if (err != 0) {
+      arg_print_errors(stderr, rebuildRollups_args.end, argv[0]);
+      return 1;
+  }
+  time_t timestamp_start;
+  time_t timestamp_end;
+  if(!parseTimestamp(rebuildRollups_args.timestamp_start->sval[0], &timestamp_start)) {
+    printf("Malformed start timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  if(!parseTimestamp(rebuildRollups_args.timestamp_end->sval[0], &timestamp_end)) {
+    printf("Malformed end timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  printf("Rebuilding rollups between %s and %s\n",
+           rebuildRollups_args.timestamp_start->sval[0],
+           rebuildRollups_args.timestamp_end->sval[0]);
+  rebuildRollups(timestamp_start, timestamp_end);
+  return 0;
+}
+
+void register_rebuildRollups_cmd() {
+  rebuildRollups_args.timestamp_start = arg_str1(NULL, NULL, "<time_start>", "Beginning timestamp, in YYYY/MM/DD HH:MM:SS format");
+  rebuildRollups_args.timestamp_end = arg_str1(NULL, NULL, "<time_end>", "Ending timestamp, in YYYY/MM/DD HH:MM:SS format");
+  rebuildRollups_args.end = arg_end(2);
+
+  esp_console_cmd_t rebuildRollups_cmd {
+    .command = "rebuildRollups",
+    .help = "Rebuild the minute/hour/day rollup files from the data stored in the SD card",
+    .hint = NULL,
+    .func = &rebuildRollups_impl,
+    .argtable = &rebuildRollups_args
+  };
+
+  esp_console_cmd_register(&rebuildRollups_cmd);
+}
+
+/*
+  Implementation of query command. Aggregates the stored data in fixed width buckets and prints it as CSV
+*/
+static int query_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &query_args);
+  if (err != 0) {
+      arg_print_errors(stderr, query_args.end, argv[0]);
+      return 1;
+  }
+  query_spec spec;
+  if(!parseTimestamp(query_args.timestamp_start->sval[0], &spec.start)) {
+    printf("Malformed start timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  if(!parseTimestamp(query_args.timestamp_end->sval[0], &spec.end)) {
+    printf("Malformed end timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  spec.bucket = query_args.bucket->ival[0];
+  if(spec.bucket <= 0 || spec.end < spec.start) {
+    printf("Invalid time range or bucket width\n");
+    return 1;
+  }
+  if(!parseQueryFields(query_args.fields->sval[0], &spec) ||
+     !parseQueryAggregates(query_args.aggregates->sval[0], &spec)) {
+    return 1;
+  }
+  runQuery(&spec);
+  return 0;
+}
+
+void register_query_cmd() {
+  query_args.timestamp_start = arg_str1(NULL, NULL, "<time_start>", "Beginning timestamp, in YYYY/MM/DD HH:MM:SS format");
+  query_args.timestamp_end = arg_str1(NULL, NULL, "<time_end>", "Ending timestamp, in YYYY/MM/DD HH:MM:SS format");
+  query_args.bucket = arg_int1(NULL, NULL, "<bucket>", "Bucket width, in seconds");
+  query_args.fields = arg_str1(NULL, NULL, "<fields>", "Comma separated field names, or 'all'");
+  query_args.aggregates = arg_str1(NULL, NULL, "<aggregates>", "Comma separated list of min, max, mean, sum (not for rain_fall) and last");
+  query_args.end = arg_end(2);
+
+  esp_console_cmd_t query_cmd {
+    .command = "query",
+    .help = "Aggregate the stored data within the timestamp range and print it as CSV",
+    .hint = NULL,
+    .func = &query_impl,
+    .argtable = &query_args
+  };
+
+  esp_console_cmd_register(&query_cmd);
+}
+
+/*
+  Implementation of setStorage command. Configures log preallocation and the free space kept on the SD card
+*/
+static int setStorage_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &setStorage_args);
+  if (err != 0) {
+      arg_print_errors(stderr, setStorage_args.end, argv[0]);
+      return 1;
+  }
+  bool prealloc;
+  if(strcasecmp(setStorage_args.prealloc->sval[0], "on") == 0) {
+    prealloc = true;
+  }
+  else if(strcasecmp(setStorage_args.prealloc->sval[0], "off") == 0) {
+    prealloc = false;
+  }
+  else {
+    printf("Preallocation must be either 'on' or 'off'\n");
+    return 1;
+  }
+  if(setStorage_args.minfree->ival[0] < 0) {
+    printf("Minimum free space can't be negative\n");
+    return 1;
+  }
+  printf("Setting preallocation %s, keeping %d MB free\n",
+           prealloc ? "on" : "off", setStorage_args.minfree->ival[0]);
+  setStoragePolicy(prealloc, setStorage_args.minfree->ival[0]);
+  return 0;
+}
+
+void register_setStorage_cmd() {
+  setStorage_args.prealloc = arg_str1(NULL, NULL, "<on|off>", "Preallocate each day's log ahead of time");
+  setStorage_args.minfree = arg_int1(NULL, NULL, "<minfree>", "Free space to keep, in MB. Oldest days are deleted below it");
+  setStorage_args.end = arg_end(2);
+
+  esp_console_cmd_t setStorage_cmd {
+    .command = "setStorage",
+    .help = "Configure log preallocation and automatic space management",
+    .hint = NULL,
+    .func = &setStorage_impl,
+    .argtable = &setStorage_args
+  };
+
+  esp_console_cmd_register(&setStorage_cmd);
+}
+
+/*
+  Implementation of sink command. Lists, adds and removes output destinations at runtime
+*/
+static int sink_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &sink_args);
+  if (err != 0) {
+      arg_print_errors(stderr, sink_args.end, argv[0]);
+      return 1;
+  }
+  const char* action = sink_args.action->sval[0];
+  int count = sink_args.args->count;
+  const char** args = sink_args.args->sval;
+  if(strcmp(action, "list") == 0) {
+    sink_list();
+    return 0;
+  }
+  if(strcmp(action, "remove") == 0 && count == 1) {
+    if(!sink_remove(args[0])) {
+      printf("No sink named '%s'\n", args[0]);
+      return 1;
+    }
+    printf("Removing sink '%s'\n", args[0]);
+    return 0;
+  }
+  if(strcmp(action, "add") == 0 && count >= 1) {
+    bool started = false;
+    if(strcmp(args[0], "csv") == 0 && count == 1) {
+      started = start_csv_sink();
+    }
+    else if(strcmp(args[0], "influx") == 0 && count >= 3) {
+      // influx <host> <port> [org] [bucket] [token]
+      influx_config config;
+      influxDefaults(&config);
+      strncpy(config.host, args[1], sizeof(config.host) - 1);
+      config.port = atoi(args[2]);
+      if(count > 3)
+        strncpy(config.org, args[3], sizeof(config.org) - 1);
+      if(count > 4)
+        strncpy(config.bucket, args[4], sizeof(config.bucket) - 1);
+      if(count > 5)
+        strncpy(config.token, args[5], sizeof(config.token) - 1);
+      started = start_influx_sink(&config);
+    }
+    else if(strcmp(args[0], "mqtt") == 0 && count >= 3) {
+      // mqtt <host> <port> [topic] [window] [records per message]
+      mqtt_config config;
+      mqttDefaults(&config);
+      strncpy(config.host, args[1], sizeof(config.host) - 1);
+      config.port = atoi(args[2]);
+      if(count > 3)
+        strncpy(config.topic, args[3], sizeof(config.topic) - 1);
+      if(count > 4)
+        config.window = constrain(atoi(args[4]), 1, MQTT_OUTBOX);
+      if(count > 5)
+        config.recordsPerMessage = constrain(atoi(args[5]), 1, MQTT_RECORDS_MAX);
+      started = start_mqtt_sink(&config);
+    }
+    else if(strcmp(args[0], "udp") == 0 && count >= 3) {
+      // udp <host> <port> [location]
+      udp_config config;
+      memset(&config, 0, sizeof(config));
+      strncpy(config.host, args[1], sizeof(config.host) - 1);
+      config.port = atoi(args[2]);
+      strncpy(config.location, count > 3 ? args[3] : "test", sizeof(config.location) - 1);
+      started = start_udp_sink(&config);
+    }
+    else {
+      printf("Usage: sink add csv | sink add influx <host> <port> [org] [bucket] [token]"
+             " | sink add mqtt <host> <port> [topic] [window] [records] | sink add udp <host> <port> [location]\n");
+      return 1;
+    }
+    if(!started) {
+      printf("Failed to add sink '%s'\n", args[0]);
+      return 1;
+    }
+    printf("Added sink '%s'\n", args[0]);
+    return 0;
+  }
+  printf("Usage: sink list | sink add <type> [args...] | sink remove <name>\n");
+  return 1;
+}
+
+void register_sink_cmd() {
+  sink_args.action = arg_str1(NULL, NULL, "<list|add|remove>", "Action to perform");
+  sink_args.args = arg_strn(NULL, NULL, "<args>", 0, 6, "Sink type and its settings, or the name of the sink to remove");
+  sink_args.end = arg_end(2);
+
+  esp_console_cmd_t sink_cmd {
+    .command = "sink",
+    .help = "Manage output destinations (CSV log, InfluxDB, MQTT, UDP, and the web server's live feed, which can only be listed or removed)",
+    .hint = NULL,
+    .func = &sink_impl,
+    .argtable = &sink_args
+  };
+
+  esp_console_cmd_register(&sink_cmd);
+}
+
+/*
+  Implementation of boot command. Shows how long after power on each boot stage was reached
+*/
+static int boot_impl(int argc, char** argv) {
+  boot_report();
+  return 0;
+}
+
+void register_boot_cmd() {
+  esp_console_cmd_t boot_cmd {
+    .command = "boot",
+    .help = "Shows boot stage timings, including time to first sample",
+    .hint = NULL,
+    .func = &boot_impl,
+    .argtable = NULL
+  };
+
+  esp_console_cmd_register(&boot_cmd);
+}
+
+/*
+  Implementation of resync command. Replays only the intervals InfluxDB never acknowledged
+*/
+static int resync_impl(int argc, char** argv) {
+  upload_report();
+  if(upload_resync())
+    printf("Resync started\n");
+  return 0;
+}
+
+void register_resync_cmd() {
+  esp_console_cmd_t resync_cmd {
+    .command = "resync",
+    .help = "Shows the upload watermark and replays the gaps InfluxDB never acknowledged",
+    .hint = NULL,
+    .func = &resync_impl,
+    .argtable = NULL
+  };
+
+  esp_console_cmd_register(&resync_cmd);
+}
+
+/*
+  Implementation of setSampling command. Configures the adaptive sampling policy, or shows it
+*/
+static int setSampling_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &setSampling_args);
+  if (err != 0) {
+      arg_print_errors(stderr, setSampling_args.end, argv[0]);
+      return 1;
+  }
+  sampling_policy policy;
+  sampling_get_policy(&policy);
+  if(setSampling_args.min->count) {
+    int min = setSampling_args.min->ival[0];
+    int max = setSampling_args.max->count ? setSampling_args.max->ival[0] : policy.maxInterval;
+    if(min < 1 || max < min || max > UINT16_MAX) {
+      printf("Intervals must satisfy 1 <= min <= max <= %d seconds\n", UINT16_MAX);
+      return 1;
+    }
+    policy.minInterval = min;
+    policy.maxInterval = max;
+    if(setSampling_args.rain->count)
+      policy.rainStep = setSampling_args.rain->dval[0];
+    if(setSampling_args.pressure->count)
+      policy.pressureDrop = setSampling_args.pressure->dval[0];
+    if(setSampling_args.gust->count)
+      policy.gust = setSampling_args.gust->dval[0];
+    if(setSampling_args.hold->count)
+      policy.hold = constrain(setSampling_args.hold->ival[0], 0, UINT16_MAX);
+    sampling_set_policy(&policy);
+    if(xTimerChangePeriod(threadTimer, pdMS_TO_TICKS(sampling_interval() * 1000), 300) == pdFAIL) {
+      printf("Failed to change timer period\n");
+      return 1;
+    }
+  }
+  printf("Sampling every %u s, between %u and %u s\n", (unsigned) sampling_interval(),
+         (unsigned) policy.minInterval, (unsigned) policy.maxInterval);
+  printf("Fast while rain >= %.2f mm, pressure falling >= %.2f hPa/h or gusts >= %.1f km/h, held %u s\n",
+         policy.rainStep, policy.pressureDrop, policy.gust, (unsigned) policy.hold);
+  return 0;
+}
+
+void register_setSampling_cmd() {
+  setSampling_args.min = arg_int0(NULL, NULL, "<min>", "Seconds between samples while active");
+  setSampling_args.max = arg_int0(NULL, NULL, "<max>", "Seconds between samples when calm");
+  setSampling_args.rain = arg_dbl0(NULL, NULL, "<rain>", "Rainfall between samples that triggers fast sampling, in mm");
+  setSampling_args.pressure = arg_dbl0(NULL, NULL, "<pressure>", "Pressure fall rate that triggers fast sampling, in hPa per hour");
+  setSampling_args.gust = arg_dbl0(NULL, NULL, "<gust>", "Wind speed above its mean that triggers fast sampling, in km/h");
+  setSampling_args.hold = arg_int0(NULL, NULL, "<hold>", "Seconds to keep sampling fast after the last trigger");
+  setSampling_args.end = arg_end(2);
+
+  esp_console_cmd_t setSampling_cmd {
+    .command = "setSampling",
+    .help = "Configure adaptive sampling, shows the current policy without arguments",
+    .hint = NULL,
+    .func = &setSampling_impl,
+    .argtable = &setSampling_args
+  };
+
+  esp_console_cmd_register(&setSampling_cmd);
+}
+
+/*
+  Implementation of log command. Shows or changes the level of each logging module
+*/
+static int log_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &log_args);
+  if (err != 0) {
+      arg_print_errors(stderr, log_args.end, argv[0]);
+      return 1;
+  }
+  if(log_args.module->count != log_args.level->count) {
+    printf("Usage: log [<module|all> <none|error|warn|info|debug>]\n");
+    return 1;
+  }
+  if(log_args.module->count && !log_set_level(log_args.module->sval[0], log_args.level->sval[0])) {
+    printf("Unknown module '%s' or level '%s'\n", log_args.module->sval[0], log_args.level->sval[0]);
+    return 1;
+  }
+  log_report();
+  return 0;
+}
+
+void register_log_cmd() {
+  log_args.module = arg_str0(NULL, NULL, "<module>", "Module to change, or 'all'");
+  log_args.level = arg_str0(NULL, NULL, "<level>", "none, error, warn, info or debug");
+  log_args.end = arg_end(2);
+
+  esp_console_cmd_t log_cmd {
+    .command = "log",
+    .help = "Shows logging levels and dropped messages, or sets the level of a module",
+    .hint = NULL,
+    .func = &log_impl,
+    .argtable = &log_args
+  };
+
+  esp_console_cmd_register(&log_cmd);
+}
+
+/*
+  Implementation of exportSerial command. Streams stored data over this console in binary frames,
+  relies on export.cpp. Meant to be run by tools/uart_receive rather than typed
+*/
+static int exportSerial_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &exportSerial_args);
+  if (err != 0) {
+      arg_print_errors(stderr, exportSerial_args.end, argv[0]);
+      return 1;
+  }
+  time_t start, end;
+  if(!parseTimestamp(exportSerial_args.timestamp_start->sval[0], &start)) {
+    printf("Malformed start timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  if(!parseTimestamp(exportSerial_args.timestamp_end->sval[0], &end)) {
+    printf("Malformed end timestamp, could not convert to UNIX timestamp\n");
+    return 1;
+  }
+  int baud = exportSerial_args.baud->count ? exportSerial_args.baud->ival[0] : EXPORT_BAUD;
+  int offset = exportSerial_args.offset->count ? exportSerial_args.offset->ival[0] : 0;
+  if(end < start || baud <= 0 || offset < 0) {
+    printf("Invalid time range, baud rate or offset\n");
+    return 1;
+  }
+  return export_serial(start, end, offset, baud) ? 0 : 1;
+}
+
+void register_exportSerial_cmd() {
+  exportSerial_args.timestamp_start = arg_str1(NULL, NULL, "<time_start>", "Beginning timestamp, in YYYY/MM/DD HH:MM:SS format");
+  exportSerial_args.timestamp_end = arg_str1(NULL, NULL, "<time_end>", "Ending timestamp, in YYYY/MM/DD HH:MM:SS format");
+  exportSerial_args.baud = arg_int0("b", "baud", "<rate>", "Baud rate during the transfer, 921600 by default");
+  exportSerial_args.offset = arg_int0("o", "offset", "<records>", "Records already received, to resume a transfer");
+  exportSerial_args.end = arg_end(2);
+
+  esp_console_cmd_t exportSerial_cmd {
+    .command = "exportSerial",
+    .help = "Streams the stored data within the timestamp range over this console as compressed binary frames",
+    .hint = NULL,
+    .func = &exportSerial_impl,
+    .argtable = &exportSerial_args
+  };
+
+  esp_console_cmd_register(&exportSerial_cmd);
+}
+
+/*
+  Implementation of tasks command. Shows cores, priorities, stack and CPU use of every task, or
+  switches the task profile, relies on tasks.cpp
+*/
+static int tasks_impl(int argc, char** argv) {
+  int err = arg_parse(argc, argv, (void **) &tasks_args);
+  if (err != 0) {
+      arg_print_errors(stderr, tasks_args.end, argv[0]);
+      return 1;
+  }
+  if(tasks_args.profile->count) {
+    if(!tasks_select(tasks_args.profile->sval[0])) {
+      printf("Unknown task profile '%s'\n", tasks_args.profile->sval[0]);
+      return 1;
+    }
+    printf("Priorities changed now, cores apply to tasks started from now on and after a restart\n");
+  }
+  tasks_report();
+  return 0;
+}
+
+void register_tasks_cmd() {
+  tasks_args.profile = arg_str0(NULL, NULL, "<profile>", "Task profile to switch to: default, sampling or recovery");
+  tasks_args.end = arg_end(1);
+
+  esp_console_cmd_t tasks_cmd {
+    .command = "tasks",
+    .help = "Shows core, priority, free stack and CPU time of every task, or switches the task profile",
+    .hint = NULL,
+    .func = &tasks_impl,
+    .argtable = &tasks_args
+  };
+
+  esp_console_cmd_register(&tasks_cmd);
+}
@@ -4,3 +4,13 @@ void register_setDB_cmd();
 void register_setFreq_cmd();
 void register_recoverData_cmd();
 void register_setRTC_cmd();
+void register_rebuildRollups_cmd();
+void register_query_cmd();
+void register_setStorage_cmd();
+void register_sink_cmd();
+void register_boot_cmd();
+void register_resync_cmd();
+void register_setSampling_cmd();
+void register_log_cmd();
+void register_exportSerial_cmd();
+void register_tasks_cmd();
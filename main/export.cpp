@@ -0,0 +1,131 @@
+/*
+  Serial export, for getting data off a station with no working network without pulling the card.
+
+  Streams every logged sample in a time range over the console UART as transfer frames (see
+  transfer.cpp), at a raised baud rate. The console prints one line announcing the rate and the
+  resume offset, waits a moment for the receiver to switch, and goes back to its own rate after
+  the end frame. Log output is held back meanwhile so it doesn't land in the middle of a frame.
+  Anything else printed during the transfer is skipped by the receiver, which resynchronizes on
+  the next frame.
+
+  The offset counts records from the start of the range, so an interrupted transfer is resumed by
+  asking for the same range from the last record received.
+*/
+#include <M5Core2.h>
+#include "driver/uart.h"
+#include "export.h"
+#include "transfer.h"
+#include "storage.h"
+#include "columnar.h"
+#include "helper.h"
+#include "logger.h"
+#include "global.h"
+
+#define EXPORT_PORT ((uart_port_t) CONFIG_ESP_CONSOLE_UART_NUM)
+// Time given to the receiver to switch rates, in milliseconds
+#define EXPORT_SWITCH_DELAY 500
+
+typedef struct {
+  uint32_t index;  // Records seen so far in the range
+  uint32_t offset; // Records before this one were already received
+  int count;
+  uint32_t frames;
+  size_t bytes;
+  sensor_data batch[TRANSFER_RECORDS_MAX];
+} export_state;
+
+// Only the console runs exports, one at a time
+static export_state state;
+static uint8_t frame[TRANSFER_FRAME_MAX];
+
+static void sendFrame(size_t len) {
+  uart_write_bytes(EXPORT_PORT, frame, len);
+  state.frames++;
+  state.bytes += len;
+}
+
+static void flushBatch() {
+  if(state.count == 0)
+    return;
+  sendFrame(transfer_data(state.index - state.count, state.batch, state.count, frame, sizeof(frame)));
+  state.count = 0;
+}
+
+static void addRecord(const sensor_data* data, void* _) {
+  if(state.index++ < state.offset)
+    return;
+  state.batch[state.count++] = *data;
+  if(state.count == TRANSFER_RECORDS_MAX)
+    flushBatch();
+}
+
+// Every logged sample in [from, to], one day file at a time
+static void sendRange(time_t from, time_t to) {
+  char readBuffer[256];
+  struct tm date;
+  localtime_r(&from, &date);
+  time_t timestamp = from;
+  while(timestamp <= to) {
+    size_t bytes = 0;
+    columnFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    bool columnar = columnar_read(readBuffer, &timestamp, to, 0xFF, &addRecord, NULL, &bytes);
+    dataFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    File file = columnar ? File() : SD.open(readBuffer, FILE_READ);
+    if(file) {
+      seekDataFile(file, timestamp);
+      while(readDataLine(file, readBuffer, sizeof(readBuffer)) > 0) {
+        sensor_data data = deserializeSensorData(readBuffer);
+        if(!data.init || data.timestamp < timestamp)
+          continue;
+        if(data.timestamp > to)
+          break;
+        addRecord(&data, NULL);
+      }
+      file.close();
+    }
+    // Advance day by 1 and set time to 0
+    date.tm_mday += 1;
+    date.tm_sec = 0;
+    date.tm_min = 0;
+    date.tm_hour = 0;
+    date.tm_isdst = -1;
+    timestamp = mktime(&date);
+  }
+  flushBatch();
+}
+
+bool export_serial(time_t from, time_t to, uint32_t offset, uint32_t baud) {
+  uint32_t consoleBaud = 0;
+  if(uart_get_baudrate(EXPORT_PORT, &consoleBaud) != ESP_OK) {
+    printf("Couldn't read the console baud rate\n");
+    return false;
+  }
+  memset(&state, 0, sizeof(state));
+  state.offset = offset;
+
+  printf("Sending %ld to %ld from record %u at %u baud\n", (long) from, (long) to, (unsigned) offset, (unsigned) baud);
+  fflush(stdout);
+  log_hold(true);
+  uart_wait_tx_done(EXPORT_PORT, pdMS_TO_TICKS(1000));
+  delay(EXPORT_SWITCH_DELAY);
+  uart_set_baudrate(EXPORT_PORT, baud);
+  delay(EXPORT_SWITCH_DELAY);
+
+  uint32_t started = millis();
+  sendFrame(transfer_start(from, to, offset, frame, sizeof(frame)));
+  sendRange(from, to);
+  sendFrame(transfer_end(state.index, frame, sizeof(frame)));
+  uart_wait_tx_done(EXPORT_PORT, portMAX_DELAY);
+  uint32_t elapsed = millis() - started;
+
+  delay(EXPORT_SWITCH_DELAY);
+  uart_set_baudrate(EXPORT_PORT, consoleBaud);
+  log_hold(false);
+  if(elapsed == 0)
+    elapsed = 1;
+  uint32_t sent = state.index > offset ? state.index - offset : 0;
+  printf("Sent %u of %u records in %u frames, %u bytes in %u ms (%u B/s)\n", (unsigned) sent,
+         (unsigned) state.index, (unsigned) state.frames, (unsigned) state.bytes, (unsigned) elapsed,
+         (unsigned) ((uint64_t) state.bytes * 1000 / elapsed));
+  return true;
+}
@@ -0,0 +1,7 @@
+#include <stdint.h>
+#include <time.h>
+
+// Rate the console UART switches to for a transfer unless told otherwise
+#define EXPORT_BAUD 921600
+
+bool export_serial(time_t from, time_t to, uint32_t offset, uint32_t baud);
@@ -4,10 +4,9 @@
 //#define BME_ENABLE
 extern bool catchupActive;
 extern TimerHandle_t threadTimer;
-extern QueueHandle_t networkQueue;
-extern QueueHandle_t storageQueue;
 
 extern SemaphoreHandle_t displayMutex;
 extern SemaphoreHandle_t storageMutex;
+extern SemaphoreHandle_t columnMutex;
 extern SFEWeatherMeterKit weatherMeterKit;
 extern BME280I2C bme;
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <time.h>
 #include "helper.h"
 #include "global.h"
+#include "logger.h"
 #define screen_width 320
 #define screen_height 240
 #define char_width 8
@@ -31,18 +32,20 @@ void writeToScreen(int x, int y, char* str, uint16_t textColor, uint16_t bgColor
   xSemaphoreGive(displayMutex);
 }
 
+// Widest region that can be cleared, in characters
+#define CLEAR_MAX 64
+
 void clearRegion(int x, int y, int len) {
+  char buf[CLEAR_MAX + 1];
+  len = constrain(len, 0, CLEAR_MAX);
+  // Generate string with the correct amount of spaces
+  memset(buf, ' ', len);
+  buf[len] = '\0';
   xSemaphoreTake(displayMutex, portMAX_DELAY);
   M5.Lcd.setTextColor(WHITE, BLACK);
   M5.Lcd.setCursor(x,y);
-  // Generate string with the correct amount of spaces
-  char* buf = (char*) malloc(len+1);
-  memset(buf, ' ', len);
-  buf[len] = '\0'; 
-  
   M5.Lcd.print(buf);
   xSemaphoreGive(displayMutex);
-  free(buf);
 }
 
 // Retrieves unix time from the RTC
@@ -67,26 +70,31 @@ time_t getUnixTimestamp() {
 sensor_data deserializeSensorData(char* str) {
   sensor_data data = { .init = false };
   char* token;
-  char* tokenArray[7] = {0};
+  char* tokenArray[8] = {0};
   int i = 0;
   char* buf; // For strtok_r thread safety
-  // Split our string into 7 tokens (matching our struct)
+  // Torn or corrupted lines fail their CRC, so don't even try to parse them
+  if(!unframeRecord(str)) {
+    LOG_WARN(LOG_RECORD, "Torn or corrupt record");
+    return data;
+  }
+  // Split our string into 7 tokens (matching our struct), plus the interval in newer logs
   token = strtok_r(str, ",", &buf);
-  while(token != NULL && i < 7) {
+  while(token != NULL && i < 8) {
     tokenArray[i] = token;
     i++;
-    token = strtok_r(str, ",", &buf); 
+    token = strtok_r(NULL, ",", &buf);
   }
   // Not enough tokens for struct, malformed file? Return just incase
-  if(i != 7) { 
-    printf("Wrong amount of tokens\n");
+  if(i < 7) { 
+    LOG_WARN(LOG_RECORD, "Wrong amount of tokens");
     return data;
   }
   struct tm time = {0};
   time_t str_timestamp = 0;
   // Malformed date, so return without initializing.
   if(strptime(tokenArray[0], "%Y/%m/%d %H:%M:%S", &time) == NULL) {
-    printf("Malformed date %s\n", tokenArray[0]);
+    LOG_WARN(LOG_RECORD, "Malformed date %s", tokenArray[0]);
     return data;
   }
   time.tm_isdst = _daylight;
@@ -99,6 +107,7 @@ sensor_data deserializeSensorData(char* str) {
   data.temperature = atof(tokenArray[4]);
   data.humidity = atof(tokenArray[5]);
   data.pressure = atof(tokenArray[6]);
+  data.interval = i > 7 ? atoi(tokenArray[7]) : 0;
   data.init = true;
   return data;
 }
@@ -129,3 +138,14 @@ void setRTC(tm timeinfo) {
   M5.Rtc.SetDate(&RTC_DateStruct);
   M5.Rtc.SetTime(&RTC_TimeStruct);
 }
+
+// Parses a YYYY/MM/DD HH:MM:SS string into a UNIX timestamp
+bool parseTimestamp(const char* str, time_t* timestamp) {
+  struct tm time = {0};
+  if(strptime(str, "%Y/%m/%d %H:%M:%S", &time) == NULL) {
+    return false;
+  }
+  time.tm_isdst = _daylight;
+  *timestamp = mktime(&time);
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+/*
+  Ring buffer with the most recent samples, so recent data can be read without touching the SD card
+*/
+#include <M5Core2.h>
+#include "history.h"
+
+static sensor_data history[HISTORY_SIZE];
+static int historyHead = 0; // Next slot to be written
+static int historyCount = 0;
+static portMUX_TYPE historyLock = portMUX_INITIALIZER_UNLOCKED;
+
+void history_add(const sensor_data* data) {
+  portENTER_CRITICAL(&historyLock);
+  history[historyHead] = *data;
+  historyHead = (historyHead + 1) % HISTORY_SIZE;
+  if(historyCount < HISTORY_SIZE)
+    historyCount++;
+  portEXIT_CRITICAL(&historyLock);
+}
+
+int history_count() {
+  return historyCount;
+}
+
+// Copies the sample at the index, with 0 being the oldest one still in memory
+bool history_get(int index, sensor_data* data) {
+  bool found = false;
+  portENTER_CRITICAL(&historyLock);
+  if(index >= 0 && index < historyCount) {
+    *data = history[(historyHead - historyCount + index + HISTORY_SIZE) % HISTORY_SIZE];
+    found = true;
+  }
+  portEXIT_CRITICAL(&historyLock);
+  return found;
+}
@@ -0,0 +1,8 @@
+#include "record.h"
+
+// Number of samples kept in RAM, one hour at the default 10s period
+#define HISTORY_SIZE 360
+
+void history_add(const sensor_data* data);
+int history_count();
+bool history_get(int index, sensor_data* data);
@@ -0,0 +1,137 @@
+/*
+  Asynchronous leveled logging. Callers format into a lock-free ring buffer and return right away,
+  a low-priority task prints the messages to the UART. When the ring is full the message is
+  counted as dropped instead of making the caller wait.
+
+  The ring is a bounded multi-producer queue where every slot carries a sequence number: a
+  producer claims a slot by advancing the tail with a compare-and-swap, fills it and then
+  publishes it by bumping its sequence. The drain task is the only consumer.
+*/
+#include <M5Core2.h>
+#include <stdarg.h>
+#include "logger.h"
+
+// How long the drain task sleeps once the ring is empty, in milliseconds
+#define LOG_DRAIN_IDLE 50
+#define LOG_DRAIN_STACK 3072
+
+typedef struct {
+  uint32_t sequence;
+  uint32_t time;
+  uint8_t level;
+  uint8_t module;
+  char text[LOG_LINE_MAX];
+} log_slot;
+
+uint8_t logLevels[LOG_MODULES];
+
+static const char* moduleNames[LOG_MODULES] = {"main", "storage", "network", "sink", "wal", "columnar",
+                                               "rollup", "upload", "record", "http"};
+static const char* levelNames[] = {"none", "error", "warn", "info", "debug"};
+
+static log_slot ring[LOG_SLOTS];
+static uint32_t tail = 0; // Next slot to claim, shared by producers
+static uint32_t head = 0; // Next slot to print, only used by the drain task
+static uint32_t dropped = 0;
+static volatile bool held = false; // Messages wait in the ring while the console carries binary data
+static StaticTask_t drainTask;
+static StackType_t drainStack[LOG_DRAIN_STACK];
+
+void log_init() {
+  for(int i = 0; i < LOG_SLOTS; i++)
+    ring[i].sequence = i;
+  for(int i = 0; i < LOG_MODULES; i++)
+    logLevels[i] = LOG_LEVEL_INFO;
+  xTaskCreateStatic(log_drain, "log_drain", LOG_DRAIN_STACK, NULL, tskIDLE_PRIORITY, drainStack, &drainTask);
+}
+
+void log_write(uint8_t level, log_module module, const char* format, ...) {
+  uint32_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  log_slot* slot;
+  while(true) {
+    slot = &ring[pos & (LOG_SLOTS - 1)];
+    int32_t diff = (int32_t) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(diff < 0) {
+      // Still holds a message from a lap ago, the drain task is behind
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else {
+      pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf(slot->text, sizeof(slot->text), format, args);
+  va_end(args);
+  slot->time = millis();
+  slot->level = level;
+  slot->module = module;
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+void log_drain(void* _) {
+  uint32_t reported = 0;
+  while(true) {
+    log_slot* slot = &ring[head & (LOG_SLOTS - 1)];
+    if(held) {
+      delay(LOG_DRAIN_IDLE);
+      continue;
+    }
+    if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) {
+      uint32_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+      if(lost != reported) {
+        printf("[%lu] %u log messages dropped\n", millis(), (unsigned) (lost - reported));
+        reported = lost;
+      }
+      delay(LOG_DRAIN_IDLE);
+      continue;
+    }
+    printf("[%u] %c %s: %s\n", (unsigned) slot->time, toupper(levelNames[slot->level][0]),
+           moduleNames[slot->module], slot->text);
+    // Hand the slot back to producers for the next lap
+    __atomic_store_n(&slot->sequence, head + LOG_SLOTS, __ATOMIC_RELEASE);
+    head++;
+  }
+}
+
+// Stops printing until released, whatever doesn't fit in the ring meanwhile is counted as dropped
+void log_hold(bool hold) {
+  held = hold;
+}
+
+static int findName(const char* name, const char** names, int count) {
+  for(int i = 0; i < count; i++) {
+    if(strcasecmp(name, names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Sets the level of one module, or of every module with "all"
+bool log_set_level(const char* module, const char* level) {
+  int value = findName(level, levelNames, LOG_LEVEL_DEBUG + 1);
+  if(value < 0)
+    return false;
+  if(strcasecmp(module, "all") == 0) {
+    for(int i = 0; i < LOG_MODULES; i++)
+      logLevels[i] = value;
+    return true;
+  }
+  int index = findName(module, moduleNames, LOG_MODULES);
+  if(index < 0)
+    return false;
+  logLevels[index] = value;
+  return true;
+}
+
+void log_report() {
+  for(int i = 0; i < LOG_MODULES; i++)
+    printf("%-10s %s\n", moduleNames[i], levelNames[logLevels[i]]);
+  printf("Compiled up to %s, %u messages dropped\n", levelNames[LOG_LEVEL_MAX],
+         (unsigned) __atomic_load_n(&dropped, __ATOMIC_RELAXED));
+}
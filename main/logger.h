@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Messages above this level are compiled out entirely
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_INFO
+#endif
+
+// Messages waiting to be printed, must be a power of two
+#define LOG_SLOTS 32
+// Longest message, anything past it is cut
+#define LOG_LINE_MAX 96
+
+enum log_module {
+  LOG_MAIN,
+  LOG_STORAGE,
+  LOG_NETWORK,
+  LOG_SINK,
+  LOG_WAL,
+  LOG_COLUMNAR,
+  LOG_ROLLUP,
+  LOG_UPLOAD,
+  LOG_RECORD,
+  LOG_HTTP,
+  LOG_MODULES
+};
+
+// Runtime level of each module, read without locking by the macros below
+extern uint8_t logLevels[LOG_MODULES];
+
+#define LOG_AT(level, module, ...) do { \
+    if((level) <= LOG_LEVEL_MAX && (level) <= logLevels[module]) \
+      log_write(level, module, __VA_ARGS__); \
+  } while(0)
+
+#define LOG_ERROR(module, ...) LOG_AT(LOG_LEVEL_ERROR, module, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_AT(LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_AT(LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define LOG_DEBUG(module, ...) LOG_AT(LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+
+void log_init();
+void log_write(uint8_t level, log_module module, const char* format, ...) __attribute__((format(printf, 3, 4)));
+bool log_set_level(const char* module, const char* level);
+void log_report();
+void log_hold(bool hold);
+void log_drain(void* _);
@@ -26,17 +26,32 @@ https://github.com/sparkfun/SparkFun_Weather_Meter_Kit_Arduino_Library
 #include "console.h"
 #include "storage.h"
 #include "screen.h"
-
-// Timer periods in milliseconds
-#define TIMER_PERIOD 10 * 1000 
-
-// Queue size for threads
-#define STORAGE_QUEUE 50
-#define NETWORK_QUEUE 200
+#include "wal.h"
+#include "rollup.h"
+#include "sink.h"
+#include "history.h"
+#include "boot.h"
+#include "upload.h"
+#include "sampling.h"
+#include "logger.h"
+#include "tasks.h"
 
 // Mutexes
 SemaphoreHandle_t displayMutex = NULL;
 SemaphoreHandle_t storageMutex = NULL;
+SemaphoreHandle_t columnMutex = NULL;
+
+// Kernel objects are created from static memory so nothing is left on the heap to fragment
+#define DISPLAY_STACK 4096
+#define MAINTENANCE_STACK 4096
+static StaticSemaphore_t displayMutexBuffer;
+static StaticSemaphore_t storageMutexBuffer;
+static StaticSemaphore_t columnMutexBuffer;
+static StaticTimer_t threadTimerBuffer;
+static StaticTask_t displayTask;
+static StackType_t displayStack[DISPLAY_STACK];
+static StaticTask_t maintenanceTask;
+static StackType_t maintenanceStack[MAINTENANCE_STACK];
 
 // Weather station definitions
 int rain_fall_pin = 27;
@@ -59,10 +74,6 @@ BME280I2C bme(bmeSettings);
 
 bool catchupActive = false;
 TimerHandle_t threadTimer;
-TaskHandle_t networkThread;
-TaskHandle_t storageThread;
-QueueHandle_t storageQueue;
-QueueHandle_t networkQueue;
 
 #ifdef DEBUG
 extern float temp;
@@ -94,6 +105,7 @@ void timer_pushData(TimerHandle_t timer) {
     .temperature = temp,
     .humidity = hum,
     .pressure = pres,
+    .interval = sampling_interval(),
     .init = true,
   };
   #endif
@@ -109,20 +121,29 @@ void timer_pushData(TimerHandle_t timer) {
     //.temperature = 25 + ((rand() % 20)/10.0)-1,
     //.humidity = 50 + (rand() % 4)-2,
     //.pressure = 1010 + (rand() % 8) - 4,
+    .interval = sampling_interval(),
     .init = true,
   };
   #endif
-  xQueueSend(networkQueue, &data, 0);
-  xQueueSend(storageQueue, &data, 0);
+  history_add(&data);
+  sink_publish(&data);
+  boot_mark(BOOT_FIRST_SAMPLE);
+  boot_heap_check();
+
+  // Speed up or back off depending on what the sample shows
+  uint16_t next = sampling_update(&data);
+  if(next != data.interval && xTimerChangePeriod(timer, pdMS_TO_TICKS(next * 1000), 0) == pdFAIL)
+    LOG_ERROR(LOG_MAIN, "Failed to change sampling interval to %u s", (unsigned) next);
 }
 
 void setup() {
   configTime(-4 * 3600, 3600, NULL); // Not a good idea, but doing this temporarily
   M5.begin(true, true, false, true); //Init M5Core2.
+  log_init(); // Before anything logs
   init_screen();
   
   // Initialize display mutex
-  displayMutex = xSemaphoreCreateMutex();
+  displayMutex = xSemaphoreCreateMutexStatic(&displayMutexBuffer);
   if(displayMutex == NULL) {
     printf("Failed to initialize display mutex! Aborting...\n");
     return;
@@ -130,20 +151,36 @@ void setup() {
   xSemaphoreGive(displayMutex);
 
   // Initialize storage mutex
-  storageMutex = xSemaphoreCreateMutex();
+  storageMutex = xSemaphoreCreateMutexStatic(&storageMutexBuffer);
   if(storageMutex == NULL) {
     printf("Failed to initialize storage mutex! Aborting...\n");
     return;
   }
   xSemaphoreGive(storageMutex);
 
-  init_console();
-  int err = 0;
-  esp_console_run("setWifi ap m5core2 password1234", &err);
-  if(err) {
-    writeToScreen(M5.Lcd.width(), M5.Lcd.height()-10, "Couldn't start AP", RED, BLACK, right);
-  };
-  esp_console_run("setDB 192.168.4.2 8086", &err);
+  // Initialize columnar file mutex
+  columnMutex = xSemaphoreCreateMutexStatic(&columnMutexBuffer);
+  if(columnMutex == NULL) {
+    printf("Failed to initialize columnar file mutex! Aborting...\n");
+    return;
+  }
+  xSemaphoreGive(columnMutex);
+
+  // Cores and priorities of the saved task profile, before any of its tasks start
+  tasks_init();
+
+  // Drop any line torn by a power loss before anything is appended to the log
+  wal_recover();
+  // The running rollups pick up where the log left off
+  rollup_recover();
+  upload_init();
+
+  // Output destinations, InfluxDB is added once the network is up
+  init_sinks();
+  if(!start_csv_sink()) {
+    printf("CRITICAL: Failed to start CSV sink!\n");
+  }
+  boot_mark(BOOT_STORAGE);
 
   #ifdef SFE_WMK_PLAFTORM_UNKNOWN
     weatherMeterKit.setADCResolutionBits(10);
@@ -152,7 +189,8 @@ void setup() {
   weatherMeterKit.begin();
 
   #ifdef BME_ENABLE
-    while(!bme.begin())
+    // Bounded, a missing sensor reads as zeros rather than holding up sampling
+    for(int attempt = 0; attempt < 5 && !bme.begin(); attempt++)
     {
       printf("Could not find BME280 sensor!\n");
       delay(1000);
@@ -171,21 +209,21 @@ void setup() {
     }
   #endif
 
-  // Initialize queues for storage and network threads
-  storageQueue = xQueueCreate(STORAGE_QUEUE, sizeof(sensor_data));
-  networkQueue = xQueueCreate(NETWORK_QUEUE, sizeof(sensor_data));
-
-  if(storageQueue == NULL || networkQueue == NULL) {
-    printf("CRITICAL: Failed to initialize queue, not enough memory!\n");
-  }
-  xTaskCreate(display_screen, "display_screen", 4096, NULL, 1, NULL); // Render screen
-  xTaskCreate(store_data, "store_data", 4096, NULL, 2, &storageThread); // Write to SD
-  xTaskCreate(upload_data, "upload_data", 4096*2, NULL, 3, &networkThread); // Write to web server
-
-  threadTimer = xTimerCreate("threadTimer", pdMS_TO_TICKS(TIMER_PERIOD), pdTRUE, (void*) 0, timer_pushData);
+  threadTimer = xTimerCreateStatic("threadTimer", pdMS_TO_TICKS(sampling_interval() * 1000), pdTRUE, (void*) 0, timer_pushData,
+                                   &threadTimerBuffer);
   if(xTimerStart(threadTimer, 100) == pdFAIL) {
     printf("CRITICAL: Failed to start thread timer!\n");
   }
+  boot_mark(BOOT_SAMPLING);
+  timer_pushData(threadTimer); // Don't wait a whole period for the first sample
+
+  tasks_create_static(display_screen, "display_screen", DISPLAY_STACK, NULL, 1, displayStack, &displayTask); // Render screen
+  tasks_create_static(maintain_storage, "maintain_storage", MAINTENANCE_STACK, NULL, tskIDLE_PRIORITY,
+                      maintenanceStack, &maintenanceTask); // Compact closed days, free space
+
+  // Network, database and NTP come up in the background
+  init_console();
+  boot_start_network();
 }
 
 void loop() {
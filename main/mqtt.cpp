@@ -0,0 +1,296 @@
+#include <string.h>
+#include "mqtt.h"
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PINGREQ 0xc0
+#define MQTT_PINGRESP 0xd0
+#define MQTT_DISCONNECT 0xe0
+
+#define MQTT_QOS1 0x02
+#define MQTT_DUP 0x08
+
+static size_t putString(uint8_t* buf, const char* str) {
+  size_t len = strlen(str);
+  buf[0] = len >> 8;
+  buf[1] = len & 0xff;
+  memcpy(buf + 2, str, len);
+  return len + 2;
+}
+
+// Fixed header with the remaining length varint, returns its size
+static size_t putHeader(uint8_t* buf, uint8_t type, size_t remaining) {
+  size_t len = 0;
+  buf[len++] = type;
+  do {
+    uint8_t byte = remaining % 128;
+    remaining /= 128;
+    buf[len++] = byte | (remaining > 0 ? 0x80 : 0);
+  } while(remaining > 0);
+  return len;
+}
+
+bool MqttClient::send(uint8_t type, const uint8_t* body, size_t len) {
+  uint8_t header[5];
+  size_t headerLen = putHeader(header, type, len);
+  if(!transport->write(header, headerLen) || (len > 0 && !transport->write(body, len))) {
+    lost();
+    return false;
+  }
+  lastSent = clock();
+  return true;
+}
+
+void MqttClient::lost() {
+  isConnected = false;
+  transport->close();
+}
+
+bool MqttClient::connect(const char* host, uint16_t port, const char* clientId, uint16_t keepAlive,
+                         const char* username, const char* password, uint32_t timeoutMs) {
+  size_t len = 0;
+  uint8_t flags = 0; // Persistent session, so resent messages are flagged as duplicates
+  if(!transport->connect(host, port))
+    return false;
+  rxLen = 0;
+  rxHeaderBytes = 0;
+  connackReceived = false;
+  pingPending = false;
+  isConnected = true;
+
+  len += putString(tx + len, "MQTT");
+  tx[len++] = 4; // Protocol level 3.1.1
+  if(username != NULL && username[0] != '\0')
+    flags |= 0x80;
+  if(password != NULL && password[0] != '\0')
+    flags |= 0x40;
+  tx[len++] = flags;
+  tx[len++] = keepAlive >> 8;
+  tx[len++] = keepAlive & 0xff;
+  len += putString(tx + len, clientId);
+  if(flags & 0x80)
+    len += putString(tx + len, username);
+  if(flags & 0x40)
+    len += putString(tx + len, password);
+  keepAliveUs = keepAlive * 1000000u;
+  if(!send(MQTT_CONNECT, tx, len))
+    return false;
+
+  uint32_t start = clock();
+  while(!connackReceived) {
+    if(!poll() || clock() - start > timeoutMs * 1000u) {
+      lost();
+      return false;
+    }
+  }
+  if(connackCode != 0) {
+    lost();
+    return false;
+  }
+  return true;
+}
+
+bool MqttClient::publish(const char* topic, const uint8_t* payload, size_t len, uint16_t packetId, bool dup) {
+  size_t topicLen = strlen(topic);
+  size_t headerLen = 2 + topicLen + 2;
+  if(!isConnected || headerLen + len > sizeof(tx))
+    return false;
+  size_t pos = putString(tx, topic);
+  tx[pos++] = packetId >> 8;
+  tx[pos++] = packetId & 0xff;
+  memcpy(tx + pos, payload, len);
+  return send(MQTT_PUBLISH | MQTT_QOS1 | (dup ? MQTT_DUP : 0), tx, pos + len);
+}
+
+void MqttClient::handlePacket(uint8_t type, const uint8_t* body, size_t len) {
+  switch(type & 0xf0) {
+    case MQTT_CONNACK:
+      if(len >= 2) {
+        connackReceived = true;
+        connackCode = body[1];
+      }
+      break;
+    case MQTT_PUBACK:
+      if(len >= 2 && ackCallback != NULL)
+        ackCallback((body[0] << 8) | body[1], ackCtx);
+      break;
+    case MQTT_PINGRESP:
+      pingPending = false;
+      break;
+  }
+}
+
+bool MqttClient::poll() {
+  uint8_t buf[64];
+  if(!isConnected)
+    return false;
+  while(true) {
+    int read = transport->read(buf, sizeof(buf));
+    if(read < 0) {
+      lost();
+      return false;
+    }
+    if(read == 0)
+      break;
+    for(int i = 0; i < read; i++) {
+      uint8_t byte = buf[i];
+      // Fixed header: type, then up to 4 bytes of remaining length
+      if(rxHeaderBytes == 0) {
+        rxType = byte;
+        rxRemaining = 0;
+        rxBody = 0;
+        rxLen = 0;
+        rxHeaderBytes = 1;
+        continue;
+      }
+      if(rxHeaderBytes > 0) {
+        rxRemaining |= (uint32_t) (byte & 0x7f) << (7 * (rxHeaderBytes - 1));
+        rxHeaderBytes++;
+        if(byte & 0x80) {
+          if(rxHeaderBytes > 5) {
+            lost();
+            return false;
+          }
+          continue;
+        }
+        rxHeaderBytes = -1; // Header done, reading the body
+        if(rxRemaining == 0) {
+          handlePacket(rxType, rx, 0);
+          rxHeaderBytes = 0;
+        }
+        continue;
+      }
+      if(rxLen < sizeof(rx))
+        rx[rxLen++] = byte;
+      rxBody++;
+      if(rxBody == rxRemaining) {
+        handlePacket(rxType, rx, rxLen);
+        rxHeaderBytes = 0;
+      }
+    }
+  }
+  // Keepalive, the broker drops us after 1.5 times the interval without traffic
+  if(keepAliveUs > 0 && clock() - lastSent > keepAliveUs / 2) {
+    if(pingPending) {
+      lost();
+      return false;
+    }
+    pingPending = true;
+    return send(MQTT_PINGREQ, NULL, 0);
+  }
+  return true;
+}
+
+void MqttClient::disconnect() {
+  if(isConnected)
+    send(MQTT_DISCONNECT, NULL, 0);
+  lost();
+}
+
+MqttPublisher::MqttPublisher(MqttClient* client, mqtt_clock clock, const char* topic, const char* location,
+                             int window, int recordsPerMessage) : client(client), clock(clock) {
+  strncpy(this->topic, topic, sizeof(this->topic) - 1);
+  this->topic[sizeof(this->topic) - 1] = '\0';
+  strncpy(this->location, location, sizeof(this->location) - 1);
+  this->location[sizeof(this->location) - 1] = '\0';
+  this->window = window < 1 ? 1 : window > MQTT_OUTBOX ? MQTT_OUTBOX : window;
+  this->recordsPerMessage = recordsPerMessage < 1 ? 1 : recordsPerMessage > MQTT_RECORDS_MAX ? MQTT_RECORDS_MAX : recordsPerMessage;
+  client->onAck(&MqttPublisher::handleAck, this);
+}
+
+bool MqttPublisher::enqueue(const sensor_data* records, int records_count) {
+  int messages = (records_count + recordsPerMessage - 1) / recordsPerMessage;
+  if(count + messages > MQTT_OUTBOX)
+    return false;
+  for(int i = 0; i < records_count; i += recordsPerMessage) {
+    mqtt_message* message = &outbox[(head + count) % MQTT_OUTBOX];
+    message->count = records_count - i < recordsPerMessage ? records_count - i : recordsPerMessage;
+    memcpy(message->records, records + i, message->count * sizeof(sensor_data));
+    message->sent = false;
+    message->dup = false;
+    message->packetId = nextPacketId;
+    nextPacketId = nextPacketId == 0xffff ? 1 : nextPacketId + 1;
+    count++;
+  }
+  return true;
+}
+
+// Acks arrive in order for a single connection, but search anyway in case the broker reorders
+void MqttPublisher::handleAck(uint16_t packetId, void* ctx) {
+  MqttPublisher* self = (MqttPublisher*) ctx;
+  for(int i = 0; i < self->count; i++) {
+    mqtt_message* message = &self->outbox[(self->head + i) % MQTT_OUTBOX];
+    if(!message->sent || message->packetId != packetId)
+      continue;
+    uint32_t latency = self->clock() - message->sentAt;
+    self->counters.acked++;
+    self->counters.records += message->count;
+    self->counters.latencyTotal += latency;
+    if(latency > self->counters.latencyMax)
+      self->counters.latencyMax = latency;
+    if(self->latencyCallback != NULL)
+      self->latencyCallback(latency, self->latencyCtx);
+    message->count = 0; // Acked, freed once it reaches the head
+    message->sent = false;
+    self->sentCount--;
+    break;
+  }
+  self->release();
+}
+
+// Releases acknowledged or emptied messages from the head
+void MqttPublisher::release() {
+  while(count > 0 && outbox[head].count == 0) {
+    head = (head + 1) % MQTT_OUTBOX;
+    count--;
+  }
+}
+
+bool MqttPublisher::pump() {
+  if(!client->poll())
+    return false;
+  for(int i = 0; i < count && sentCount < window; i++) {
+    mqtt_message* message = &outbox[(head + i) % MQTT_OUTBOX];
+    if(message->sent || message->count == 0)
+      continue;
+    size_t len = 0;
+    for(int r = 0; r < message->count; r++) {
+      size_t written = formatLineProtocol(&message->records[r], location, payload + len, sizeof(payload) - len);
+      // The payload fits a full message of the longest records, so this never happens. The rest is
+      // dropped from the message rather than acknowledged along with it, and counted in unsent
+      if(written == 0) {
+        counters.unsent += message->count - r;
+        message->count = r;
+        break;
+      }
+      len += written;
+    }
+    if(message->count == 0)
+      continue;
+    if(!client->publish(topic, (uint8_t*) payload, len, message->packetId, message->dup))
+      return false;
+    message->sent = true;
+    message->sentAt = clock();
+    sentCount++;
+    if(message->dup)
+      counters.resent++;
+    else
+      counters.published++;
+  }
+  release();
+  return client->poll();
+}
+
+void MqttPublisher::resend() {
+  for(int i = 0; i < count; i++) {
+    mqtt_message* message = &outbox[(head + i) % MQTT_OUTBOX];
+    if(message->count == 0)
+      continue;
+    if(message->sent)
+      message->dup = true;
+    message->sent = false;
+  }
+  sentCount = 0;
+}
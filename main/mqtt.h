@@ -0,0 +1,130 @@
+/*
+  Minimal MQTT 3.1.1 publisher with QoS 1, kept free of Arduino dependencies so it also runs on
+  Linux (see tools/mqtt_bench.cpp).
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "record.h"
+
+// Messages kept until the broker acknowledges them
+#define MQTT_OUTBOX 32
+// Records packed in a single message at most
+#define MQTT_RECORDS_MAX 8
+// A full message of the longest records, plus the topic and packet header
+#define MQTT_PAYLOAD_MAX (MQTT_RECORDS_MAX * LINE_PROTOCOL_MAX)
+#define MQTT_TX_BUFFER (MQTT_PAYLOAD_MAX + 128)
+
+// Byte stream to the broker, reads must not block
+class MqttTransport {
+public:
+  virtual ~MqttTransport() {}
+  virtual bool connect(const char* host, uint16_t port) = 0;
+  virtual void close() = 0;
+  virtual bool connected() = 0;
+  // Returns the amount of bytes read, 0 if none are available and -1 on error
+  virtual int read(uint8_t* buf, size_t len) = 0;
+  virtual bool write(const uint8_t* buf, size_t len) = 0;
+};
+
+// Monotonic clock in microseconds
+typedef uint32_t (*mqtt_clock)();
+typedef void (*mqtt_ack_callback)(uint16_t packetId, void* ctx);
+
+class MqttClient {
+public:
+  MqttClient(MqttTransport* transport, mqtt_clock clock) : transport(transport), clock(clock) {}
+  bool connect(const char* host, uint16_t port, const char* clientId, uint16_t keepAlive,
+               const char* username, const char* password, uint32_t timeoutMs);
+  bool publish(const char* topic, const uint8_t* payload, size_t len, uint16_t packetId, bool dup);
+  // Handles incoming packets and keepalive pings, returns false once the connection is lost
+  bool poll();
+  void disconnect();
+  bool connected() { return isConnected; }
+  void onAck(mqtt_ack_callback callback, void* ctx) { ackCallback = callback; ackCtx = ctx; }
+
+private:
+  bool send(uint8_t type, const uint8_t* body, size_t len);
+  void handlePacket(uint8_t type, const uint8_t* body, size_t len);
+  void lost();
+
+  MqttTransport* transport;
+  mqtt_clock clock;
+  mqtt_ack_callback ackCallback = NULL;
+  void* ackCtx = NULL;
+  bool isConnected = false;
+  bool connackReceived = false;
+  uint8_t connackCode = 0;
+  uint32_t keepAliveUs = 0;
+  uint32_t lastSent = 0;
+  bool pingPending = false;
+  // Incoming packet being assembled, anything larger than the buffer is skipped
+  uint8_t rx[16];
+  size_t rxLen = 0;
+  uint8_t rxType = 0;
+  uint32_t rxRemaining = 0;
+  uint32_t rxBody = 0;
+  int rxHeaderBytes = 0;
+  uint8_t tx[MQTT_TX_BUFFER];
+};
+
+typedef struct {
+  uint16_t packetId;
+  uint8_t count;
+  bool sent;
+  bool dup;
+  uint32_t sentAt;
+  sensor_data records[MQTT_RECORDS_MAX];
+} mqtt_message;
+
+typedef struct {
+  uint32_t published;
+  uint32_t acked;
+  uint32_t resent;
+  uint32_t records; // Records in acknowledged messages
+  uint32_t unsent; // Records that didn't fit their message, a bug if ever non zero
+  uint64_t latencyTotal; // Microseconds from publish to PUBACK
+  uint32_t latencyMax;
+} mqtt_stats;
+
+typedef void (*mqtt_latency_callback)(uint32_t latencyUs, void* ctx);
+
+/*
+  Outbox on top of MqttClient. Records are packed into messages, at most `window` of them are
+  awaiting a PUBACK at once, and unacknowledged messages are published again after a reconnect.
+*/
+class MqttPublisher {
+public:
+  MqttPublisher(MqttClient* client, mqtt_clock clock, const char* topic, const char* location,
+                int window, int recordsPerMessage);
+  // Queues the records as whole messages, all or nothing. Returns false if the outbox is too full
+  bool enqueue(const sensor_data* records, int count);
+  // Publishes what the window allows and processes acks, returns false if the connection is lost
+  bool pump();
+  // Marks every unacknowledged message to be published again, call after reconnecting
+  void resend();
+  int pending() { return count; }
+  int inFlight() { return sentCount; }
+  const mqtt_stats* stats() { return &counters; }
+  void onLatency(mqtt_latency_callback callback, void* ctx) { latencyCallback = callback; latencyCtx = ctx; }
+
+private:
+  static void handleAck(uint16_t packetId, void* ctx);
+  void release();
+
+  MqttClient* client;
+  mqtt_clock clock;
+  char topic[64];
+  char location[32];
+  int window;
+  int recordsPerMessage;
+  mqtt_message outbox[MQTT_OUTBOX];
+  int head = 0; // Oldest message
+  int count = 0;
+  int sentCount = 0;
+  uint16_t nextPacketId = 1;
+  mqtt_stats counters = {};
+  mqtt_latency_callback latencyCallback = NULL;
+  void* latencyCtx = NULL;
+  char payload[MQTT_PAYLOAD_MAX];
+};
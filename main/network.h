@@ -1,3 +1,44 @@
+// Queue size for the InfluxDB sink
+#define NETWORK_QUEUE 200
+
+typedef struct {
+  char host[64];
+  int port;
+  char org[32];
+  char bucket[32];
+  char token[96];
+  char location[32];
+} influx_config;
+
+// Queue size for the MQTT sink
+#define MQTT_QUEUE 200
+
+typedef struct {
+  char host[64];
+  int port;
+  char clientId[32];
+  char topic[64];
+  char username[32];
+  char password[64];
+  char location[32];
+  int window; // Messages awaiting a PUBACK at once
+  int recordsPerMessage;
+} mqtt_config;
+
+// Queue size for the UDP sink, only live data goes through it so it can be short
+#define UDP_QUEUE 20
+// Largest datagram payload that fits a 1500 byte Ethernet MTU without fragmenting
+#define UDP_DATAGRAM_MAX 1472
+
+typedef struct {
+  char host[64];
+  int port;
+  char location[32];
+} udp_config;
+
 bool start_wifi_cmd(const char* ssid, const char* password, bool isAP);
-void start_http_server(const char* httpServer, const int port);
-void upload_data(void* _);
\ No newline at end of file
+void influxDefaults(influx_config* config);
+bool start_influx_sink(const influx_config* config);
+void mqttDefaults(mqtt_config* config);
+bool start_mqtt_sink(const mqtt_config* config);
+bool start_udp_sink(const udp_config* config);
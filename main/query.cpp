@@ -0,0 +1,304 @@
+/*
+  Range aggregation over the stored data, streamed back over the console.
+
+  Each query is split in time order across the cheapest source holding the data:
+    - rollup files for the oldest part, when the bucket width is a multiple of a rollup level
+    - raw daily logs for whatever rollups can't answer, using the columnar file of closed days
+      and otherwise bisecting the CSV to the first requested line
+    - the RAM history for the most recent samples
+*/
+#include <M5Core2.h>
+#include <algorithm>
+#include "query.h"
+#include "history.h"
+#include "rollup.h"
+#include "storage.h"
+#include "columnar.h"
+#include "helper.h"
+#include "global.h"
+
+static const char* aggregateNames[] = {"min", "max", "mean", "sum", "last"};
+
+typedef struct {
+  const query_spec* spec;
+  rollup_bucket current; // Output bucket being filled, start is the bucket boundary
+  float last[SENSOR_FIELDS];
+  uint32_t rows;
+  uint32_t records;
+  uint32_t bytes;
+  uint32_t sourceRecords[3]; // RAM, rollup and raw records, in that order
+} query_state;
+
+enum { SOURCE_RAM, SOURCE_ROLLUP, SOURCE_RAW };
+
+static void emitBucket(query_state* q) {
+  const query_spec* spec = q->spec;
+  char timeBuf[24];
+  if(q->current.count == 0)
+    return;
+  formatTimestamp(q->current.start, timeBuf, sizeof(timeBuf));
+  printf("%s,%u", timeBuf, (unsigned) q->current.count);
+  for(int i = 0; i < spec->fieldCount; i++) {
+    rollup_field* field = &q->current.fields[spec->fields[i]];
+    if(spec->aggregates & AGG_MIN)
+      printf(",%.3f", field->min);
+    if(spec->aggregates & AGG_MAX)
+      printf(",%.3f", field->max);
+    if(spec->aggregates & AGG_MEAN)
+      printf(",%.3f", field->sum / q->current.count);
+    if(spec->aggregates & AGG_SUM)
+      printf(",%.3f", field->sum);
+    if(spec->aggregates & AGG_LAST)
+      printf(",%.3f", q->last[spec->fields[i]]);
+  }
+  printf("\n");
+  q->current.count = 0;
+  q->rows++;
+}
+
+// Adds data to the output bucket it falls in. Inputs must arrive in time order
+static void feed(query_state* q, const rollup_bucket* in, const sensor_data* sample) {
+  const query_spec* spec = q->spec;
+  if(in->start < spec->start || in->start > spec->end)
+    return;
+  time_t start = spec->start + ((in->start - spec->start) / spec->bucket) * spec->bucket;
+  if(q->current.count > 0 && q->current.start != start)
+    emitBucket(q);
+  rollup_merge(&q->current, in);
+  q->current.start = start;
+  if(sample != NULL) {
+    for(int i = 0; i < SENSOR_FIELDS; i++)
+      q->last[i] = getSensorField(sample, i);
+  }
+}
+
+static void feedSample(query_state* q, const sensor_data* data) {
+  rollup_bucket in;
+  rollup_from_sample(&in, data);
+  feed(q, &in, data);
+}
+
+static void feedColumnar(const sensor_data* data, void* ctx) {
+  query_state* q = (query_state*) ctx;
+  q->records++;
+  q->sourceRecords[SOURCE_RAW]++;
+  feedSample(q, data);
+}
+
+// Raw samples in [from, to)
+static void queryRaw(query_state* q, time_t from, time_t to) {
+  char readBuffer[256];
+  struct tm date;
+  localtime_r(&from, &date);
+  time_t timestamp = from;
+  uint8_t fieldMask = 0;
+  for(int i = 0; i < q->spec->fieldCount; i++)
+    fieldMask |= 1 << q->spec->fields[i];
+  while(timestamp < to) {
+    size_t bytes = 0;
+    columnFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    bool columnar = columnar_read(readBuffer, &timestamp, to - 1, fieldMask, &feedColumnar, q, &bytes);
+    q->bytes += bytes;
+    dataFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    File file = columnar ? File() : SD.open(readBuffer, FILE_READ);
+    if(file) {
+      q->bytes += seekDataFile(file, timestamp);
+      while(true) {
+        size_t read = readDataLine(file, readBuffer, sizeof(readBuffer));
+        if(read == 0)
+          break;
+        q->bytes += read + 1;
+        q->records++;
+        q->sourceRecords[SOURCE_RAW]++;
+        sensor_data data = deserializeSensorData(readBuffer);
+        if(!data.init || data.timestamp < timestamp)
+          continue;
+        if(data.timestamp >= to)
+          break;
+        feedSample(q, &data);
+      }
+      file.close();
+    }
+    // Advance day by 1 and set time to 0
+    date.tm_mday += 1;
+    date.tm_sec = 0;
+    date.tm_min = 0;
+    date.tm_hour = 0;
+    date.tm_isdst = -1;
+    timestamp = mktime(&date);
+  }
+}
+
+// Rollup rows of a level starting in [from, to), falling back to raw data for missing files
+static void queryRollups(query_state* q, enum rollup_level level, time_t from, time_t to) {
+  char path[40];
+  char line[320];
+  struct tm date;
+  localtime_r(&from, &date);
+  // Each rollup file covers a day, a month or a year
+  date.tm_hour = 0;
+  date.tm_min = 0;
+  date.tm_sec = 0;
+  if(level >= ROLLUP_HOUR)
+    date.tm_mday = 1;
+  if(level >= ROLLUP_DAY)
+    date.tm_mon = 0;
+  date.tm_isdst = -1;
+  time_t periodStart = mktime(&date);
+  while(periodStart < to) {
+    if(level == ROLLUP_MINUTE)
+      date.tm_mday += 1;
+    else if(level == ROLLUP_HOUR)
+      date.tm_mon += 1;
+    else
+      date.tm_year += 1;
+    date.tm_isdst = -1;
+    time_t periodEnd = mktime(&date);
+
+    rollup_path(level, periodStart, path, sizeof(path));
+    File file = SD.open(path, FILE_READ);
+    if(file) {
+      while(true) {
+        xSemaphoreTake(storageMutex, portMAX_DELAY);
+        size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+        xSemaphoreGive(storageMutex);
+        if(read == 0)
+          break;
+        line[read] = '\0';
+        q->bytes += read + 1;
+        q->records++;
+        q->sourceRecords[SOURCE_ROLLUP]++;
+        rollup_bucket bucket;
+        if(!deserializeRollup(line, &bucket) || bucket.start < from)
+          continue;
+        if(bucket.start >= to)
+          break;
+        feed(q, &bucket, NULL);
+      }
+      file.close();
+    }
+    else {
+      queryRaw(q, std::max(from, periodStart), std::min(to, periodEnd));
+    }
+    periodStart = periodEnd;
+  }
+}
+
+// Samples in the RAM history in [from, spec->end]
+static void queryRam(query_state* q, time_t from) {
+  sensor_data data;
+  for(int i = 0; history_get(i, &data); i++) {
+    q->records++;
+    q->sourceRecords[SOURCE_RAM]++;
+    if(data.timestamp >= from)
+      feedSample(q, &data);
+  }
+}
+
+void runQuery(const query_spec* spec) {
+  query_state q = {0};
+  q.spec = spec;
+
+  // Header
+  printf("time,count");
+  for(int i = 0; i < spec->fieldCount; i++) {
+    for(int agg = 0; agg < 5; agg++) {
+      if(spec->aggregates & (1 << agg))
+        printf(",%s_%s", sensorFieldNames[spec->fields[i]], aggregateNames[agg]);
+    }
+  }
+  printf("\n");
+
+  // The RAM history answers everything from its first whole minute onwards
+  time_t ramStart = spec->end + 1;
+  sensor_data oldest;
+  if(history_get(0, &oldest)) {
+    ramStart = rollup_bucket_start(ROLLUP_MINUTE, oldest.timestamp);
+    if(ramStart < oldest.timestamp)
+      ramStart += rollup_width(ROLLUP_MINUTE);
+  }
+  if(ramStart < spec->start)
+    ramStart = spec->start;
+  time_t olderEnd = std::min(ramStart, spec->end + 1);
+
+  // Walk down from the coarsest usable rollup level, each one covering up to its open bucket
+  time_t cursor = spec->start;
+  int level = (spec->aggregates & AGG_LAST) ? -1 : rollup_select_level(spec->bucket);
+  for(; level >= 0 && cursor < olderEnd; level--) {
+    enum rollup_level rollupLevel = (enum rollup_level) level;
+    if(rollup_bucket_start(rollupLevel, cursor) != cursor)
+      continue;
+    time_t levelEnd = std::min(rollup_bucket_start(rollupLevel, olderEnd), rollup_live_start(rollupLevel));
+    if(levelEnd > cursor) {
+      queryRollups(&q, rollupLevel, cursor, levelEnd);
+      cursor = levelEnd;
+    }
+  }
+  if(cursor < olderEnd)
+    queryRaw(&q, cursor, olderEnd);
+  if(ramStart <= spec->end)
+    queryRam(&q, ramStart);
+  emitBucket(&q);
+
+  printf("# %u rows, scanned %u records (%u ram, %u rollup, %u raw) and %u bytes\n",
+         (unsigned) q.rows, (unsigned) q.records, (unsigned) q.sourceRecords[SOURCE_RAM],
+         (unsigned) q.sourceRecords[SOURCE_ROLLUP], (unsigned) q.sourceRecords[SOURCE_RAW],
+         (unsigned) q.bytes);
+}
+
+// Parses a comma separated list of field names, or "all"
+bool parseQueryFields(const char* list, query_spec* spec) {
+  char buf[128];
+  char* save;
+  spec->fieldCount = 0;
+  if(strcmp(list, "all") == 0) {
+    for(int i = 0; i < SENSOR_FIELDS; i++)
+      spec->fields[spec->fieldCount++] = i;
+    return true;
+  }
+  strncpy(buf, list, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  for(char* token = strtok_r(buf, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+    int field = findSensorField(token);
+    if(field < 0 || spec->fieldCount == SENSOR_FIELDS) {
+      printf("Unknown field '%s'\n", token);
+      return false;
+    }
+    spec->fields[spec->fieldCount++] = field;
+  }
+  return spec->fieldCount > 0;
+}
+
+// rain_fall is a running total, adding its samples up means nothing
+static bool isCumulative(int field) {
+  return strcmp(sensorFieldNames[field], "rain_fall") == 0;
+}
+
+// Parses a comma separated list of aggregate functions, after parseQueryFields filled the fields
+bool parseQueryAggregates(const char* list, query_spec* spec) {
+  char buf[64];
+  char* save;
+  spec->aggregates = 0;
+  strncpy(buf, list, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  for(char* token = strtok_r(buf, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+    int agg;
+    for(agg = 0; agg < 5; agg++) {
+      if(strcmp(token, aggregateNames[agg]) == 0)
+        break;
+    }
+    if(agg == 5) {
+      printf("Unknown aggregate '%s'\n", token);
+      return false;
+    }
+    spec->aggregates |= 1 << agg;
+  }
+  for(int i = 0; i < spec->fieldCount && (spec->aggregates & AGG_SUM); i++) {
+    if(isCumulative(spec->fields[i])) {
+      printf("Can't sum %s, it's a running total. Its max less its min is the amount in a bucket\n",
+             sensorFieldNames[spec->fields[i]]);
+      return false;
+    }
+  }
+  return spec->aggregates != 0;
+}
@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <time.h>
+#include "record.h"
+
+// Aggregate functions, combined as a bitmask
+#define AGG_MIN  (1 << 0)
+#define AGG_MAX  (1 << 1)
+#define AGG_MEAN (1 << 2)
+#define AGG_SUM  (1 << 3)
+#define AGG_LAST (1 << 4)
+
+typedef struct {
+  time_t start;
+  time_t end;
+  int bucket; // Output bucket width in seconds
+  int fields[SENSOR_FIELDS];
+  int fieldCount;
+  uint8_t aggregates;
+} query_spec;
+
+bool parseQueryFields(const char* list, query_spec* spec);
+bool parseQueryAggregates(const char* list, query_spec* spec);
+void runQuery(const query_spec* spec);
@@ -0,0 +1,124 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "record.h"
+
+const char* sensorFieldNames[SENSOR_FIELDS] = {"rain_fall", "wind_speed", "wind_direction",
+                                               "temperature", "humidity", "pressure"};
+
+float getSensorField(const sensor_data* data, int field) {
+  switch(field) {
+    case 0: return data->rain_fall;
+    case 1: return data->wind_speed;
+    case 2: return data->wind_direction;
+    case 3: return data->temperature;
+    case 4: return data->humidity;
+    case 5: return data->pressure;
+  }
+  return 0;
+}
+
+// Returns the column index of a field name, or -1 if it doesn't exist
+int findSensorField(const char* name) {
+  for(int i = 0; i < SENSOR_FIELDS; i++) {
+    if(strcmp(name, sensorFieldNames[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+
+// CRC-32 (IEEE 802.3, reflected), bitwise to avoid a 1KB table
+uint32_t record_crc32(const void* data, size_t len) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  uint32_t crc = 0xffffffff;
+  for(size_t i = 0; i < len; i++) {
+    crc ^= bytes[i];
+    for(int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+// Formats a timestamp in the YYYY/MM/DD HH:MM:SS format used by the SD logs
+void formatTimestamp(time_t timestamp, char* buf, size_t len) {
+  struct tm time;
+  localtime_r(&timestamp, &time);
+  strftime(buf, len, "%Y/%m/%d %H:%M:%S", &time);
+}
+
+/*
+  Formats a record as one line of the daily log: the 7 CSV columns and the sampling interval,
+  followed by the payload length and its CRC32, "<payload>,<len>,*<crc>\n". Lines cut short by a
+  power loss fail the check.
+  Returns the line length, including the newline.
+*/
+size_t serializeSensorData(const sensor_data* data, char* buf, size_t len) {
+  char timeBuf[24];
+  formatTimestamp(data->timestamp, timeBuf, sizeof(timeBuf));
+  int payload = snprintf(buf, len, "%s,%f,%f,%f,%f,%f,%f,%u", timeBuf, data->rain_fall,
+                         data->wind_speed, data->wind_direction, data->temperature,
+                         data->humidity, data->pressure, (unsigned) data->interval);
+  if(payload < 0 || (size_t) payload >= len)
+    return 0;
+  uint32_t crc = record_crc32(buf, payload);
+  int frame = snprintf(buf + payload, len - payload, ",%d,*%08lX\n", payload, (unsigned long) crc);
+  if(frame < 0 || (size_t) (payload + frame) >= len)
+    return 0;
+  return payload + frame;
+}
+
+/*
+  Checks and strips the length/CRC frame from a line read without its newline, leaving only the
+  payload. Lines written before framing was introduced have no frame and are accepted as they are.
+*/
+bool unframeRecord(char* str) {
+  char* marker = strstr(str, ",*");
+  if(marker == NULL)
+    return true;
+  *marker = '\0';
+  // Exactly the eight upper case digits serializeSensorData writes, so no flipped byte parses the same
+  const char* hex = marker + 2;
+  uint32_t crc = 0;
+  for(int i = 0; i < 8; i++) {
+    if(!isdigit(hex[i]) && (hex[i] < 'A' || hex[i] > 'F'))
+      return false;
+    crc = (crc << 4) | (isdigit(hex[i]) ? hex[i] - '0' : hex[i] - 'A' + 10);
+  }
+  if(hex[8] != '\0' && hex[8] != '\r' && hex[8] != '\n')
+    return false;
+  char* lenToken = strrchr(str, ',');
+  if(lenToken == NULL)
+    return false;
+  *lenToken = '\0';
+  size_t payload = atoi(lenToken + 1);
+  return payload == strlen(str) && crc == record_crc32(str, payload);
+}
+
+static float finiteOrZero(float value) {
+  return isnan(value) ? 0 : value;
+}
+
+/*
+  Formats a record as InfluxDB line protocol, one line per sensor. Timestamps are in seconds for
+  writes that say precision=s, or in nanoseconds where the precision can't be given (UDP).
+  Returns the length written, or 0 if it doesn't fit.
+*/
+size_t formatLineProtocol(const sensor_data* data, const char* location, char* buf, size_t len, bool nanoseconds) {
+  const char* scale = nanoseconds ? "000000000" : "";
+  char interval[24] = "";
+  // Records read back from before adaptive sampling don't know their interval
+  if(data->interval > 0)
+    snprintf(interval, sizeof(interval), ",interval=%ui", (unsigned) data->interval);
+  int written = snprintf(buf, len,
+    "weather,sensor_id=SFEWeatherMeterKit,location=%s rain_fall=%f,wind_speed=%f,wind_direction=%f%s %lld%s\n"
+    "weather,sensor_id=bme280,location=%s temperature=%f,humidity=%f,pressure=%f %lld%s\n",
+    location, data->rain_fall, data->wind_speed, data->wind_direction, interval, (long long) data->timestamp, scale,
+    location, finiteOrZero(data->temperature), finiteOrZero(data->humidity),
+    finiteOrZero(data->pressure), (long long) data->timestamp, scale);
+  if(written < 0 || (size_t) written >= len)
+    return 0;
+  return written;
+}
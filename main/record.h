@@ -0,0 +1,45 @@
+/*
+  Sensor record definition, shared by every module that stores, sends or aggregates samples.
+  Kept free of Arduino dependencies.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Number of measured fields in a record (everything but the timestamp)
+#define SENSOR_FIELDS 6
+
+typedef struct {
+  time_t timestamp;
+  float rain_fall;
+  float wind_speed;
+  float wind_direction;
+  float temperature;
+  float humidity;
+  float pressure;
+  uint16_t interval; // Seconds since the previous sample, 0 if unknown
+  bool init;
+} sensor_data;
+
+// Field names in storage column order, also used as InfluxDB field keys
+extern const char* sensorFieldNames[SENSOR_FIELDS];
+
+float getSensorField(const sensor_data* data, int field);
+int findSensorField(const char* name);
+
+// Longest line serializeSensorData can produce
+#define RECORD_LINE_MAX 160
+// Longest location formatLineProtocol is given, the size of every config's location less one
+#define LINE_PROTOCOL_LOCATION_MAX 31
+/*
+  Room formatLineProtocol needs for one record, terminator included: 230 characters of keys,
+  interval and nanosecond timestamps, the location twice and six floats as wide as %f makes them
+*/
+#define LINE_PROTOCOL_MAX (230 + 2 * LINE_PROTOCOL_LOCATION_MAX + 6 * 47 + 1)
+
+uint32_t record_crc32(const void* data, size_t len);
+void formatTimestamp(time_t timestamp, char* buf, size_t len);
+size_t serializeSensorData(const sensor_data* data, char* buf, size_t len);
+bool unframeRecord(char* str);
+size_t formatLineProtocol(const sensor_data* data, const char* location, char* buf, size_t len, bool nanoseconds = false);
@@ -0,0 +1,424 @@
+/*
+  Incrementally maintained rollups of the stored data.
+
+  Every sample is folded into a running minute, hour and day bucket holding the count and the
+  min/max/sum of each field. When a sample falls past a bucket boundary the bucket is finalized
+  and appended as a row to its rollup file:
+    /rollup-minute_YYYY-MM-DD.csv  (one file per day)
+    /rollup-hour_YYYY-MM.csv       (one file per month)
+    /rollup-day_YYYY.csv           (one file per year)
+  Rows are "timestamp,count" followed by min,max,mean for every field in storage order.
+
+  The running buckets only live in RAM, rollup_recover seeds them again at boot.
+*/
+#include <M5Core2.h>
+#include "rollup.h"
+#include "helper.h"
+#include "storage.h"
+#include "wal.h"
+#include "global.h"
+#include "logger.h"
+
+// Buckets currently being filled by the CSV sink, only touched while holding storageMutex
+static rollup_bucket liveRollups[ROLLUP_LEVELS];
+
+static void writeRollup(File& file, const rollup_bucket* bucket) {
+  char timeBuf[24];
+  formatTimestamp(bucket->start, timeBuf, sizeof(timeBuf));
+  file.printf("%s,%u", timeBuf, (unsigned) bucket->count);
+  for(int i = 0; i < SENSOR_FIELDS; i++) {
+    file.printf(",%.3f,%.3f,%.3f", bucket->fields[i].min, bucket->fields[i].max,
+                bucket->fields[i].sum / bucket->count);
+  }
+  file.printf("\n");
+}
+
+static void appendRollup(enum rollup_level level, const rollup_bucket* bucket) {
+  char path[40];
+  rollup_path(level, bucket->start, path, sizeof(path));
+  File file = SD.open(path, FILE_APPEND);
+  if(!file) {
+    LOG_ERROR(LOG_ROLLUP, "Failed to open rollup file %s", path);
+    return;
+  }
+  writeRollup(file, bucket);
+  file.close();
+}
+
+/*
+  Folds a bucket into the running bucket of a level. Returns true and fills `closed` if the
+  incoming data started a new bucket, meaning the previous one is complete.
+*/
+static bool rollup_advance(rollup_bucket* current, enum rollup_level level, const rollup_bucket* in, rollup_bucket* closed) {
+  time_t start = rollup_bucket_start(level, in->start);
+  bool finished = false;
+  if(current->count > 0 && current->start != start) {
+    *closed = *current;
+    current->count = 0;
+    finished = true;
+  }
+  rollup_merge(current, in);
+  current->start = start;
+  return finished;
+}
+
+// Called by the CSV sink for every sample written to the SD card
+void rollup_store(const sensor_data* data) {
+  rollup_bucket sample;
+  rollup_bucket closed;
+  rollup_from_sample(&sample, data);
+  for(int level = 0; level < ROLLUP_LEVELS; level++) {
+    if(rollup_advance(&liveRollups[level], (enum rollup_level) level, &sample, &closed))
+      appendRollup((enum rollup_level) level, &closed);
+  }
+}
+
+void rollup_from_sample(rollup_bucket* bucket, const sensor_data* data) {
+  bucket->start = data->timestamp;
+  bucket->count = 1;
+  for(int i = 0; i < SENSOR_FIELDS; i++) {
+    float value = getSensorField(data, i);
+    bucket->fields[i].min = value;
+    bucket->fields[i].max = value;
+    bucket->fields[i].sum = value;
+  }
+}
+
+void rollup_merge(rollup_bucket* into, const rollup_bucket* from) {
+  if(into->count == 0) {
+    *into = *from;
+    return;
+  }
+  into->count += from->count;
+  for(int i = 0; i < SENSOR_FIELDS; i++) {
+    into->fields[i].min = fmin(into->fields[i].min, from->fields[i].min);
+    into->fields[i].max = fmax(into->fields[i].max, from->fields[i].max);
+    into->fields[i].sum += from->fields[i].sum;
+  }
+}
+
+// Nominal bucket width in seconds (days may be shorter or longer on DST changes)
+int rollup_width(enum rollup_level level) {
+  switch(level) {
+    case ROLLUP_MINUTE: return 60;
+    case ROLLUP_HOUR: return 60 * 60;
+    case ROLLUP_DAY: return 24 * 60 * 60;
+    default: return 0;
+  }
+}
+
+// Returns the coarsest level whose buckets evenly divide the resolution, or -1 if raw data is needed
+int rollup_select_level(int resolution) {
+  for(int level = ROLLUP_LEVELS - 1; level >= 0; level--) {
+    int width = rollup_width((enum rollup_level) level);
+    if(resolution >= width && resolution % width == 0)
+      return level;
+  }
+  return -1;
+}
+
+time_t rollup_bucket_start(enum rollup_level level, time_t timestamp) {
+  struct tm date;
+  localtime_r(&timestamp, &date);
+  date.tm_sec = 0;
+  if(level >= ROLLUP_HOUR)
+    date.tm_min = 0;
+  if(level >= ROLLUP_DAY)
+    date.tm_hour = 0;
+  date.tm_isdst = -1;
+  return mktime(&date);
+}
+
+void rollup_path(enum rollup_level level, time_t timestamp, char* buf, size_t len) {
+  struct tm date;
+  localtime_r(&timestamp, &date);
+  switch(level) {
+    case ROLLUP_MINUTE:
+      snprintf(buf, len, "/rollup-minute_%d-%02d-%02d.csv", date.tm_year+1900, date.tm_mon+1, date.tm_mday);
+      break;
+    case ROLLUP_HOUR:
+      snprintf(buf, len, "/rollup-hour_%d-%02d.csv", date.tm_year+1900, date.tm_mon+1);
+      break;
+    default:
+      snprintf(buf, len, "/rollup-day_%d.csv", date.tm_year+1900);
+      break;
+  }
+}
+
+bool deserializeRollup(char* str, rollup_bucket* bucket) {
+  char* tokenArray[2 + SENSOR_FIELDS * 3] = {0};
+  int tokens = 2 + SENSOR_FIELDS * 3;
+  int i = 0;
+  char* buf; // For strtok_r thread safety
+  char* token = strtok_r(str, ",", &buf);
+  while(token != NULL && i < tokens) {
+    tokenArray[i] = token;
+    i++;
+    token = strtok_r(NULL, ",", &buf);
+  }
+  if(i != tokens || !parseTimestamp(tokenArray[0], &bucket->start))
+    return false;
+  bucket->count = atoi(tokenArray[1]);
+  for(int field = 0; field < SENSOR_FIELDS; field++) {
+    bucket->fields[field].min = atof(tokenArray[2 + field*3]);
+    bucket->fields[field].max = atof(tokenArray[3 + field*3]);
+    bucket->fields[field].sum = atof(tokenArray[4 + field*3]) * bucket->count;
+  }
+  return bucket->count > 0;
+}
+
+/*
+  Regenerates the rollup file of a level containing the timestamp from the data one level below:
+  minute rollups come from the raw daily log, hour rollups from the month's minute rollups and
+  day rollups from the year's hour rollups. Holds storageMutex for the whole file so the CSV sink
+  can't append to it in the meantime.
+*/
+static void rebuildRollupFile(enum rollup_level level, time_t timestamp) {
+  char path[40];
+  char tmpPath[40];
+  char sourcePath[40];
+  char line[320];
+  rollup_bucket current = {0};
+  rollup_bucket in;
+  rollup_bucket closed;
+  struct tm date;
+
+  rollup_path(level, timestamp, path, sizeof(path));
+  strcpy(tmpPath, path);
+  strcpy(strrchr(tmpPath, '.'), ".tmp");
+  localtime_r(&timestamp, &date);
+  date.tm_hour = 12; // Stay clear of DST transitions while stepping through days
+  date.tm_min = 0;
+  date.tm_sec = 0;
+  date.tm_isdst = -1;
+  if(level == ROLLUP_HOUR)
+    date.tm_mday = 1;
+  if(level == ROLLUP_DAY) {
+    date.tm_mday = 1;
+    date.tm_mon = 0;
+  }
+  int year = date.tm_year;
+  int month = date.tm_mon;
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File out = SD.open(tmpPath, FILE_WRITE);
+  if(!out) {
+    xSemaphoreGive(storageMutex);
+    LOG_ERROR(LOG_ROLLUP, "Failed to create %s", tmpPath);
+    return;
+  }
+  while(true) {
+    time_t sourceTime = mktime(&date);
+    // Stop once we step out of the period covered by this file
+    if(date.tm_year != year || (level != ROLLUP_DAY && date.tm_mon != month))
+      break;
+    if(level == ROLLUP_MINUTE)
+      dataFilePath(sourceTime, sourcePath, sizeof(sourcePath));
+    else
+      rollup_path((enum rollup_level) (level - 1), sourceTime, sourcePath, sizeof(sourcePath));
+
+    File source = SD.open(sourcePath, FILE_READ);
+    if(source) {
+      while(true) {
+        size_t read = source.readBytesUntil('\n', line, sizeof(line) - 1);
+        // Preallocated logs are padded with zeros past their last line
+        if(read == 0 || line[0] == '\0')
+          break;
+        line[read] = '\0';
+        if(level == ROLLUP_MINUTE) {
+          sensor_data data = deserializeSensorData(line);
+          if(!data.init)
+            continue;
+          rollup_from_sample(&in, &data);
+        }
+        else if(!deserializeRollup(line, &in)) {
+          continue;
+        }
+        if(rollup_advance(&current, level, &in, &closed))
+          writeRollup(out, &closed);
+      }
+      source.close();
+    }
+    // Minute files come from a single day, the others step by their source file
+    if(level == ROLLUP_MINUTE)
+      break;
+    if(level == ROLLUP_HOUR)
+      date.tm_mday += 1;
+    else
+      date.tm_mon += 1;
+    date.tm_isdst = -1;
+    mktime(&date);
+  }
+  // The bucket still being filled by the CSV sink will be appended when it closes
+  if(current.count > 0 && current.start != liveRollups[level].start)
+    writeRollup(out, &current);
+  out.close();
+  SD.remove(path);
+  SD.rename(tmpPath, path);
+  xSemaphoreGive(storageMutex);
+  printf("Rebuilt %s\n", path);
+}
+
+// Rebuilds all rollups covering the range from the raw logs, used to backfill older data
+void rebuildRollups(time_t timestamp, time_t timestamp_end) {
+  struct tm date;
+  struct tm date_end;
+  localtime_r(&timestamp, &date);
+  localtime_r(&timestamp_end, &date_end);
+  date.tm_hour = 12;
+  date.tm_min = 0;
+  date.tm_sec = 0;
+  date.tm_isdst = -1;
+  struct tm start = date;
+
+  // Minute rollups, one per day
+  while(date.tm_year < date_end.tm_year ||
+        (date.tm_year == date_end.tm_year && date.tm_yday <= date_end.tm_yday)) {
+    rebuildRollupFile(ROLLUP_MINUTE, mktime(&date));
+    date.tm_mday += 1;
+    date.tm_isdst = -1;
+    mktime(&date);
+  }
+  // Hour rollups, one per month
+  date = start;
+  date.tm_mday = 1;
+  while(date.tm_year < date_end.tm_year ||
+        (date.tm_year == date_end.tm_year && date.tm_mon <= date_end.tm_mon)) {
+    rebuildRollupFile(ROLLUP_HOUR, mktime(&date));
+    date.tm_mon += 1;
+    date.tm_isdst = -1;
+    mktime(&date);
+  }
+  // Day rollups, one per year
+  for(int year = start.tm_year; year <= date_end.tm_year; year++) {
+    date = start;
+    date.tm_year = year;
+    date.tm_mon = 0;
+    date.tm_mday = 1;
+    rebuildRollupFile(ROLLUP_DAY, mktime(&date));
+  }
+}
+
+// Folds the rows of a rollup file starting within [from, to) into a bucket
+static void mergeRollupRows(const char* path, time_t from, time_t to, rollup_bucket* into) {
+  char line[320];
+  rollup_bucket row;
+  File file = SD.open(path, FILE_READ);
+  if(!file)
+    return;
+  while(true) {
+    size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    if(read == 0)
+      break;
+    line[read] = '\0';
+    if(deserializeRollup(line, &row) && row.start >= from && row.start < to)
+      rollup_merge(into, &row);
+  }
+  file.close();
+}
+
+/*
+  Folds the samples of the log's last minute into a bucket, returns false if the log holds none.
+  Only the tail is read, further back each time until it reaches a sample from an earlier minute.
+*/
+static bool mergeLastMinute(const char* path, uint32_t end, rollup_bucket* into) {
+  char line[RECORD_LINE_MAX];
+  File file = SD.open(path, FILE_READ);
+  if(!file)
+    return false;
+  for(uint32_t span = RECORD_LINE_MAX * 16; ; span *= 2) {
+    uint32_t offset = end > span ? end - span : 0;
+    time_t first = 0;
+    time_t last = 0;
+    file.seek(offset);
+    // Starting mid line, the first one is partial
+    if(offset > 0)
+      offset += file.readBytesUntil('\n', line, sizeof(line) - 1) + 1;
+    uint32_t from = offset;
+    while(offset < end) {
+      size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+      if(read == 0 || line[0] == '\0')
+        break;
+      offset += read + 1;
+      line[read] = '\0';
+      sensor_data data = deserializeSensorData(line);
+      if(!data.init)
+        continue;
+      if(first == 0)
+        first = data.timestamp;
+      last = data.timestamp;
+    }
+    if(last == 0) {
+      if(from == 0)
+        break;
+      continue;
+    }
+    time_t start = rollup_bucket_start(ROLLUP_MINUTE, last);
+    if(first >= start && from > 0)
+      continue;
+    // Read again, now knowing which minute to keep
+    rollup_bucket sample;
+    file.seek(from);
+    for(offset = from; offset < end; ) {
+      size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+      if(read == 0 || line[0] == '\0')
+        break;
+      offset += read + 1;
+      line[read] = '\0';
+      sensor_data data = deserializeSensorData(line);
+      if(!data.init || data.timestamp < start)
+        continue;
+      rollup_from_sample(&sample, &data);
+      rollup_merge(into, &sample);
+    }
+    into->start = start;
+    file.close();
+    return true;
+  }
+  file.close();
+  return false;
+}
+
+/*
+  Seeds the running buckets at boot, after wal_recover, so the samples logged before a reboot
+  aren't missing from the minute, hour and day they fall in. Only the last minute comes from the
+  raw log, the closed minutes of its hour and the closed hours of its day are already in the
+  rollup files. The buckets may be long past by now, the next sample closes and appends them.
+*/
+void rollup_recover() {
+  char path[40];
+  uint32_t end;
+  rollup_bucket minute = {0};
+  rollup_bucket hour = {0};
+  rollup_bucket day = {0};
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  if(!wal_active(path, sizeof(path), &end) || end == 0 || !mergeLastMinute(path, end, &minute)) {
+    xSemaphoreGive(storageMutex);
+    return;
+  }
+  time_t hourStart = rollup_bucket_start(ROLLUP_HOUR, minute.start);
+  time_t dayStart = rollup_bucket_start(ROLLUP_DAY, minute.start);
+  rollup_path(ROLLUP_MINUTE, minute.start, path, sizeof(path));
+  mergeRollupRows(path, hourStart, minute.start, &hour);
+  rollup_merge(&hour, &minute);
+  hour.start = hourStart;
+  rollup_path(ROLLUP_HOUR, minute.start, path, sizeof(path));
+  mergeRollupRows(path, dayStart, hourStart, &day);
+  rollup_merge(&day, &hour);
+  day.start = dayStart;
+  liveRollups[ROLLUP_MINUTE] = minute;
+  liveRollups[ROLLUP_HOUR] = hour;
+  liveRollups[ROLLUP_DAY] = day;
+  xSemaphoreGive(storageMutex);
+  LOG_INFO(LOG_ROLLUP, "Seeded running rollups with %u samples of the day, %u of the hour and %u of the minute",
+           (unsigned) day.count, (unsigned) hour.count, (unsigned) minute.count);
+}
+
+// Start of the bucket the CSV sink is still filling, rollup files hold everything before it
+time_t rollup_live_start(enum rollup_level level) {
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  time_t start = liveRollups[level].count > 0 ? liveRollups[level].start : getUnixTimestamp();
+  xSemaphoreGive(storageMutex);
+  return start;
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <time.h>
+#include "record.h"
+
+// Aggregation levels, from finest to coarsest
+enum rollup_level { ROLLUP_MINUTE, ROLLUP_HOUR, ROLLUP_DAY, ROLLUP_LEVELS };
+
+typedef struct {
+  float min;
+  float max;
+  double sum;
+} rollup_field;
+
+typedef struct {
+  time_t start;
+  uint32_t count;
+  rollup_field fields[SENSOR_FIELDS];
+} rollup_bucket;
+
+void rollup_store(const sensor_data* data);
+void rollup_from_sample(rollup_bucket* bucket, const sensor_data* data);
+void rollup_merge(rollup_bucket* into, const rollup_bucket* from);
+int rollup_width(enum rollup_level level);
+int rollup_select_level(int resolution);
+time_t rollup_bucket_start(enum rollup_level level, time_t timestamp);
+void rollup_path(enum rollup_level level, time_t timestamp, char* buf, size_t len);
+bool deserializeRollup(char* str, rollup_bucket* bucket);
+time_t rollup_live_start(enum rollup_level level);
+void rollup_recover();
+void rebuildRollups(time_t timestamp, time_t timestamp_end);
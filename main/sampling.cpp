@@ -0,0 +1,107 @@
+/*
+  Adaptive sampling policy. Samples fast while it rains, the pressure falls quickly or the wind
+  gusts, then backs off to the calm interval one doubling per sample once nothing has triggered
+  for the hold time. A fixed rate is a policy with equal minimum and maximum intervals.
+
+  Only the timer callback calls sampling_update, the policy itself is swapped under a spinlock.
+*/
+#include <M5Core2.h>
+#include "sampling.h"
+
+// Pressure trend is measured over this many seconds, shorter windows are mostly sensor noise
+#define PRESSURE_WINDOW 600
+// Weight of each sample in the running wind speed mean
+#define WIND_MEAN_ALPHA 0.1f
+
+static portMUX_TYPE policyMux = portMUX_INITIALIZER_UNLOCKED;
+// Today's 10 s rate while active, down to once a minute when calm. Pressure is in hPa like the
+// BME280 reading, a fall of 1 hPa/h is well into storm territory
+static const sampling_policy defaultPolicy = {10, 60, 0, 1, 10, 600};
+static sampling_policy policy = defaultPolicy;
+static uint16_t interval = 10;
+
+// Running state, only touched by sampling_update
+static float lastRain = NAN;
+static float windMean = NAN;
+static float pressureRef = NAN;
+static time_t pressureRefTime = 0;
+static time_t lastTrigger = 0;
+
+void samplingDefaults(sampling_policy* out) {
+  *out = defaultPolicy;
+}
+
+void sampling_set_policy(const sampling_policy* in) {
+  portENTER_CRITICAL(&policyMux);
+  policy = *in;
+  if(policy.minInterval < 1)
+    policy.minInterval = 1;
+  if(policy.maxInterval < policy.minInterval)
+    policy.maxInterval = policy.minInterval;
+  interval = policy.minInterval; // Start fast, the policy settles on its own
+  portEXIT_CRITICAL(&policyMux);
+}
+
+void sampling_get_policy(sampling_policy* out) {
+  portENTER_CRITICAL(&policyMux);
+  *out = policy;
+  portEXIT_CRITICAL(&policyMux);
+}
+
+// Interval the next sample will be taken at, in seconds
+uint16_t sampling_interval() {
+  portENTER_CRITICAL(&policyMux);
+  uint16_t current = interval;
+  portEXIT_CRITICAL(&policyMux);
+  return current;
+}
+
+static bool triggered(const sensor_data* data, const sampling_policy* p) {
+  bool active = false;
+  // Rainfall is a running total, a drop means the counter was reset
+  if(!isnan(lastRain) && data->rain_fall > lastRain && data->rain_fall - lastRain >= p->rainStep)
+    active = true;
+  lastRain = data->rain_fall;
+
+  if(!isnan(windMean) && data->wind_speed - windMean >= p->gust)
+    active = true;
+  windMean = isnan(windMean) ? data->wind_speed : windMean + (data->wind_speed - windMean) * WIND_MEAN_ALPHA;
+
+  // Zero means the sensor is missing
+  if(data->pressure > 0) {
+    if(isnan(pressureRef)) {
+      pressureRef = data->pressure;
+      pressureRefTime = data->timestamp;
+    }
+    else if(data->timestamp - pressureRefTime >= PRESSURE_WINDOW) {
+      // hPa per hour
+      float rate = (data->pressure - pressureRef) * 3600 / (data->timestamp - pressureRefTime);
+      if(-rate >= p->pressureDrop)
+        lastTrigger = data->timestamp; // Holds on its own, the next check is a whole window away
+      pressureRef = data->pressure;
+      pressureRefTime = data->timestamp;
+    }
+  }
+  return active;
+}
+
+/*
+  Feeds a sample to the policy, returning the interval until the next one in seconds
+*/
+uint16_t sampling_update(const sensor_data* data) {
+  sampling_policy p;
+  sampling_get_policy(&p);
+  if(triggered(data, &p))
+    lastTrigger = data->timestamp;
+
+  uint16_t next;
+  portENTER_CRITICAL(&policyMux);
+  if(lastTrigger != 0 && data->timestamp - lastTrigger < p.hold)
+    next = p.minInterval;
+  else
+    next = min((uint32_t) interval * 2, (uint32_t) p.maxInterval);
+  next = constrain(next, p.minInterval, p.maxInterval);
+  interval = next;
+  portEXIT_CRITICAL(&policyMux);
+  return next;
+}
@@ -0,0 +1,17 @@
+#include <stdint.h>
+#include "record.h"
+
+typedef struct {
+  uint16_t minInterval;  // Seconds between samples while something is happening
+  uint16_t maxInterval;  // Seconds between samples when calm
+  float rainStep;        // Rainfall increase between samples that counts as raining, in mm
+  float pressureDrop;    // Pressure fall rate that counts as a storm coming, in hPa per hour
+  float gust;            // Wind speed above its running mean that counts as a gust, in km/h
+  uint16_t hold;         // Seconds to keep sampling fast after the last trigger
+} sampling_policy;
+
+void samplingDefaults(sampling_policy* policy);
+void sampling_set_policy(const sampling_policy* policy);
+void sampling_get_policy(sampling_policy* policy);
+uint16_t sampling_interval();
+uint16_t sampling_update(const sensor_data* data);
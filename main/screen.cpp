@@ -1,5 +1,6 @@
 #include <M5Core2.h>
 #include "screen.h"
+#include "chart.h"
 #include "helper.h"
 #include "global.h"
 
@@ -65,36 +66,63 @@ void print_weatherkit_data() {
 
   #elif defined(DEBUG)
     // Temperature (BME does not provide a precise reading)
-    if(rand() % 100 > 90) {
-      temp = fmax(24.6, temp + ((rand() % 3)/10.0)-0.1);
-      temp = fmin(temp, 25.5);
-    }
     sprintf(weatherStrbuff, "Temperature: %0.1f [C]      \n", temp);
     writeToScreen(10, temp_row, weatherStrbuff);
 
     // Humidity
-    if(rand() % 100 > 90) {
-      hum = fmax(49, hum + ((rand() % 3)/10.0)-0.1);
-      hum = fmin(hum, 51);
-    }
     sprintf(weatherStrbuff, "Humidity: %0.1f [RH]     \n", hum);
     writeToScreen(10, hum_row, weatherStrbuff);
 
     // Pressure
-    if(rand() % 100 > 90) {
-      pres = fmax(1009, pres + ((rand() % 3)/10.0)-0.1);
-      pres = fmin(pres, 1011);
-    }
     sprintf(weatherStrbuff, "Pressure: %0.1f [hPa]     \n", pres);
     writeToScreen(10, pres_row, weatherStrbuff);
 
   #endif
 }
 
+#if !defined(BME_ENABLE) && defined(DEBUG)
+// Random walk standing in for the BME280, kept going whichever screen is shown
+void simulate_bme() {
+  if(rand() % 100 > 90) {
+    temp = fmax(24.6, temp + ((rand() % 3)/10.0)-0.1);
+    temp = fmin(temp, 25.5);
+  }
+  if(rand() % 100 > 90) {
+    hum = fmax(49, hum + ((rand() % 3)/10.0)-0.1);
+    hum = fmin(hum, 51);
+  }
+  if(rand() % 100 > 90) {
+    pres = fmax(1009, pres + ((rand() % 3)/10.0)-0.1);
+    pres = fmin(pres, 1011);
+  }
+}
+#endif
+
+// Button A shows the current readings, button B the charts
 void display_screen(void* _) {
+  bool showCharts = false;
   while(1) {
+    M5.update();
+    if(M5.BtnA.wasPressed() && showCharts) {
+      showCharts = false;
+      chart_hide();
+      xSemaphoreTake(displayMutex, portMAX_DELAY);
+      M5.Lcd.fillRect(0, rain_row, M5.Lcd.width(), M5.Lcd.height() - 20 - rain_row, BLACK);
+      xSemaphoreGive(displayMutex);
+    }
+    if(M5.BtnB.wasPressed() && !showCharts) {
+      showCharts = true;
+      chart_show();
+    }
+    #if !defined(BME_ENABLE) && defined(DEBUG)
+      simulate_bme();
+    #endif
     print_time();
-    print_weatherkit_data();
+    chart_feed();
+    if(showCharts)
+      chart_draw();
+    else
+      print_weatherkit_data();
     delay(100);
   }
 }
@@ -104,4 +132,5 @@ void init_screen() {
   M5.Lcd.setCursor(10, title_row);
   M5.Lcd.setTextSize(font_size);
   M5.Lcd.print("SparkFun Weather Kit");
+  chart_init();
 }
\ No newline at end of file
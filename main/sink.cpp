@@ -0,0 +1,319 @@
+/*
+  Sink registry. Samples published by the timer are copied into the queue of every registered
+  sink without blocking, each sink task then drains its queue in batches.
+
+  Registering, removing and listing sinks take sinkMutex. The publish path never waits on it: it
+  only holds sinkLock long enough to pin the queues it sends to, and a sink being removed waits
+  for those pins to go before deleting its queue.
+*/
+#include <M5Core2.h>
+#include "sink.h"
+#include "global.h"
+#include "tasks.h"
+
+// Backoff between retries of a failed batch, in milliseconds
+#define SINK_RETRY_MIN 1000
+#define SINK_RETRY_MAX 30 * 1000
+
+typedef struct {
+  Sink* sink;
+  sink_config config;
+  QueueHandle_t queue;
+  TaskHandle_t task;
+  bool active;
+  bool removing;
+  int publishing; // Publishers sending to the queue right now, guarded by sinkLock
+  uint32_t written;
+  uint32_t dropped;
+  uint32_t failed;
+  uint32_t batches;
+  UBaseType_t highWater;
+} sink_entry;
+
+static sink_entry sinks[SINK_MAX];
+// Guards the registry itself, sinks are only accessed by their own task
+static SemaphoreHandle_t sinkMutex = NULL;
+static StaticSemaphore_t sinkMutexBuffer;
+// Guards active, removing, publishing, dropped and highWater against the publish path
+static portMUX_TYPE sinkLock = portMUX_INITIALIZER_UNLOCKED;
+// Profiling hook, NULL unless a benchmark installed one
+static volatile sink_observer observer = NULL;
+
+static sink_entry* findSink(const char* name) {
+  for(int i = 0; i < SINK_MAX; i++) {
+    if(sinks[i].active && strcmp(sinks[i].sink->name(), name) == 0)
+      return &sinks[i];
+  }
+  return NULL;
+}
+
+// Writes a batch, retrying with exponential backoff as allowed by the sink configuration
+static void writeWithRetries(sink_entry* entry, const sensor_data* batch, int count) {
+  uint32_t backoff = SINK_RETRY_MIN;
+  int attempt = 0;
+  while(true) {
+    sink_observer notify = observer;
+    uint32_t start = notify != NULL ? micros() : 0;
+    bool ok = entry->sink->writeBatch(batch, count);
+    if(notify != NULL)
+      notify(entry->sink->name(), batch, count, ok, micros() - start);
+    if(ok)
+      break;
+    attempt++;
+    if(entry->removing || (entry->config.maxRetries != SINK_RETRY_FOREVER && attempt > entry->config.maxRetries)) {
+      entry->failed += count;
+      return;
+    }
+    // Sleep in short steps so a removal doesn't have to wait out the backoff
+    for(uint32_t slept = 0; slept < backoff && !entry->removing; slept += 100)
+      delay(100);
+    backoff = min(backoff * 2, (uint32_t) SINK_RETRY_MAX);
+    entry->sink->open();
+  }
+  entry->written += count;
+  entry->batches++;
+}
+
+static void sink_task(void* arg) {
+  sink_entry* entry = (sink_entry*) arg;
+  sensor_data batch[SINK_BATCH_MAX];
+  entry->sink->open();
+  while(!entry->removing) {
+    // Wait for the first record, then gather more until the batch fills or times out
+    if(xQueueReceive(entry->queue, &batch[0], pdMS_TO_TICKS(1000)) != pdTRUE) {
+      entry->sink->idle();
+      continue;
+    }
+    int count = 1;
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(entry->config.batchTimeout);
+    while(count < entry->config.batchSize) {
+      TickType_t now = xTaskGetTickCount();
+      TickType_t wait = (TickType_t) (deadline - now) > pdMS_TO_TICKS(entry->config.batchTimeout) ? 0 : deadline - now;
+      if(xQueueReceive(entry->queue, &batch[count], wait) != pdTRUE)
+        break;
+      count++;
+    }
+    writeWithRetries(entry, batch, count);
+    if(uxQueueMessagesWaiting(entry->queue) == 0)
+      entry->sink->flush();
+  }
+
+  // Removed from the console, drop whatever is left and free the slot
+  entry->sink->flush();
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  portENTER_CRITICAL(&sinkLock);
+  entry->active = false;
+  portEXIT_CRITICAL(&sinkLock);
+  // A publish that pinned the queue before it went inactive is still sending to it
+  while(true) {
+    portENTER_CRITICAL(&sinkLock);
+    int publishing = entry->publishing;
+    portEXIT_CRITICAL(&sinkLock);
+    if(publishing == 0)
+      break;
+    delay(1);
+  }
+  vQueueDelete(entry->queue);
+  delete entry->sink;
+  entry->sink = NULL;
+  entry->queue = NULL;
+  entry->removing = false;
+  xSemaphoreGive(sinkMutex);
+  vTaskDelete(NULL);
+}
+
+void init_sinks() {
+  sinkMutex = xSemaphoreCreateMutexStatic(&sinkMutexBuffer);
+  if(sinkMutex == NULL)
+    printf("Failed to initialize sink mutex!\n");
+}
+
+// Takes ownership of the sink, which is deleted when removed or if it can't be registered
+bool sink_register(Sink* sink, const sink_config* config) {
+  sink_entry* entry = NULL;
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  if(findSink(sink->name()) != NULL) {
+    xSemaphoreGive(sinkMutex);
+    printf("A sink named '%s' already exists\n", sink->name());
+    delete sink;
+    return false;
+  }
+  for(int i = 0; i < SINK_MAX && entry == NULL; i++) {
+    if(!sinks[i].active)
+      entry = &sinks[i];
+  }
+  if(entry == NULL) {
+    xSemaphoreGive(sinkMutex);
+    printf("No free sink slots\n");
+    delete sink;
+    return false;
+  }
+  memset(entry, 0, sizeof(*entry));
+  entry->sink = sink;
+  entry->config = *config;
+  entry->config.batchSize = constrain(config->batchSize, 1, SINK_BATCH_MAX);
+  entry->queue = xQueueCreate(config->queueLength, sizeof(sensor_data));
+  if(entry->queue == NULL) {
+    xSemaphoreGive(sinkMutex);
+    printf("Not enough memory for the '%s' sink queue\n", sink->name());
+    delete sink;
+    return false;
+  }
+  // The task profile may move it to a core or priority other than what the sink asked for
+  if(!tasks_create(sink_task, sink->name(), config->stackSize, entry, config->priority, &entry->task)) {
+    vQueueDelete(entry->queue);
+    xSemaphoreGive(sinkMutex);
+    printf("Failed to start the '%s' sink task\n", sink->name());
+    delete sink;
+    return false;
+  }
+  // Only now visible to publishers
+  portENTER_CRITICAL(&sinkLock);
+  entry->active = true;
+  portEXIT_CRITICAL(&sinkLock);
+  xSemaphoreGive(sinkMutex);
+  return true;
+}
+
+// Asks a sink to stop, its task frees it once the batch in progress is done
+bool sink_remove(const char* name) {
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  sink_entry* entry = findSink(name);
+  if(entry != NULL) {
+    portENTER_CRITICAL(&sinkLock);
+    entry->removing = true;
+    portEXIT_CRITICAL(&sinkLock);
+  }
+  xSemaphoreGive(sinkMutex);
+  return entry != NULL;
+}
+
+bool sink_exists(const char* name) {
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  bool exists = findSink(name) != NULL;
+  xSemaphoreGive(sinkMutex);
+  return exists;
+}
+
+// Records the outcome of a send to a pinned queue, with sinkLock held
+static void countSend(sink_entry* entry, bool queued, UBaseType_t waiting) {
+  if(!queued)
+    entry->dropped++;
+  else if(waiting > entry->highWater)
+    entry->highWater = waiting;
+}
+
+/*
+  Queues a sample for every sink, never blocking, not even on a console command holding the
+  registry. Full queues count the sample as dropped.
+*/
+void sink_publish(const sensor_data* data) {
+  QueueHandle_t queues[SINK_MAX];
+  portENTER_CRITICAL(&sinkLock);
+  for(int i = 0; i < SINK_MAX; i++) {
+    sink_entry* entry = &sinks[i];
+    queues[i] = NULL;
+    if(!entry->active || entry->removing)
+      continue;
+    entry->publishing++;
+    queues[i] = entry->queue;
+  }
+  portEXIT_CRITICAL(&sinkLock);
+
+  for(int i = 0; i < SINK_MAX; i++) {
+    if(queues[i] == NULL)
+      continue;
+    bool queued = xQueueSend(queues[i], data, 0) == pdTRUE;
+    UBaseType_t waiting = uxQueueMessagesWaiting(queues[i]);
+    portENTER_CRITICAL(&sinkLock);
+    countSend(&sinks[i], queued, waiting);
+    sinks[i].publishing--;
+    portEXIT_CRITICAL(&sinkLock);
+  }
+}
+
+/*
+  Queues a record for a single sink, used to replay stored data. Polls instead of blocking on the
+  queue so the sink can't be freed while we wait on it.
+*/
+bool sink_send(const char* name, const sensor_data* data, TickType_t wait) {
+  TickType_t start = xTaskGetTickCount();
+  while(true) {
+    xSemaphoreTake(sinkMutex, portMAX_DELAY);
+    sink_entry* entry = findSink(name);
+    if(entry == NULL || entry->removing) {
+      xSemaphoreGive(sinkMutex);
+      return false;
+    }
+    bool queued = xQueueSend(entry->queue, data, 0) == pdTRUE;
+    if(queued) {
+      UBaseType_t waiting = uxQueueMessagesWaiting(entry->queue);
+      portENTER_CRITICAL(&sinkLock);
+      countSend(entry, true, waiting);
+      portEXIT_CRITICAL(&sinkLock);
+    }
+    xSemaphoreGive(sinkMutex);
+    if(queued)
+      return true;
+    if(wait != portMAX_DELAY && xTaskGetTickCount() - start >= wait)
+      return false;
+    delay(10);
+  }
+}
+
+// Printed from a copy, so a slow console never holds up the sinks
+void sink_list() {
+  struct {
+    char name[24];
+    const char* health;
+    sink_stats stats;
+  } rows[SINK_MAX];
+  int count = 0;
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  for(int i = 0; i < SINK_MAX; i++) {
+    sink_entry* entry = &sinks[i];
+    if(!entry->active)
+      continue;
+    snprintf(rows[count].name, sizeof(rows[count].name), "%s", entry->sink->name());
+    rows[count].health = entry->removing ? "removing" : entry->sink->healthy() ? "ok" : "failing";
+    rows[count].stats.queued = uxQueueMessagesWaiting(entry->queue);
+    portENTER_CRITICAL(&sinkLock);
+    rows[count].stats.highWater = entry->highWater;
+    rows[count].stats.dropped = entry->dropped;
+    portEXIT_CRITICAL(&sinkLock);
+    rows[count].stats.written = entry->written;
+    rows[count].stats.batches = entry->batches;
+    rows[count].stats.failed = entry->failed;
+    count++;
+  }
+  xSemaphoreGive(sinkMutex);
+
+  printf("%-10s %-8s %6s %6s %8s %8s %8s %8s\n", "name", "health", "queued", "peak", "written", "batches", "dropped", "failed");
+  for(int i = 0; i < count; i++) {
+    printf("%-10s %-8s %6u %6u %8u %8u %8u %8u\n", rows[i].name, rows[i].health,
+           (unsigned) rows[i].stats.queued, (unsigned) rows[i].stats.highWater, (unsigned) rows[i].stats.written,
+           (unsigned) rows[i].stats.batches, (unsigned) rows[i].stats.dropped, (unsigned) rows[i].stats.failed);
+  }
+}
+
+bool sink_get_stats(const char* name, sink_stats* stats) {
+  xSemaphoreTake(sinkMutex, portMAX_DELAY);
+  sink_entry* entry = findSink(name);
+  if(entry != NULL) {
+    stats->written = entry->written;
+    stats->failed = entry->failed;
+    stats->batches = entry->batches;
+    stats->queued = uxQueueMessagesWaiting(entry->queue);
+    stats->capacity = entry->config.queueLength;
+    portENTER_CRITICAL(&sinkLock);
+    stats->dropped = entry->dropped;
+    stats->highWater = entry->highWater;
+    portEXIT_CRITICAL(&sinkLock);
+  }
+  xSemaphoreGive(sinkMutex);
+  return entry != NULL;
+}
+
+void sink_set_observer(sink_observer callback) {
+  observer = callback;
+}
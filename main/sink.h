@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include "record.h"
+
+// Maximum amount of sinks registered at once
+#define SINK_MAX 6
+// Largest batch handed to a sink in one writeBatch call
+#define SINK_BATCH_MAX 16
+// Retry forever, for sinks that must not lose data
+#define SINK_RETRY_FOREVER -1
+
+/*
+  Output destination for samples. Every registered sink runs in its own task, fed by its own
+  bounded queue, so a slow or failing sink only ever drops its own data.
+*/
+class Sink {
+public:
+  virtual ~Sink() {}
+  // Called from the sink task before the first batch, and again after a failed batch
+  virtual bool open() = 0;
+  // Writes a batch of records in time order, returns false if it should be retried
+  virtual bool writeBatch(const sensor_data* batch, int count) = 0;
+  // Called when the queue runs empty and before the sink is removed
+  virtual bool flush() { return true; }
+  // Called when no record arrived for a second, for keepalives and pending acknowledgements
+  virtual void idle() {}
+  virtual bool healthy() = 0;
+  virtual const char* name() = 0;
+};
+
+typedef struct {
+  int queueLength;
+  int batchSize;
+  uint32_t batchTimeout; // Longest wait for a batch to fill, in milliseconds
+  int maxRetries;
+  UBaseType_t priority;
+  uint32_t stackSize;
+} sink_config;
+
+typedef struct {
+  uint32_t written;
+  uint32_t dropped;
+  uint32_t failed;
+  uint32_t batches;
+  UBaseType_t queued;
+  UBaseType_t highWater; // Most records ever waiting in the queue at once
+  UBaseType_t capacity;  // Queue length
+} sink_stats;
+
+// Called from the sink task after every writeBatch attempt, with how long it took in microseconds
+typedef void (*sink_observer)(const char* name, const sensor_data* batch, int count, bool ok, uint32_t elapsed);
+
+bool sink_register(Sink* sink, const sink_config* config);
+bool sink_remove(const char* name);
+bool sink_exists(const char* name);
+void sink_publish(const sensor_data* data);
+bool sink_send(const char* name, const sensor_data* data, TickType_t wait);
+void sink_list();
+bool sink_get_stats(const char* name, sink_stats* stats);
+void sink_set_observer(sink_observer observer);
+void init_sinks();
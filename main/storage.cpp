@@ -1,93 +1,169 @@
 #include <M5Core2.h>
 #include "storage.h"
+#include "rollup.h"
+#include "wal.h"
+#include "columnar.h"
+#include "sink.h"
+#include "sampling.h"
 #include "helper.h"
 #include "global.h"
+#include "logger.h"
 
+// Expected length of a log line when sizing preallocated files, framed lines are around 90 bytes
+#define PREALLOC_LINE_BYTES 100
+// Preallocated files are written in blocks of this size
+#define PREALLOC_BLOCK 512
+// How often maintain_storage runs, in milliseconds
+#define MAINTENANCE_PERIOD 60 * 60 * 1000
 
-RTC_TimeTypeDef RTCtime;
-RTC_DateTypeDef RTCDate;
-sensor_data storageData;
-char SDStrbuff[64];
-
-void store_data(void* _) {
-  while(1) {
-    // Wait to receive data from queue
-    xQueueReceive(storageQueue, &storageData, portMAX_DELAY);
-    clearRegion((M5.Lcd.width()-(11*6))/2, 120, 30);
-    // Create new log every day
-    M5.Rtc.GetDate(&RTCDate);
-    M5.Rtc.GetTime(&RTCtime);
-    sprintf(SDStrbuff, "/weather-data_%d-%02d-%02d.csv", RTCDate.Year, 
-          RTCDate.Month, RTCDate.Date);
-    File file = SD.open(SDStrbuff, FILE_APPEND);
-    if (file) {
-      xSemaphoreTake(storageMutex, portMAX_DELAY);
-      sprintf(SDStrbuff, "%d/%02d/%02d %02d:%02d:%02d", RTCDate.Year,
-          RTCDate.Month, RTCDate.Date, RTCtime.Hours, RTCtime.Minutes,
-          RTCtime.Seconds);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.rain_fall);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.wind_speed);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.wind_direction);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.temperature);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.humidity);
-      file.printf(SDStrbuff);
-      sprintf(SDStrbuff, ",%f", storageData.pressure);
-      file.printf(SDStrbuff);
-
-      file.printf("\n");
-      file.close();
-      xSemaphoreGive(storageMutex);
-      writeToScreen((M5.Lcd.width()-(11*6))/2, 120, "Wrote to SD");
-    } 
-    else {
-      writeToScreen((M5.Lcd.width()-(11*6))/2, 120, "Error writing to file", RED, BLACK);
+// Storage policy, set with the setStorage command
+bool storagePrealloc = false;
+int storageMinFreeMB = 64;
+
+/*
+  CSV sink, appends every record to the daily log and keeps the rollups up to date
+*/
+class CsvSink : public Sink {
+public:
+  bool open() { return true; }
+  bool writeBatch(const sensor_data* batch, int count);
+  bool healthy() { return lastOk; }
+  const char* name() { return "csv"; }
+
+private:
+  bool lastOk = true;
+  char path[40];
+  char recordBuff[RECORD_LINE_MAX];
+};
+
+bool CsvSink::writeBatch(const sensor_data* batch, int count) {
+  int i = 0;
+  lastOk = true;
+  clearRegion((M5.Lcd.width()-(11*6))/2, 120, 30);
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  while(i < count && lastOk) {
+    // Create new log every day, a batch may straddle midnight
+    dataFilePath(batch[i].timestamp, path, sizeof(path));
+    // Write at the logical end of the log rather than appending, the file may be preallocated
+    uint32_t offset = wal_begin(path);
+    File file = SD.open(path, "r+");
+    if(!file) {
+      lastOk = false;
+      break;
     }
-    //delay(2000);
-    clearRegion((M5.Lcd.width()-(11*6))/2, 120, 30);
-    //delay(1000);
+    file.seek(offset);
+    uint32_t end = offset;
+    int first = i;
+    for(; i < count; i++) {
+      char batchPath[40];
+      dataFilePath(batch[i].timestamp, batchPath, sizeof(batchPath));
+      if(strcmp(batchPath, path) != 0)
+        break;
+      // Format the whole line up front so it reaches the card in a single write
+      size_t len = serializeSensorData(&batch[i], recordBuff, sizeof(recordBuff));
+      if(file.write((uint8_t*) recordBuff, len) != len) {
+        lastOk = false;
+        break;
+      }
+      end += len;
+    }
+    file.close();
+    // Only lines that reached the card are committed and rolled up
+    wal_commit(path, end, i - first);
+    for(int j = first; j < i; j++)
+      rollup_store(&batch[j]);
+  }
+  xSemaphoreGive(storageMutex);
+  if(lastOk)
+    writeToScreen((M5.Lcd.width()-(11*6))/2, 120, "Wrote to SD");
+  else
+    writeToScreen((M5.Lcd.width()-(11*6))/2, 120, "Error writing to file", RED, BLACK);
+  return lastOk;
+}
+
+bool start_csv_sink() {
+  sink_config sinkConfig = {
+    .queueLength = STORAGE_QUEUE,
+    .batchSize = 8,
+    .batchTimeout = 0,
+    .maxRetries = 0, // A card that failed once will likely fail again, so keep up with new data instead
+    .priority = 2,
+    .stackSize = 4096,
+  };
+  return sink_register(new CsvSink(), &sinkConfig);
+}
+
+typedef struct {
+  int queued;
+  time_t last;
+  bool failed;
+} replay_progress;
+
+static void queueColumnarData(const sensor_data* data, void* ctx) {
+  replay_progress* progress = (replay_progress*) ctx;
+  if(progress->failed)
+    return;
+  if(!sink_send("influx", data, portMAX_DELAY)) {
+    progress->failed = true;
+    return;
   }
+  progress->queued++;
+  progress->last = data->timestamp;
 }
 
-// Read data from SD card, ranging between two UNIX timestamps, and queue it
-void readDataAndQueue(time_t timestamp, time_t timestamp_end) {
+/*
+  Read data from SD card, ranging between two UNIX timestamps, and queue it. Returns how many
+  records were queued, or -1 if there's no InfluxDB sink, and the timestamp of the last one in last
+*/
+int readDataAndQueue(time_t timestamp, time_t timestamp_end, time_t* last) {
   double diff = difftime(timestamp_end, timestamp);
   struct tm date = *localtime(&timestamp);
   char readBuffer[256];
   size_t read = 0;
+  replay_progress progress = {0, 0, false};
 
   while(diff >= 0) {
     sensor_data data;
-    sprintf(readBuffer, "/weather-data_%d-%02d-%02d.csv", date.tm_year+1900, 
-          date.tm_mon+1, date.tm_mday);
+    dataFilePath(timestamp, readBuffer, sizeof(readBuffer));
     File file = SD.open(readBuffer, FILE_READ);
+    // The CSV may have been dropped to free space, in which case only the columnar file is left
+    if(!file) {
+      size_t bytes = 0;
+      time_t from = timestamp;
+      columnFilePath(timestamp, readBuffer, sizeof(readBuffer));
+      columnar_read(readBuffer, &from, timestamp_end, (1 << SENSOR_FIELDS) - 1,
+                    &queueColumnarData, &progress, &bytes);
+      if(progress.failed) {
+        LOG_WARN(LOG_STORAGE, "No InfluxDB sink to send data to");
+        return -1;
+      }
+    }
     if(file) {
-      printf("Reading file %s\n", readBuffer);
+      LOG_DEBUG(LOG_STORAGE, "Reading file %s", readBuffer);
       while(true) {
-        xSemaphoreTake(storageMutex, portMAX_DELAY);
-        read = file.readBytesUntil('\n', readBuffer, sizeof(readBuffer));
-        xSemaphoreGive(storageMutex);
+        read = readDataLine(file, readBuffer, sizeof(readBuffer));
         // EOL, move forward to next file
         if(read == 0)
           break;
         data = deserializeSensorData(readBuffer);
         // Malformed data, so we move on
         if (!data.init) {
-          printf("Ran into malformed string while reading %s\n", file.name());
+          LOG_WARN(LOG_STORAGE, "Ran into malformed string while reading %s", file.name());
           continue;
         }
-        printf("Reading data from %d\n", data.timestamp);
         // Too early, so we skip this entry
         if(data.timestamp < timestamp)
           continue;
         // Reached the last timestamp, so we exit
         if(data.timestamp > timestamp_end)
           break;
-        xQueueSend(networkQueue, &data, portMAX_DELAY);
+        if(!sink_send("influx", &data, portMAX_DELAY)) {
+          LOG_WARN(LOG_STORAGE, "No InfluxDB sink to send data to");
+          file.close();
+          return -1;
+        }
+        progress.queued++;
+        progress.last = data.timestamp;
       }
       file.close();
     }
@@ -99,4 +175,219 @@ void readDataAndQueue(time_t timestamp, time_t timestamp_end) {
     timestamp = mktime(&date);
     diff = difftime(timestamp_end, timestamp);
   }
+  if(last != NULL)
+    *last = progress.last;
+  return progress.queued;
+}
+
+// Path of the daily log holding the timestamp
+void dataFilePath(time_t timestamp, char* buf, size_t len) {
+  struct tm date;
+  localtime_r(&timestamp, &date);
+  snprintf(buf, len, "/weather-data_%d-%02d-%02d.csv", date.tm_year+1900,
+          date.tm_mon+1, date.tm_mday);
+}
+
+/*
+  Positions a daily log before the first line stamped at or after the timestamp. Lines are
+  appended in time order, so this bisects on byte offsets instead of reading the file from the
+  start. Returns the amount of bytes read while searching.
+*/
+size_t seekDataFile(File& file, time_t timestamp) {
+  char buf[256];
+  size_t low = 0;
+  size_t high = file.size();
+  size_t scanned = 0;
+  while(high - low > sizeof(buf)) {
+    size_t mid = low + (high - low) / 2;
+    xSemaphoreTake(storageMutex, portMAX_DELAY);
+    file.seek(mid);
+    // Skip the partial line we landed on
+    scanned += file.readBytesUntil('\n', buf, sizeof(buf) - 1) + 1;
+    size_t read = file.readBytesUntil('\n', buf, sizeof(buf) - 1);
+    xSemaphoreGive(storageMutex);
+    scanned += read + 1;
+    buf[read] = '\0';
+    // Malformed lines and preallocated space move the upper bound, which only makes the final scan longer
+    sensor_data data = {0};
+    if(buf[0] != '\0')
+      data = deserializeSensorData(buf);
+    if(!data.init || data.timestamp >= timestamp)
+      high = mid;
+    else
+      low = mid;
+  }
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  file.seek(low);
+  if(low > 0)
+    scanned += file.readBytesUntil('\n', buf, sizeof(buf) - 1) + 1;
+  xSemaphoreGive(storageMutex);
+  return scanned;
+}
+
+/*
+  Reads the next line of a daily log without its newline. Returns 0 at the end of the file or once
+  it reaches the zero padding of a preallocated log.
+*/
+size_t readDataLine(File& file, char* buf, size_t len) {
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  size_t read = file.readBytesUntil('\n', buf, len - 1);
+  xSemaphoreGive(storageMutex);
+  if(read == 0 || buf[0] == '\0')
+    return 0;
+  buf[read] = '\0';
+  return read;
+}
+
+/*
+  Size of a preallocated log, enough for a full day at the fastest sampling interval. The timer
+  period is only what adaptive sampling picked for the moment, usually the slowest, and a day that
+  turns stormy would outgrow a log sized from it.
+*/
+static uint32_t preallocSize() {
+  sampling_policy policy;
+  sampling_get_policy(&policy);
+  uint32_t period = policy.minInterval > 0 ? policy.minInterval : 1;
+  uint32_t lines = 24 * 60 * 60 / period + 1;
+  return lines * PREALLOC_LINE_BYTES;
+}
+
+/*
+  Creates a log padded with zeros for a full day, so FAT clusters are allocated up front instead of
+  one at a time while the CSV sink appends. The file is written under a temporary name, taking
+  storageMutex per block, and renamed once complete. Returns false if preallocation is disabled.
+*/
+bool preallocateDataFile(const char* path) {
+  static const uint8_t zeros[PREALLOC_BLOCK] = {0};
+  char tmpPath[40];
+  if(!storagePrealloc)
+    return false;
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  uint32_t size = preallocSize();
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(tmpPath, FILE_WRITE);
+  xSemaphoreGive(storageMutex);
+  if(!file) {
+    LOG_ERROR(LOG_STORAGE, "Failed to preallocate %s", path);
+    return false;
+  }
+  bool ok = true;
+  for(uint32_t written = 0; ok && written < size; written += PREALLOC_BLOCK) {
+    xSemaphoreTake(storageMutex, portMAX_DELAY);
+    ok = file.write(zeros, PREALLOC_BLOCK) == PREALLOC_BLOCK;
+    xSemaphoreGive(storageMutex);
+  }
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  file.close();
+  // The CSV sink may have created the log in the meantime
+  if(ok && !SD.exists(path))
+    ok = SD.rename(tmpPath, path);
+  else
+    SD.remove(tmpPath);
+  xSemaphoreGive(storageMutex);
+  return ok;
+}
+
+void setStoragePolicy(bool prealloc, int minFreeMB) {
+  storagePrealloc = prealloc;
+  storageMinFreeMB = minFreeMB;
+}
+
+// Finds the oldest day before today with a weather-data file of the given extension
+static bool oldestDataFile(const char* extension, time_t* timestamp) {
+  char suffix[8];
+  struct tm today;
+  time_t now = getUnixTimestamp();
+  localtime_r(&now, &today);
+  int todayKey = (today.tm_year + 1900) * 10000 + (today.tm_mon + 1) * 100 + today.tm_mday;
+  int oldestKey = todayKey;
+  snprintf(suffix, sizeof(suffix), ".%s", extension);
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File root = SD.open("/");
+  while(root) {
+    File entry = root.openNextFile();
+    if(!entry)
+      break;
+    const char* name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    int year, month, day;
+    const char* ext = strrchr(name, '.');
+    if(ext && strcmp(ext, suffix) == 0 && sscanf(name, "weather-data_%d-%d-%d.", &year, &month, &day) == 3) {
+      int key = year * 10000 + month * 100 + day;
+      if(key < oldestKey) {
+        struct tm date = {0};
+        date.tm_year = year - 1900;
+        date.tm_mon = month - 1;
+        date.tm_mday = day;
+        date.tm_hour = 12;
+        date.tm_isdst = -1;
+        oldestKey = key;
+        *timestamp = mktime(&date);
+      }
+    }
+    entry.close();
+  }
+  if(root)
+    root.close();
+  xSemaphoreGive(storageMutex);
+  return oldestKey < todayKey;
+}
+
+/*
+  Frees space while the card is below the configured minimum: the oldest raw logs are dropped first,
+  compacting them beforehand if needed, then the oldest columnar files along with their minute rollups.
+*/
+static void freeSpace() {
+  char path[40];
+  uint64_t minFree = (uint64_t) storageMinFreeMB * 1024 * 1024;
+  while(SD.totalBytes() - SD.usedBytes() < minFree) {
+    time_t timestamp;
+    if(oldestDataFile("csv", &timestamp)) {
+      columnFilePath(timestamp, path, sizeof(path));
+      if(!SD.exists(path) && !compactDataFile(timestamp))
+        break;
+      dataFilePath(timestamp, path, sizeof(path));
+    }
+    else if(oldestDataFile("col", &timestamp)) {
+      rollup_path(ROLLUP_MINUTE, timestamp, path, sizeof(path));
+      xSemaphoreTake(storageMutex, portMAX_DELAY);
+      SD.remove(path);
+      xSemaphoreGive(storageMutex);
+      columnFilePath(timestamp, path, sizeof(path));
+    }
+    else {
+      LOG_WARN(LOG_STORAGE, "Storage is below %d MB free with nothing left to delete", storageMinFreeMB);
+      break;
+    }
+    xSemaphoreTake(storageMutex, portMAX_DELAY);
+    bool removed = SD.remove(path);
+    xSemaphoreGive(storageMutex);
+    if(!removed) {
+      LOG_ERROR(LOG_STORAGE, "Failed to remove %s", path);
+      break;
+    }
+    LOG_INFO(LOG_STORAGE, "Removed %s to free space", path);
+  }
+}
+
+/*
+  Background upkeep of the SD card, created at idle priority so it only runs on spare time:
+  compacts closed days, keeps free space above the minimum and preallocates tomorrow's log.
+*/
+void maintain_storage(void* _) {
+  char path[40];
+  while(true) {
+    compactClosedDays();
+    freeSpace();
+    if(storagePrealloc) {
+      dataFilePath(getUnixTimestamp() + 24 * 60 * 60, path, sizeof(path));
+      xSemaphoreTake(storageMutex, portMAX_DELAY);
+      bool exists = SD.exists(path);
+      xSemaphoreGive(storageMutex);
+      if(!exists)
+        preallocateDataFile(path);
+    }
+    delay(MAINTENANCE_PERIOD);
+  }
 }
\ No newline at end of file
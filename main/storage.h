@@ -1,3 +1,13 @@
 #include <time.h>
-void store_data(void* _);
-void readDataAndQueue(time_t timestamp, time_t timestamp_end);
\ No newline at end of file
+#include <M5Core2.h>
+// Queue size for the CSV sink
+#define STORAGE_QUEUE 50
+
+bool start_csv_sink();
+int readDataAndQueue(time_t timestamp, time_t timestamp_end, time_t* last = NULL);
+void dataFilePath(time_t timestamp, char* buf, size_t len);
+size_t seekDataFile(File& file, time_t timestamp);
+size_t readDataLine(File& file, char* buf, size_t len);
+bool preallocateDataFile(const char* path);
+void setStoragePolicy(bool prealloc, int minFreeMB);
+void maintain_storage(void* _);
\ No newline at end of file
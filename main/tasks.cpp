@@ -0,0 +1,265 @@
+/*
+  Task table. Profiles say which core each long running task is pinned to, at what priority and,
+  for tasks allocated at runtime, with how much stack. Tasks a profile doesn't mention keep what
+  their module asked for and run on either core.
+
+  Core 0 also runs the WiFi driver and lwIP, core 1 is where Arduino runs setup(). The sample timer
+  is the "Tmr Svc" task, created by FreeRTOS itself, so only its priority can be set.
+
+  The profile is saved on the SD card and applied at the next boot. Selecting one from the console
+  changes priorities right away, cores only change for tasks started afterwards (sinks registered
+  again) or after a restart, since ESP-IDF can't move a running task to another core.
+*/
+#include <M5Core2.h>
+#include "tasks.h"
+#include "logger.h"
+#include "global.h"
+
+#define TASKS_FILE "/tasks.profile"
+
+static const task_profile profiles[] = {
+  {"default", "What every module asks for, any core", {}},
+  {"sampling", "Low-latency sampling: sampler and CSV log above everything on core 1, network next to WiFi", {
+    {"Tmr Svc", TASK_ANY_CORE, 5, 0},
+    {"csv", 1, 4, 0},
+    {"display_screen", 1, 1, 0},
+    {"maintain_storage", 1, 0, 0},
+    {"influx", 0, 2, 0},
+    {"mqtt", 0, 2, 0},
+    {"udp", 0, 2, 0},
+    {"live", 0, 1, 0},
+    {"httpd", 0, 1, 0},
+    {"resync", 0, 1, 0},
+  }},
+  {"recovery", "Network-heavy recovery: upload and resync first, on core 1 beside WiFi on core 0", {
+    {"influx", 1, 4, 0},
+    {"mqtt", 1, 4, 0},
+    {"resync", 1, 3, 0},
+    {"csv", 1, 2, 0},
+    {"Tmr Svc", TASK_ANY_CORE, 2, 0},
+    {"udp", 0, 1, 0},
+    {"live", 0, 1, 0},
+    {"httpd", 0, 1, 0},
+    {"display_screen", 0, 0, 0},
+    {"maintain_storage", 0, 0, 0},
+  }},
+};
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+typedef struct {
+  char name[16];
+  UBaseType_t priority;
+} task_default;
+
+static const task_profile* active = &profiles[0];
+// Priority every task had before a profile touched it, so switching back restores it
+static task_default defaults[TASKS_MAX];
+static int defaultCount = 0;
+static portMUX_TYPE tasksLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Previous run time counters, for tasks_usage to work out shares since its last call
+static TaskHandle_t previousHandles[TASKS_MAX];
+static uint32_t previousRuntime[TASKS_MAX];
+static uint32_t previousTotal = 0;
+static int previousCount = 0;
+
+static const task_profile* findProfile(const char* name) {
+  for(size_t i = 0; i < PROFILE_COUNT; i++) {
+    if(strcmp(profiles[i].name, name) == 0)
+      return &profiles[i];
+  }
+  return NULL;
+}
+
+// Row of the active profile for a task, NULL if the profile leaves it alone
+const task_spec* tasks_spec(const char* name) {
+  for(int i = 0; i < TASK_PROFILE_ROWS && active->tasks[i].name != NULL; i++) {
+    if(strcmp(active->tasks[i].name, name) == 0)
+      return &active->tasks[i];
+  }
+  return NULL;
+}
+
+const char* tasks_profile() {
+  return active->name;
+}
+
+static void rememberDefault(const char* name, UBaseType_t priority) {
+  portENTER_CRITICAL(&tasksLock);
+  bool known = false;
+  for(int i = 0; i < defaultCount && !known; i++)
+    known = strcmp(defaults[i].name, name) == 0;
+  if(!known && defaultCount < TASKS_MAX) {
+    strncpy(defaults[defaultCount].name, name, sizeof(defaults[defaultCount].name) - 1);
+    defaults[defaultCount].priority = priority;
+    defaultCount++;
+  }
+  portEXIT_CRITICAL(&tasksLock);
+}
+
+static BaseType_t coreOf(const task_spec* spec) {
+  return spec == NULL || spec->core == TASK_ANY_CORE ? tskNO_AFFINITY : spec->core;
+}
+
+// Reads the profile saved by tasks_select, before any table task is created
+void tasks_init() {
+  char name[24] = "";
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(TASKS_FILE, FILE_READ);
+  if(file) {
+    size_t read = file.readBytesUntil('\n', name, sizeof(name) - 1);
+    name[read] = '\0';
+    file.close();
+  }
+  xSemaphoreGive(storageMutex);
+  const task_profile* profile = findProfile(name);
+  if(profile != NULL)
+    active = profile;
+  // Tasks FreeRTOS created before us only get their priority changed
+  for(int i = 0; i < TASK_PROFILE_ROWS && active->tasks[i].name != NULL; i++) {
+    TaskHandle_t task = xTaskGetHandle(active->tasks[i].name);
+    if(task != NULL) {
+      rememberDefault(active->tasks[i].name, uxTaskPriorityGet(task));
+      vTaskPrioritySet(task, active->tasks[i].priority);
+    }
+  }
+  LOG_INFO(LOG_MAIN, "Task profile %s", active->name);
+}
+
+// Statically allocated tasks keep their buffer, the profile only picks the core and priority
+TaskHandle_t tasks_create_static(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                                 UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer) {
+  const task_spec* spec = tasks_spec(name);
+  rememberDefault(name, priority);
+  return xTaskCreateStaticPinnedToCore(code, name, stackSize, param, spec != NULL ? spec->priority : priority,
+                                       stack, buffer, coreOf(spec));
+}
+
+bool tasks_create(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                  UBaseType_t priority, TaskHandle_t* created) {
+  const task_spec* spec = tasks_spec(name);
+  rememberDefault(name, priority);
+  if(spec != NULL) {
+    priority = spec->priority;
+    if(spec->stack != 0)
+      stackSize = spec->stack;
+  }
+  return xTaskCreatePinnedToCore(code, name, stackSize, param, priority, created, coreOf(spec)) == pdPASS;
+}
+
+/*
+  Switches profile and saves it for the next boot. Priorities of running tasks change now, going
+  back to what they were created with when the new profile doesn't mention them.
+*/
+bool tasks_select(const char* name) {
+  const task_profile* profile = findProfile(name);
+  if(profile == NULL)
+    return false;
+  active = profile;
+  for(int i = 0; i < TASK_PROFILE_ROWS && active->tasks[i].name != NULL; i++) {
+    TaskHandle_t task = xTaskGetHandle(active->tasks[i].name);
+    if(task != NULL)
+      rememberDefault(active->tasks[i].name, uxTaskPriorityGet(task));
+  }
+  for(int i = 0; i < defaultCount; i++) {
+    TaskHandle_t task = xTaskGetHandle(defaults[i].name);
+    const task_spec* spec = tasks_spec(defaults[i].name);
+    if(task != NULL)
+      vTaskPrioritySet(task, spec != NULL ? spec->priority : defaults[i].priority);
+  }
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(TASKS_FILE, FILE_WRITE);
+  if(file) {
+    file.print(profile->name);
+    file.print("\n");
+    file.close();
+  }
+  xSemaphoreGive(storageMutex);
+  if(!file)
+    LOG_WARN(LOG_MAIN, "Couldn't save task profile %s", profile->name);
+  LOG_INFO(LOG_MAIN, "Task profile %s", profile->name);
+  return true;
+}
+
+/*
+  Every task the scheduler knows about, including WiFi, lwIP and the idle tasks. CPU shares need
+  CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, without it only priorities and stacks of the table's
+  tasks are known.
+*/
+int tasks_usage(task_usage* usage, int max) {
+  int count = 0;
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+  static TaskStatus_t status[TASKS_MAX];
+  uint32_t total = 0;
+  int found = uxTaskGetSystemState(status, TASKS_MAX, &total);
+  // The counters are 32 bit and wrap, unsigned differences still come out right
+  uint32_t elapsed = total - previousTotal;
+  TaskHandle_t handles[TASKS_MAX];
+  uint32_t runtimes[TASKS_MAX];
+  for(int i = 0; i < found && count < max; i++) {
+    task_usage* task = &usage[count++];
+    strncpy(task->name, status[i].pcTaskName, sizeof(task->name) - 1);
+    task->name[sizeof(task->name) - 1] = '\0';
+#ifdef CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+    task->core = status[i].xCoreID == tskNO_AFFINITY ? TASK_ANY_CORE : status[i].xCoreID;
+#else
+    task->core = TASK_ANY_CORE;
+#endif
+    task->priority = status[i].uxCurrentPriority;
+    task->stackFree = status[i].usStackHighWaterMark;
+    task->runtime = status[i].ulRunTimeCounter;
+    task->cpu = -1;
+    for(int p = 0; p < previousCount; p++) {
+      if(previousHandles[p] == status[i].xHandle && elapsed > 0)
+        task->cpu = 100.0f * (uint32_t) (status[i].ulRunTimeCounter - previousRuntime[p]) / elapsed;
+    }
+    handles[i] = status[i].xHandle;
+    runtimes[i] = status[i].ulRunTimeCounter;
+  }
+  previousCount = min(found, TASKS_MAX);
+  memcpy(previousHandles, handles, previousCount * sizeof(TaskHandle_t));
+  memcpy(previousRuntime, runtimes, previousCount * sizeof(uint32_t));
+  previousTotal = total;
+#else
+  for(int i = 0; i < defaultCount && count < max; i++) {
+    TaskHandle_t handle = xTaskGetHandle(defaults[i].name);
+    if(handle == NULL)
+      continue;
+    const task_spec* spec = tasks_spec(defaults[i].name);
+    task_usage* task = &usage[count++];
+    strncpy(task->name, defaults[i].name, sizeof(task->name) - 1);
+    task->name[sizeof(task->name) - 1] = '\0';
+    task->core = spec != NULL ? spec->core : TASK_ANY_CORE;
+    task->priority = uxTaskPriorityGet(handle);
+    task->stackFree = uxTaskGetStackHighWaterMark(handle);
+    task->runtime = 0;
+    task->cpu = -1;
+  }
+#endif
+  return count;
+}
+
+void tasks_report() {
+  static task_usage usage[TASKS_MAX];
+  printf("Profile %s: %s\n", active->name, active->description);
+  for(size_t i = 0; i < PROFILE_COUNT; i++) {
+    if(&profiles[i] != active)
+      printf("  also %s: %s\n", profiles[i].name, profiles[i].description);
+  }
+  int count = tasks_usage(usage, TASKS_MAX);
+  printf("%-16s %4s %4s %10s %7s\n", "task", "core", "prio", "stack free", "cpu");
+  for(int i = 0; i < count; i++) {
+    char core[8] = "any";
+    char cpu[12] = "-";
+    if(usage[i].core != TASK_ANY_CORE)
+      snprintf(core, sizeof(core), "%d", usage[i].core);
+    if(usage[i].cpu >= 0)
+      snprintf(cpu, sizeof(cpu), "%.1f%%", usage[i].cpu);
+    printf("%-16s %4s %4u %10u %7s\n", usage[i].name, core, (unsigned) usage[i].priority,
+           (unsigned) usage[i].stackFree, cpu);
+  }
+#if !(configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS)
+  printf("CPU time needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS\n");
+#endif
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <M5Core2.h>
+
+// Task free to run on either core
+#define TASK_ANY_CORE -1
+// Most overrides in one profile
+#define TASK_PROFILE_ROWS 12
+// Most tasks tasks_usage and the priority bookkeeping handle
+#define TASKS_MAX 32
+
+typedef struct {
+  const char* name;     // FreeRTOS task name, sink tasks are named after their sink
+  int8_t core;          // TASK_ANY_CORE, or 0 (shared with WiFi and lwIP) or 1
+  UBaseType_t priority;
+  uint32_t stack;       // Bytes, only for tasks allocated at runtime. 0 keeps the configured size
+} task_spec;
+
+typedef struct {
+  const char* name;
+  const char* description;
+  task_spec tasks[TASK_PROFILE_ROWS]; // Ends at the first row without a name
+} task_profile;
+
+typedef struct {
+  char name[16];
+  int core;           // TASK_ANY_CORE if not pinned or not known
+  UBaseType_t priority;
+  uint32_t stackFree; // Least free stack ever, in bytes
+  uint64_t runtime;   // Run time counter, 0 without run time stats
+  float cpu;          // Percent of one core since the previous call, negative if unknown
+} task_usage;
+
+void tasks_init();
+const task_spec* tasks_spec(const char* name);
+const char* tasks_profile();
+bool tasks_select(const char* profile);
+TaskHandle_t tasks_create_static(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                                 UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer);
+bool tasks_create(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                  UBaseType_t priority, TaskHandle_t* created);
+int tasks_usage(task_usage* usage, int max);
+void tasks_report();
@@ -0,0 +1,194 @@
+/*
+  Serial transfer frames:
+    header:  'W' 'X', type, offset (u32), record count (u16), payload length (u16)
+    payload: records, see below
+    trailer: CRC32 of header and payload (u32)
+  All integers are little endian.
+
+  Records are encoded like the columnar files but row by row. The first record of a frame holds
+  its timestamp as a varint and its fields in thousandths as zigzag varints, every following record
+  holds zigzag varint deltas from the previous one. The interval is always a plain varint. Frames
+  don't depend on each other, so a transfer can resume at any frame.
+*/
+#include <math.h>
+#include <string.h>
+#include "transfer.h"
+
+static void putU16(uint8_t* buf, uint16_t value) {
+  buf[0] = value & 0xff;
+  buf[1] = value >> 8;
+}
+
+static void putU32(uint8_t* buf, uint32_t value) {
+  for(int i = 0; i < 4; i++)
+    buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint16_t getU16(const uint8_t* buf) {
+  return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t getU32(const uint8_t* buf) {
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static size_t putVarint(uint8_t* buf, uint32_t value) {
+  size_t len = 0;
+  while(value >= 0x80) {
+    buf[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+  return len;
+}
+
+// Returns the amount of bytes consumed, 0 if the varint runs past the end of the buffer
+static size_t getVarint(const uint8_t* buf, size_t len, uint32_t* value) {
+  *value = 0;
+  for(size_t i = 0; i < len && i < 5; i++) {
+    *value |= (uint32_t) (buf[i] & 0x7f) << (7 * i);
+    if(!(buf[i] & 0x80))
+      return i + 1;
+  }
+  return 0;
+}
+
+static uint32_t zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+// Missing readings are sent as zero, the same as in line protocol
+static int32_t thousandths(float value) {
+  if(isnan(value))
+    return 0;
+  double scaled = round(value * 1000.0);
+  if(scaled > INT32_MAX / 2)
+    return INT32_MAX / 2;
+  if(scaled < INT32_MIN / 2)
+    return INT32_MIN / 2;
+  return (int32_t) scaled;
+}
+
+static void setField(sensor_data* data, int field, float value) {
+  float* fields[SENSOR_FIELDS] = {&data->rain_fall, &data->wind_speed, &data->wind_direction,
+                                  &data->temperature, &data->humidity, &data->pressure};
+  *fields[field] = value;
+}
+
+static size_t finishFrame(uint8_t type, uint32_t offset, uint16_t count, size_t payload, uint8_t* buf) {
+  buf[0] = TRANSFER_MAGIC0;
+  buf[1] = TRANSFER_MAGIC1;
+  buf[2] = type;
+  putU32(buf + 3, offset);
+  putU16(buf + 7, count);
+  putU16(buf + 9, payload);
+  putU32(buf + TRANSFER_HEADER + payload, record_crc32(buf, TRANSFER_HEADER + payload));
+  return TRANSFER_HEADER + payload + TRANSFER_TRAILER;
+}
+
+size_t transfer_start(uint32_t from, uint32_t to, uint32_t offset, uint8_t* buf, size_t len) {
+  if(len < TRANSFER_HEADER + 8 + TRANSFER_TRAILER)
+    return 0;
+  putU32(buf + TRANSFER_HEADER, from);
+  putU32(buf + TRANSFER_HEADER + 4, to);
+  return finishFrame(TRANSFER_START, offset, 0, 8, buf);
+}
+
+size_t transfer_end(uint32_t total, uint8_t* buf, size_t len) {
+  if(len < TRANSFER_HEADER + TRANSFER_TRAILER)
+    return 0;
+  return finishFrame(TRANSFER_END, total, 0, 0, buf);
+}
+
+// Returns the frame length, 0 if the records don't fit in buf
+size_t transfer_data(uint32_t offset, const sensor_data* records, int count, uint8_t* buf, size_t len) {
+  if(count > TRANSFER_RECORDS_MAX || len < (size_t) (TRANSFER_HEADER + count * TRANSFER_RECORD_MAX + TRANSFER_TRAILER))
+    return 0;
+  uint8_t* out = buf + TRANSFER_HEADER;
+  int32_t previous[SENSOR_FIELDS] = {0};
+  uint32_t previousTime = 0;
+  for(int i = 0; i < count; i++) {
+    uint32_t timestamp = (uint32_t) records[i].timestamp;
+    if(i == 0)
+      out += putVarint(out, timestamp);
+    else
+      out += putVarint(out, zigzag((int32_t) (timestamp - previousTime)));
+    previousTime = timestamp;
+    for(int field = 0; field < SENSOR_FIELDS; field++) {
+      int32_t value = thousandths(getSensorField(&records[i], field));
+      out += putVarint(out, zigzag(value - previous[field]));
+      previous[field] = value;
+    }
+    out += putVarint(out, records[i].interval);
+  }
+  return finishFrame(TRANSFER_DATA, offset, count, out - buf - TRANSFER_HEADER, buf);
+}
+
+/*
+  Looks for a frame at the start of buf. Returns its total length with frame filled in, 0 if more
+  bytes are needed, or -1 if buf doesn't start with a valid frame and the first byte should be skipped.
+*/
+int transfer_decode(const uint8_t* buf, size_t len, transfer_frame* frame) {
+  if(len >= 1 && buf[0] != TRANSFER_MAGIC0)
+    return -1;
+  if(len >= 2 && buf[1] != TRANSFER_MAGIC1)
+    return -1;
+  if(len < TRANSFER_HEADER)
+    return 0;
+  uint16_t payload = getU16(buf + 9);
+  if(buf[2] > TRANSFER_END || payload > TRANSFER_PAYLOAD_MAX || getU16(buf + 7) > TRANSFER_RECORDS_MAX)
+    return -1;
+  size_t total = TRANSFER_HEADER + payload + TRANSFER_TRAILER;
+  if(len < total)
+    return 0;
+  if(getU32(buf + TRANSFER_HEADER + payload) != record_crc32(buf, TRANSFER_HEADER + payload))
+    return -1;
+  frame->type = buf[2];
+  frame->offset = getU32(buf + 3);
+  frame->count = getU16(buf + 7);
+  frame->length = payload;
+  frame->payload = buf + TRANSFER_HEADER;
+  return total;
+}
+
+// Decodes the records of a data frame, returns how many or -1 if the payload is malformed
+int transfer_records(const transfer_frame* frame, sensor_data* records, int max) {
+  const uint8_t* in = frame->payload;
+  size_t left = frame->length;
+  int32_t values[SENSOR_FIELDS] = {0};
+  uint32_t timestamp = 0;
+  if(frame->type != TRANSFER_DATA || frame->count > max)
+    return -1;
+  for(int i = 0; i < frame->count; i++) {
+    uint32_t value;
+    size_t used = getVarint(in, left, &value);
+    if(used == 0)
+      return -1;
+    timestamp = i == 0 ? value : timestamp + unzigzag(value);
+    in += used;
+    left -= used;
+    memset(&records[i], 0, sizeof(sensor_data));
+    records[i].timestamp = timestamp;
+    for(int field = 0; field < SENSOR_FIELDS; field++) {
+      used = getVarint(in, left, &value);
+      if(used == 0)
+        return -1;
+      values[field] += unzigzag(value);
+      setField(&records[i], field, values[field] / 1000.0);
+      in += used;
+      left -= used;
+    }
+    used = getVarint(in, left, &value);
+    if(used == 0)
+      return -1;
+    records[i].interval = value;
+    records[i].init = true;
+    in += used;
+    left -= used;
+  }
+  return left == 0 ? frame->count : -1;
+}
@@ -0,0 +1,41 @@
+/*
+  Framed binary format for moving logged records over a serial line. Shared with the host side
+  receiver in tools/, so it's kept free of Arduino dependencies like record.h.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "record.h"
+
+// Every frame starts with these two bytes, a receiver hunts for them after a bad frame
+#define TRANSFER_MAGIC0 'W'
+#define TRANSFER_MAGIC1 'X'
+// Magic, type, offset (u32), record count (u16), payload length (u16)
+#define TRANSFER_HEADER 11
+// Trailing CRC32 over the header and payload
+#define TRANSFER_TRAILER 4
+#define TRANSFER_RECORDS_MAX 32
+// Worst case for a record: timestamp and fields as 5 byte varints, interval as 3
+#define TRANSFER_RECORD_MAX (5 * (SENSOR_FIELDS + 1) + 3)
+#define TRANSFER_PAYLOAD_MAX (TRANSFER_RECORDS_MAX * TRANSFER_RECORD_MAX)
+#define TRANSFER_FRAME_MAX (TRANSFER_HEADER + TRANSFER_PAYLOAD_MAX + TRANSFER_TRAILER)
+
+enum transfer_type {
+  TRANSFER_START, // Payload: from (u32), to (u32), offset is where this transfer resumes
+  TRANSFER_DATA,  // Offset is the index of the first record in the range
+  TRANSFER_END    // Offset is the total amount of records in the range
+};
+
+typedef struct {
+  uint8_t type;
+  uint32_t offset;
+  uint16_t count;
+  uint16_t length;
+  const uint8_t* payload;
+} transfer_frame;
+
+size_t transfer_start(uint32_t from, uint32_t to, uint32_t offset, uint8_t* buf, size_t len);
+size_t transfer_data(uint32_t offset, const sensor_data* records, int count, uint8_t* buf, size_t len);
+size_t transfer_end(uint32_t total, uint8_t* buf, size_t len);
+int transfer_decode(const uint8_t* buf, size_t len, transfer_frame* frame);
+int transfer_records(const transfer_frame* frame, sensor_data* records, int max);
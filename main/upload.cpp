@@ -0,0 +1,262 @@
+/*
+  Upload high-water mark for the InfluxDB sink.
+
+  Every record the server acknowledged with a 204 moves the watermark forward. When an
+  acknowledged record is further past the watermark than its sampling interval, the records in
+  between never made it (dropped from a full queue, lost in a reboot, no sink registered yet) and
+  the interval is remembered as a gap. Resync replays only the gaps, and each gap shrinks as its
+  replayed records are acknowledged in order.
+
+  The state lives in /upload.wm with two slots written alternately, same as the log superblock.
+  The watermark alone is only saved once a minute, so after a power loss up to a minute of data
+  may be sent twice. InfluxDB overwrites points with the same timestamp and tags, so that's harmless.
+*/
+#include <M5Core2.h>
+#include "upload.h"
+#include "storage.h"
+#include "global.h"
+#include "logger.h"
+#include "tasks.h"
+
+#define UPLOAD_FILE "/upload.wm"
+#define UPLOAD_MAGIC 0x314d5755 // "UWM1"
+#define UPLOAD_PERSIST_INTERVAL 60
+
+typedef struct {
+  time_t from;
+  time_t to;
+  time_t replayEnd; // Last record queued by resync, 0 if not replayed yet
+} upload_gap;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+  time_t watermark;
+  int32_t count;
+  upload_gap gaps[UPLOAD_GAPS_MAX];
+  uint32_t crc;
+} upload_state;
+
+// Guarded by uploadMutex, updated from the InfluxDB sink task and the resync task
+static upload_state state = {0};
+static SemaphoreHandle_t uploadMutex = NULL;
+static time_t lastPersist = 0;
+static bool resyncActive = false;
+// Set when queued replays were written off while resync was running, it starts over once done
+static bool resyncAgain = false;
+
+#define RESYNC_STACK 4096*2
+static StaticSemaphore_t uploadMutexBuffer;
+static TaskHandle_t resyncTask = NULL;
+static StaticTask_t resyncTaskBuffer;
+static StackType_t resyncStack[RESYNC_STACK];
+
+static void resync_task(void* _);
+
+static bool readSlot(File& file, int slot, upload_state* out) {
+  file.seek(slot * sizeof(upload_state));
+  if(file.read((uint8_t*) out, sizeof(*out)) != sizeof(*out))
+    return false;
+  return out->magic == UPLOAD_MAGIC && out->crc == record_crc32(out, offsetof(upload_state, crc)) &&
+         out->count >= 0 && out->count <= UPLOAD_GAPS_MAX;
+}
+
+static void persist() {
+  state.magic = UPLOAD_MAGIC;
+  state.sequence++;
+  state.crc = record_crc32(&state, offsetof(upload_state, crc));
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(UPLOAD_FILE, SD.exists(UPLOAD_FILE) ? "r+" : FILE_WRITE);
+  if(file) {
+    file.seek((state.sequence % 2) * sizeof(upload_state));
+    if(file.write((uint8_t*) &state, sizeof(state)) != sizeof(state))
+      LOG_ERROR(LOG_UPLOAD, "Failed to save upload watermark");
+    file.close();
+  }
+  xSemaphoreGive(storageMutex);
+  lastPersist = time(NULL);
+}
+
+void upload_init() {
+  upload_state slots[2];
+  bool valid[2] = {false, false};
+  uploadMutex = xSemaphoreCreateMutexStatic(&uploadMutexBuffer);
+  resyncTask = tasks_create_static(resync_task, "resync", RESYNC_STACK, NULL, 1, resyncStack, &resyncTaskBuffer);
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File file = SD.open(UPLOAD_FILE, FILE_READ);
+  if(file) {
+    valid[0] = readSlot(file, 0, &slots[0]);
+    valid[1] = readSlot(file, 1, &slots[1]);
+    file.close();
+  }
+  xSemaphoreGive(storageMutex);
+  if(valid[0] || valid[1]) {
+    int newest = !valid[0] || (valid[1] && slots[1].sequence > slots[0].sequence) ? 1 : 0;
+    state = slots[newest];
+    // Whatever resync had queued before the reboot is gone
+    for(int i = 0; i < state.count; i++)
+      state.gaps[i].replayEnd = 0;
+  }
+  LOG_INFO(LOG_UPLOAD, "Upload watermark at %ld with %d gaps", (long) state.watermark, (int) state.count);
+}
+
+static void removeGap(int index) {
+  memmove(&state.gaps[index], &state.gaps[index + 1], (state.count - index - 1) * sizeof(upload_gap));
+  state.count--;
+}
+
+// Gaps are added in time order, so the list stays sorted
+static void addGap(time_t from, time_t to) {
+  if(state.count == UPLOAD_GAPS_MAX) {
+    // Merge the two closest neighbours, at worst some acknowledged data is sent again
+    int closest = 0;
+    for(int i = 1; i < state.count - 1; i++) {
+      if(state.gaps[i + 1].from - state.gaps[i].to < state.gaps[closest + 1].from - state.gaps[closest].to)
+        closest = i;
+    }
+    state.gaps[closest].to = state.gaps[closest + 1].to;
+    state.gaps[closest].replayEnd = 0;
+    removeGap(closest + 1);
+  }
+  state.gaps[state.count++] = {from, to, 0};
+}
+
+// Spacing past which a record is taken to have something missing before it
+static time_t gapThreshold(const sensor_data* data) {
+  time_t period = data->interval;
+  if(period == 0)
+    period = pdTICKS_TO_MS(xTimerGetPeriod(threadTimer)) / 1000;
+  return period + period / 2 + 1;
+}
+
+// Called by the InfluxDB sink for every batch the server acknowledged
+void upload_acked(const sensor_data* batch, int count) {
+  bool changed = false;
+  bool newGap = false;
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  for(int i = 0; i < count; i++) {
+    time_t t = batch[i].timestamp;
+    if(t > state.watermark) {
+      // First acknowledgement ever, there's nothing to compare against
+      if(state.watermark != 0 && t - state.watermark > gapThreshold(&batch[i])) {
+        addGap(state.watermark + 1, t - 1);
+        newGap = true;
+        changed = true;
+      }
+      state.watermark = t;
+      continue;
+    }
+    // Replayed record, shrink the gap it belongs to
+    for(int g = 0; g < state.count; g++) {
+      upload_gap* gap = &state.gaps[g];
+      if(t < gap->from || t > gap->to)
+        continue;
+      gap->from = t + 1;
+      if(gap->from > gap->to || (gap->replayEnd != 0 && t >= gap->replayEnd))
+        removeGap(g);
+      changed = true;
+      break;
+    }
+  }
+  if(changed || time(NULL) - lastPersist >= UPLOAD_PERSIST_INTERVAL)
+    persist();
+  xSemaphoreGive(uploadMutex);
+  if(newGap)
+    upload_resync();
+}
+
+// Replays each gap in order, oldest first, every time upload_resync wakes it up
+static void resync_task(void* _) {
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int index = 0;
+    while(true) {
+      xSemaphoreTake(uploadMutex, portMAX_DELAY);
+      // Skip gaps already queued, they close as their acknowledgements come in
+      while(index < state.count && state.gaps[index].replayEnd != 0)
+        index++;
+      if(index >= state.count && resyncAgain) {
+        resyncAgain = false;
+        index = 0;
+        xSemaphoreGive(uploadMutex);
+        continue;
+      }
+      if(index >= state.count) {
+        resyncActive = false;
+        xSemaphoreGive(uploadMutex);
+        break;
+      }
+      upload_gap gap = state.gaps[index];
+      xSemaphoreGive(uploadMutex);
+
+      time_t last = 0;
+      LOG_INFO(LOG_UPLOAD, "Resyncing %ld to %ld", (long) gap.from, (long) gap.to);
+      int queued = readDataAndQueue(gap.from, gap.to, &last);
+
+      xSemaphoreTake(uploadMutex, portMAX_DELAY);
+      if(queued < 0) {
+        resyncActive = false;
+        xSemaphoreGive(uploadMutex);
+        break;
+      }
+      // The gap may have moved while we read, it's identified by its end
+      for(int g = 0; g < state.count; g++) {
+        if(state.gaps[g].to != gap.to)
+          continue;
+        if(queued == 0)
+          removeGap(g); // Nothing was logged in it, the station was off
+        else
+          state.gaps[g].replayEnd = last;
+        persist();
+        break;
+      }
+      xSemaphoreGive(uploadMutex);
+    }
+  }
+}
+
+// Starts replaying the gaps in the background, false if there's nothing to do or it's running
+bool upload_resync() {
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  bool start = !resyncActive && state.count > 0;
+  if(start)
+    resyncActive = true;
+  xSemaphoreGive(uploadMutex);
+  if(start)
+    xTaskNotifyGive(resyncTask);
+  return start;
+}
+
+/*
+  Called by the InfluxDB sink whenever it (re)connects, including when it was just registered.
+  Replays queued before may have gone with a failed batch or a removed sink and would otherwise
+  show as queued forever, so every gap is replayed again. At worst that sends some records twice.
+*/
+void upload_sink_opened() {
+  bool requeued = false;
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  for(int i = 0; i < state.count; i++) {
+    if(state.gaps[i].replayEnd != 0) {
+      state.gaps[i].replayEnd = 0;
+      requeued = true;
+    }
+  }
+  if(requeued && resyncActive)
+    resyncAgain = true;
+  xSemaphoreGive(uploadMutex);
+  upload_resync();
+}
+
+void upload_report() {
+  char buf[32];
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  formatTimestamp(state.watermark, buf, sizeof(buf));
+  printf("Acknowledged up to %s, %d gaps%s\n", buf, (int) state.count, resyncActive ? ", resync running" : "");
+  for(int i = 0; i < state.count; i++) {
+    char end[32];
+    formatTimestamp(state.gaps[i].from, buf, sizeof(buf));
+    formatTimestamp(state.gaps[i].to, end, sizeof(end));
+    printf("  %s - %s%s\n", buf, end, state.gaps[i].replayEnd != 0 ? " (queued)" : "");
+  }
+  xSemaphoreGive(uploadMutex);
+}
@@ -0,0 +1,11 @@
+#include <time.h>
+#include "record.h"
+
+// Unacknowledged intervals remembered at most, the closest ones are merged past this
+#define UPLOAD_GAPS_MAX 32
+
+void upload_init();
+void upload_acked(const sensor_data* batch, int count);
+bool upload_resync();
+void upload_sink_opened();
+void upload_report();
@@ -0,0 +1,231 @@
+/*
+  Crash safety for the daily logs.
+
+  Every line is framed with its length and CRC (see serializeSensorData), and a small superblock
+  in /weather-data.sb records which log is being appended to and the offset up to which it is known
+  to be durable. The superblock has two slots written alternately with a sequence number and CRC,
+  so a power loss while checkpointing leaves the previous slot intact.
+
+  On boot wal_recover only scans the log from the last checkpoint, which is at most
+  WAL_CHECKPOINT_RECORDS lines behind, and truncates it at the first torn line. Preallocated logs
+  have the torn bytes zeroed instead, keeping their size.
+
+  Since logs may be preallocated, the logical end of the active log (where the next line goes) is
+  tracked here instead of relying on the file size.
+*/
+#include <M5Core2.h>
+#include <unistd.h>
+#include "wal.h"
+#include "record.h"
+#include "helper.h"
+#include "global.h"
+#include "logger.h"
+
+#define WAL_SUPERBLOCK "/weather-data.sb"
+#define WAL_MAGIC 0x31425357 // "WSB1"
+#define WAL_SLOT_SIZE 64
+// Where the SD card is mounted in the VFS, needed for truncate()
+#define SD_MOUNTPOINT "/sd"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+  char path[40];
+  uint32_t committed;
+  uint32_t crc;
+} wal_superblock;
+
+// Last checkpoint, only touched while holding storageMutex
+static wal_superblock superblock = {0};
+static uint32_t uncheckpointed = 0;
+static uint32_t logicalEnd = 0;
+
+// Preallocated logs end with zero padding instead of a newline
+static bool isPreallocated(File& file) {
+  uint8_t last = 0;
+  if(file.size() == 0)
+    return false;
+  file.seek(file.size() - 1);
+  file.read(&last, 1);
+  return last == 0;
+}
+
+// End of the last line of a log, scanning a preallocated one from the start for its padding
+static uint32_t findLogicalEnd(File& file) {
+  char line[RECORD_LINE_MAX];
+  if(!isPreallocated(file))
+    return file.size();
+  uint32_t offset = 0;
+  file.seek(0);
+  while(offset < file.size()) {
+    size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    if(read == 0 || line[0] == '\0')
+      break;
+    offset += read + 1;
+  }
+  return offset;
+}
+
+static bool readSlot(File& file, int slot, wal_superblock* sb) {
+  file.seek(slot * WAL_SLOT_SIZE);
+  if(file.read((uint8_t*) sb, sizeof(*sb)) != sizeof(*sb))
+    return false;
+  return sb->magic == WAL_MAGIC && sb->crc == record_crc32(sb, offsetof(wal_superblock, crc));
+}
+
+static void writeCheckpoint(const char* path, uint32_t offset) {
+  uint8_t slot[WAL_SLOT_SIZE] = {0};
+  bool exists = SD.exists(WAL_SUPERBLOCK);
+  superblock.magic = WAL_MAGIC;
+  superblock.sequence++;
+  strncpy(superblock.path, path, sizeof(superblock.path) - 1);
+  superblock.path[sizeof(superblock.path) - 1] = '\0';
+  superblock.committed = offset;
+  superblock.crc = record_crc32(&superblock, offsetof(wal_superblock, crc));
+  memcpy(slot, &superblock, sizeof(superblock));
+
+  File file = SD.open(WAL_SUPERBLOCK, exists ? "r+" : FILE_WRITE);
+  if(!file) {
+    LOG_ERROR(LOG_WAL, "Failed to open superblock");
+    return;
+  }
+  file.seek((superblock.sequence % 2) * WAL_SLOT_SIZE);
+  file.write(slot, sizeof(slot));
+  file.close();
+  uncheckpointed = 0;
+}
+
+/*
+  Called by the CSV sink before writing to a log, returns the offset the next line goes to. Switching
+  to a new log is checkpointed first, so recovery always knows which file may hold a torn line.
+  Missing logs are created empty here, preallocation is left to maintain_storage so it never
+  stalls the CSV sink.
+*/
+uint32_t wal_begin(const char* path) {
+  if(strncmp(path, superblock.path, sizeof(superblock.path)) == 0)
+    return logicalEnd;
+  File file = SD.open(path, FILE_READ);
+  if(file) {
+    logicalEnd = findLogicalEnd(file);
+    file.close();
+  }
+  else {
+    logicalEnd = 0;
+    file = SD.open(path, FILE_WRITE);
+    file.close();
+  }
+  writeCheckpoint(path, logicalEnd);
+  return logicalEnd;
+}
+
+// Called by the CSV sink once lines were written and the log closed
+void wal_commit(const char* path, uint32_t offset, uint32_t records) {
+  logicalEnd = offset;
+  uncheckpointed += records;
+  if(uncheckpointed >= WAL_CHECKPOINT_RECORDS)
+    writeCheckpoint(path, offset);
+}
+
+// Scans the log past the last checkpoint and truncates it at the first invalid line, returns the lines scanned
+uint32_t wal_recover() {
+  char line[RECORD_LINE_MAX];
+  char fullPath[48];
+  wal_superblock slots[2];
+  unsigned long startTime = millis();
+
+  xSemaphoreTake(storageMutex, portMAX_DELAY);
+  File sbFile = SD.open(WAL_SUPERBLOCK, FILE_READ);
+  if(!sbFile) {
+    xSemaphoreGive(storageMutex);
+    LOG_INFO(LOG_WAL, "No superblock found, skipping log recovery");
+    return 0;
+  }
+  bool valid0 = readSlot(sbFile, 0, &slots[0]);
+  bool valid1 = readSlot(sbFile, 1, &slots[1]);
+  sbFile.close();
+  if(!valid0 && !valid1) {
+    xSemaphoreGive(storageMutex);
+    LOG_WARN(LOG_WAL, "Superblock is corrupt, skipping log recovery");
+    return 0;
+  }
+  if(valid0 && (!valid1 || slots[0].sequence > slots[1].sequence))
+    superblock = slots[0];
+  else
+    superblock = slots[1];
+
+  File file = SD.open(superblock.path, FILE_READ);
+  if(!file) {
+    xSemaphoreGive(storageMutex);
+    return 0;
+  }
+  uint32_t size = file.size();
+  // The log shrank behind our back, nothing we can trust past the start
+  uint32_t offset = superblock.committed <= size ? superblock.committed : 0;
+  uint32_t scanned = 0;
+  file.seek(offset);
+  while(offset < size) {
+    size_t read = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[read] = '\0';
+    // A line is only complete if the newline made it to the card, and never holds zeros, which is
+    // where a preallocated log was cut
+    bool terminated = offset + read < size && read < sizeof(line) - 1 && strlen(line) == read;
+    // Everything past a checkpoint was written framed, so an unframed line is a torn one too
+    if(read == 0 || !terminated || strstr(line, ",*") == NULL || !unframeRecord(line))
+      break;
+    offset += read + 1;
+    scanned++;
+  }
+
+  if(offset < size && isPreallocated(file)) {
+    // Zero everything past the last good line up to where the padding starts. A corrupt line may
+    // be followed by more written before the power went, or hold zeros itself, so the padding only
+    // starts after a run of zeros longer than any line.
+    uint8_t torn[RECORD_LINE_MAX];
+    uint32_t at = offset;
+    uint32_t end = offset;
+    file.seek(offset);
+    while(at - end < sizeof(torn)) {
+      size_t len = file.read(torn, sizeof(torn));
+      if(len == 0)
+        break;
+      for(size_t i = 0; i < len; i++)
+        if(torn[i] != 0)
+          end = at + i + 1;
+      at += len;
+    }
+    file.close();
+    file = SD.open(superblock.path, "r+");
+    memset(torn, 0, sizeof(torn));
+    file.seek(offset);
+    for(at = offset; at < end; at += sizeof(torn))
+      file.write(torn, min((uint32_t) sizeof(torn), end - at));
+    uint32_t dirty = end - offset;
+    if(dirty > 0)
+      LOG_WARN(LOG_WAL, "Cleared torn write in %s at %u (%u bytes)", superblock.path, (unsigned) offset, (unsigned) dirty);
+    size = offset;
+  }
+  file.close();
+
+  if(offset < size) {
+    snprintf(fullPath, sizeof(fullPath), SD_MOUNTPOINT "%s", superblock.path);
+    if(truncate(fullPath, offset) != 0)
+      LOG_ERROR(LOG_WAL, "Failed to truncate %s", superblock.path);
+    else
+      LOG_WARN(LOG_WAL, "Truncated torn write in %s at %u (%u bytes dropped)", superblock.path,
+             (unsigned) offset, (unsigned) (size - offset));
+  }
+  logicalEnd = offset;
+  writeCheckpoint(superblock.path, offset);
+  xSemaphoreGive(storageMutex);
+  LOG_INFO(LOG_WAL, "Log recovery scanned %u records in %lu ms", (unsigned) scanned, millis() - startTime);
+  return scanned;
+}
+
+// Log being appended to and its logical end, false if there is none yet. Needs storageMutex
+bool wal_active(char* path, size_t len, uint32_t* end) {
+  if(superblock.magic != WAL_MAGIC)
+    return false;
+  snprintf(path, len, "%s", superblock.path);
+  *end = logicalEnd;
+  return true;
+}
@@ -0,0 +1,10 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Records appended between two superblock checkpoints, bounds the boot time recovery scan
+#define WAL_CHECKPOINT_RECORDS 16
+
+uint32_t wal_begin(const char* path);
+void wal_commit(const char* path, uint32_t offset, uint32_t records);
+uint32_t wal_recover();
+bool wal_active(char* path, size_t len, uint32_t* end);
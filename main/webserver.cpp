@@ -0,0 +1,503 @@
+/*
+  Embedded HTTP server, mostly for a technician laptop joined to the station's access point.
+
+    GET /data?from=&to=&format=csv|lp|bin&location=
+      Every logged sample in [from, to], straight from the SD card. Times are Unix seconds or
+      "YYYY/MM/DD HH:MM:SS" (URL encoded), defaulting to the start of today and now.
+    GET /latest
+      The newest sample as JSON.
+    GET /events?wind=1
+      Server-sent events, a "sample" event for every new sample and, with wind=1, a "wind" event
+      every second in between.
+    GET /
+      A dashboard page showing the live feed.
+
+  Exports are sent with chunked transfer encoding from one fixed buffer, so a whole day is never
+  held in RAM. Days that were compacted are read from their columnar file instead.
+
+  The binary format is an 8 byte header ("WBIN", version, record size, 2 reserved bytes) followed
+  by little endian records: uint32 timestamp, the six fields as float32 in storage column order,
+  uint16 interval.
+
+  Live events go out through a sink of their own. Its task encodes each event once and writes it
+  to every subscriber without blocking, a client whose socket buffer is full is disconnected, so
+  the sampler never waits on a browser.
+*/
+#include <M5Core2.h>
+#include "esp_http_server.h"
+#include "lwip/sockets.h"
+#include "webserver.h"
+#include "sink.h"
+#include "storage.h"
+#include "columnar.h"
+#include "history.h"
+#include "helper.h"
+#include "logger.h"
+#include "tasks.h"
+#include "global.h"
+
+#define EXPORT_RECORD_BYTES 30
+#define WEBSERVER_STACK 8192
+// Only the newest samples matter to a live feed
+#define LIVE_QUEUE 4
+
+enum export_format { FORMAT_CSV, FORMAT_LP, FORMAT_BIN };
+
+typedef struct {
+  httpd_req_t* req;
+  enum export_format format;
+  char location[32];
+  size_t fill;
+  size_t sent;
+  uint32_t records;
+  bool failed;
+  char chunk[EXPORT_CHUNK];
+} export_stream;
+
+typedef struct {
+  int fd; // -1 if the slot is free
+  bool wind;
+} live_client;
+
+static httpd_handle_t server = NULL;
+// The server runs one handler at a time on its own task, so a single stream is enough
+static export_stream stream;
+// Guarded by liveMutex, written by the server task and read by the live sink task
+static live_client liveClients[LIVE_CLIENTS];
+static SemaphoreHandle_t liveMutex = NULL;
+static StaticSemaphore_t liveMutexBuffer;
+
+// Served from flash as is
+static const char dashboardPage[] = R"(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><meta name="viewport" content="width=device-width">
+<title>Weather station</title>
+<style>body{font-family:sans-serif;margin:2em}td{padding:.2em 1em}#state{color:gray}</style>
+</head><body>
+<h2>Weather station</h2>
+<p id="state">Connecting...</p>
+<table id="values"></table>
+<p>Wind now: <span id="wind">-</span></p>
+<p><a href="/data?format=csv">Today as CSV</a> | <a href="/data?format=lp">Today as line protocol</a></p>
+<script>
+const table = document.getElementById("values");
+const source = new EventSource("/events?wind=1");
+source.onopen = () => document.getElementById("state").textContent = "Live";
+source.onerror = () => document.getElementById("state").textContent = "Reconnecting...";
+source.addEventListener("sample", e => {
+  const sample = JSON.parse(e.data);
+  table.innerHTML = "";
+  for(const key in sample)
+    table.insertRow().innerHTML = "<td>" + key + "</td><td>" + sample[key] + "</td>";
+});
+source.addEventListener("wind", e => {
+  const wind = JSON.parse(e.data);
+  document.getElementById("wind").textContent = wind.wind_speed.toFixed(1) + " km/h at " + wind.wind_direction + "\u00b0";
+});
+</script>
+</body></html>
+)";
+
+static void flushChunk(export_stream* out) {
+  if(out->fill == 0 || out->failed)
+    return;
+  if(httpd_resp_send_chunk(out->req, out->chunk, out->fill) != ESP_OK) {
+    // The client went away, the rest of the range is skipped
+    out->failed = true;
+    return;
+  }
+  out->sent += out->fill;
+  out->fill = 0;
+}
+
+static void putU32(uint8_t* buf, uint32_t value) {
+  memcpy(buf, &value, 4);
+}
+
+static void appendRecord(const sensor_data* data, export_stream* out) {
+  // Line protocol is the longest format
+  char line[LINE_PROTOCOL_MAX];
+  size_t len = 0;
+  if(out->failed)
+    return;
+  if(out->format == FORMAT_CSV) {
+    // Plain payload, the length and CRC frame only matter on the card
+    len = serializeSensorData(data, line, sizeof(line));
+    if(len > 0) {
+      line[len - 1] = '\0';
+      unframeRecord(line);
+      len = strlen(line);
+      line[len++] = '\n';
+    }
+  }
+  else if(out->format == FORMAT_LP) {
+    len = formatLineProtocol(data, out->location, line, sizeof(line));
+  }
+  else {
+    uint8_t* record = (uint8_t*) line;
+    putU32(record, (uint32_t) data->timestamp);
+    for(int i = 0; i < SENSOR_FIELDS; i++) {
+      float value = getSensorField(data, i);
+      memcpy(record + 4 + i * 4, &value, 4);
+    }
+    memcpy(record + 4 + SENSOR_FIELDS * 4, &data->interval, 2);
+    len = EXPORT_RECORD_BYTES;
+  }
+  if(len == 0)
+    return;
+  if(out->fill + len > sizeof(out->chunk)) {
+    flushChunk(out);
+    // A failed send leaves the chunk full
+    if(out->failed)
+      return;
+  }
+  memcpy(out->chunk + out->fill, line, len);
+  out->fill += len;
+  out->records++;
+}
+
+static void appendColumnar(const sensor_data* data, void* ctx) {
+  appendRecord(data, (export_stream*) ctx);
+}
+
+// Streams every logged sample in [from, to] one day file at a time
+static void exportRange(export_stream* out, time_t from, time_t to) {
+  char readBuffer[256];
+  struct tm date;
+  localtime_r(&from, &date);
+  time_t timestamp = from;
+  while(timestamp <= to && !out->failed) {
+    size_t bytes = 0;
+    columnFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    bool columnar = columnar_read(readBuffer, &timestamp, to, 0xFF, &appendColumnar, out, &bytes);
+    dataFilePath(timestamp, readBuffer, sizeof(readBuffer));
+    File file = columnar ? File() : SD.open(readBuffer, FILE_READ);
+    if(file) {
+      seekDataFile(file, timestamp);
+      while(!out->failed && readDataLine(file, readBuffer, sizeof(readBuffer)) > 0) {
+        sensor_data data = deserializeSensorData(readBuffer);
+        if(!data.init || data.timestamp < timestamp)
+          continue;
+        if(data.timestamp > to)
+          break;
+        appendRecord(&data, out);
+      }
+      file.close();
+    }
+    // Advance day by 1 and set time to 0
+    date.tm_mday += 1;
+    date.tm_sec = 0;
+    date.tm_min = 0;
+    date.tm_hour = 0;
+    date.tm_isdst = -1;
+    timestamp = mktime(&date);
+  }
+  flushChunk(out);
+}
+
+// Decodes %XX escapes and '+' in place
+static void urlDecode(char* str) {
+  char* out = str;
+  for(char* in = str; *in != '\0'; in++) {
+    if(*in == '%' && isxdigit((unsigned char) in[1]) && isxdigit((unsigned char) in[2])) {
+      char hex[3] = {in[1], in[2], '\0'};
+      *out++ = (char) strtol(hex, NULL, 16);
+      in += 2;
+    }
+    else {
+      *out++ = *in == '+' ? ' ' : *in;
+    }
+  }
+  *out = '\0';
+}
+
+// Unix seconds or the console's timestamp format, keeps the default if the key is missing
+static bool queryTime(const char* query, const char* key, time_t* timestamp) {
+  char value[40];
+  if(httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK)
+    return true;
+  urlDecode(value);
+  char* end;
+  long seconds = strtol(value, &end, 10);
+  if(end != value && *end == '\0') {
+    *timestamp = seconds;
+    return true;
+  }
+  return parseTimestamp(value, timestamp);
+}
+
+static esp_err_t data_handler(httpd_req_t* req) {
+  char query[160] = "";
+  char format[8] = "csv";
+  time_t to = getUnixTimestamp();
+  struct tm today;
+  localtime_r(&to, &today);
+  today.tm_hour = 0;
+  today.tm_min = 0;
+  today.tm_sec = 0;
+  today.tm_isdst = -1;
+  time_t from = mktime(&today);
+
+  export_stream* out = &stream;
+  out->req = req;
+  out->fill = 0;
+  out->sent = 0;
+  out->records = 0;
+  out->failed = false;
+  strcpy(out->location, "test");
+  if(httpd_req_get_url_query_len(req) < sizeof(query))
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+  httpd_query_key_value(query, "format", format, sizeof(format));
+  httpd_query_key_value(query, "location", out->location, sizeof(out->location));
+  if(!queryTime(query, "from", &from) || !queryTime(query, "to", &to) || from > to)
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad time range");
+  if(strcmp(format, "csv") == 0) {
+    out->format = FORMAT_CSV;
+    httpd_resp_set_type(req, "text/csv");
+  }
+  else if(strcmp(format, "lp") == 0) {
+    out->format = FORMAT_LP;
+    httpd_resp_set_type(req, "text/plain");
+  }
+  else if(strcmp(format, "bin") == 0) {
+    out->format = FORMAT_BIN;
+    httpd_resp_set_type(req, "application/octet-stream");
+  }
+  else {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Format must be csv, lp or bin");
+  }
+
+  uint32_t started = millis();
+  if(out->format == FORMAT_CSV) {
+    const char* header = "time,rain_fall,wind_speed,wind_direction,temperature,humidity,pressure,interval\n";
+    out->fill = strlen(header);
+    memcpy(out->chunk, header, out->fill);
+  }
+  else if(out->format == FORMAT_BIN) {
+    memcpy(out->chunk, "WBIN", 4);
+    out->chunk[4] = 1;
+    out->chunk[5] = EXPORT_RECORD_BYTES;
+    out->chunk[6] = 0;
+    out->chunk[7] = 0;
+    out->fill = 8;
+  }
+  exportRange(out, from, to);
+  if(!out->failed)
+    httpd_resp_send_chunk(req, NULL, 0);
+
+  uint32_t elapsed = millis() - started;
+  if(elapsed == 0)
+    elapsed = 1;
+  if(out->failed)
+    LOG_WARN(LOG_HTTP, "Export aborted by client after %u bytes", (unsigned) out->sent);
+  LOG_INFO(LOG_HTTP, "Exported %u records, %u bytes in %u ms (%u B/s)", (unsigned) out->records,
+           (unsigned) out->sent, (unsigned) elapsed, (unsigned) ((uint64_t) out->sent * 1000 / elapsed));
+  return out->failed ? ESP_FAIL : ESP_OK;
+}
+
+// One line of JSON, shared by /latest and the live feed
+static size_t formatSampleJson(const sensor_data* data, char* buf, size_t len) {
+  char timeBuf[24];
+  formatTimestamp(data->timestamp, timeBuf, sizeof(timeBuf));
+  size_t written = snprintf(buf, len, "{\"timestamp\":%ld,\"time\":\"%s\"", (long) data->timestamp, timeBuf);
+  for(int i = 0; i < SENSOR_FIELDS && written < len; i++)
+    written += snprintf(buf + written, len - written, ",\"%s\":%.3f", sensorFieldNames[i], getSensorField(data, i));
+  if(written < len)
+    written += snprintf(buf + written, len - written, ",\"interval\":%u}", (unsigned) data->interval);
+  return written < len ? written : 0;
+}
+
+// Newest sample in RAM, false before the first one
+static bool latestSample(sensor_data* data) {
+  int count = history_count();
+  return count > 0 && history_get(count - 1, data);
+}
+
+static esp_err_t latest_handler(httpd_req_t* req) {
+  char json[SAMPLE_JSON_MAX];
+  sensor_data data;
+  if(!latestSample(&data)) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "No sample yet", HTTPD_RESP_USE_STRLEN);
+  }
+  formatSampleJson(&data, json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  return httpd_resp_send(req, json, HTTPD_RESP_USE_STRLEN);
+}
+
+static esp_err_t dashboard_handler(httpd_req_t* req) {
+  httpd_resp_set_type(req, "text/html");
+  return httpd_resp_send(req, dashboardPage, sizeof(dashboardPage) - 1);
+}
+
+static size_t formatSampleEvent(const sensor_data* data, char* buf, size_t len) {
+  char json[SAMPLE_JSON_MAX];
+  if(formatSampleJson(data, json, sizeof(json)) == 0)
+    return 0;
+  int written = snprintf(buf, len, "id: %ld\nevent: sample\ndata: %s\n\n", (long) data->timestamp, json);
+  return written > 0 && (size_t) written < len ? written : 0;
+}
+
+/*
+  Answers with the event stream headers and keeps the socket. Nothing else is read from it,
+  the live sink writes to it until either side closes it.
+*/
+static esp_err_t events_handler(httpd_req_t* req) {
+  static const char headers[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                                "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\n\r\n"
+                                "retry: 5000\n\n";
+  char query[32] = "";
+  char wind[4] = "0";
+  char event[LIVE_EVENT_MAX];
+  sensor_data data;
+  if(httpd_req_get_url_query_len(req) < sizeof(query))
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+  httpd_query_key_value(query, "wind", wind, sizeof(wind));
+
+  int slot = -1;
+  xSemaphoreTake(liveMutex, portMAX_DELAY);
+  for(int i = 0; i < LIVE_CLIENTS && slot < 0; i++) {
+    if(liveClients[i].fd < 0)
+      slot = i;
+  }
+  xSemaphoreGive(liveMutex);
+  if(slot < 0) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "Too many live clients", HTTPD_RESP_USE_STRLEN);
+  }
+  if(httpd_send(req, headers, sizeof(headers) - 1) != sizeof(headers) - 1)
+    return ESP_FAIL;
+  // Start with the newest sample rather than a blank page until the next one
+  if(latestSample(&data)) {
+    size_t len = formatSampleEvent(&data, event, sizeof(event));
+    if(len > 0 && httpd_send(req, event, len) != (int) len)
+      return ESP_FAIL;
+  }
+  int fd = httpd_req_to_sockfd(req);
+  xSemaphoreTake(liveMutex, portMAX_DELAY);
+  liveClients[slot].fd = fd;
+  liveClients[slot].wind = strcmp(wind, "1") == 0;
+  xSemaphoreGive(liveMutex);
+  LOG_INFO(LOG_HTTP, "Live client %d connected", fd);
+  return ESP_OK;
+}
+
+// Every closed session passes through here, a live client's slot must be freed before its fd is reused
+static void onClose(httpd_handle_t handle, int fd) {
+  xSemaphoreTake(liveMutex, portMAX_DELAY);
+  for(int i = 0; i < LIVE_CLIENTS; i++) {
+    if(liveClients[i].fd == fd) {
+      liveClients[i].fd = -1;
+      LOG_INFO(LOG_HTTP, "Live client %d disconnected", fd);
+    }
+  }
+  close(fd);
+  xSemaphoreGive(liveMutex);
+}
+
+/*
+  Fans the live feed out to every subscriber. Never asks for a retry, like the UDP sink, a late
+  sample is of no use to a live view.
+*/
+class LiveSink : public Sink {
+public:
+  bool open() { return true; }
+  bool writeBatch(const sensor_data* batch, int count);
+  void idle();
+  bool healthy() { return true; }
+  const char* name() { return "live"; }
+
+private:
+  void broadcast(size_t len, bool windOnly);
+
+  char event[LIVE_EVENT_MAX];
+};
+
+// Writes the encoded event to each client without waiting, anyone who can't take all of it is dropped
+void LiveSink::broadcast(size_t len, bool windOnly) {
+  xSemaphoreTake(liveMutex, portMAX_DELAY);
+  for(int i = 0; i < LIVE_CLIENTS; i++) {
+    live_client* client = &liveClients[i];
+    if(client->fd < 0 || (windOnly && !client->wind))
+      continue;
+    if(send(client->fd, event, len, MSG_DONTWAIT) != (ssize_t) len) {
+      // A partial event would corrupt the stream, so the client goes either way
+      LOG_WARN(LOG_HTTP, "Live client %d too slow, dropping it", client->fd);
+      httpd_sess_trigger_close(server, client->fd);
+      client->fd = -1;
+    }
+  }
+  xSemaphoreGive(liveMutex);
+}
+
+bool LiveSink::writeBatch(const sensor_data* batch, int count) {
+  for(int i = 0; i < count; i++) {
+    size_t len = formatSampleEvent(&batch[i], event, sizeof(event));
+    if(len > 0)
+      broadcast(len, false);
+  }
+  return true;
+}
+
+// Fast wind readings between samples, only for clients that asked for them
+void LiveSink::idle() {
+  bool wanted = false;
+  xSemaphoreTake(liveMutex, portMAX_DELAY);
+  for(int i = 0; i < LIVE_CLIENTS; i++)
+    wanted |= liveClients[i].fd >= 0 && liveClients[i].wind;
+  xSemaphoreGive(liveMutex);
+  if(!wanted)
+    return;
+  int len = snprintf(event, sizeof(event), "event: wind\ndata: {\"wind_speed\":%.2f,\"wind_direction\":%.1f}\n\n",
+                     weatherMeterKit.getWindSpeed(), weatherMeterKit.getWindDirection());
+  if(len > 0 && (size_t) len < sizeof(event))
+    broadcast(len, true);
+}
+
+// Listens on every interface, so it serves both the access point and station mode
+bool start_webserver() {
+  if(server != NULL)
+    return true;
+  liveMutex = xSemaphoreCreateMutexStatic(&liveMutexBuffer);
+  for(int i = 0; i < LIVE_CLIENTS; i++)
+    liveClients[i].fd = -1;
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.stack_size = WEBSERVER_STACK;
+  // Below the sinks and the display, an export only gets the time they leave
+  config.task_priority = 1;
+  // The server task is created by ESP-IDF, it's named "httpd" in the task profiles
+  const task_spec* spec = tasks_spec("httpd");
+  if(spec != NULL) {
+    config.task_priority = spec->priority;
+    config.core_id = spec->core == TASK_ANY_CORE ? tskNO_AFFINITY : spec->core;
+    if(spec->stack != 0)
+      config.stack_size = spec->stack;
+  }
+  config.lru_purge_enable = true;
+  config.close_fn = &onClose;
+  if(httpd_start(&server, &config) != ESP_OK) {
+    LOG_ERROR(LOG_HTTP, "Failed to start HTTP server");
+    server = NULL;
+    return false;
+  }
+  httpd_uri_t dataUri = {.uri = "/data", .method = HTTP_GET, .handler = &data_handler, .user_ctx = NULL};
+  httpd_uri_t latestUri = {.uri = "/latest", .method = HTTP_GET, .handler = &latest_handler, .user_ctx = NULL};
+  httpd_uri_t eventsUri = {.uri = "/events", .method = HTTP_GET, .handler = &events_handler, .user_ctx = NULL};
+  httpd_uri_t dashboardUri = {.uri = "/", .method = HTTP_GET, .handler = &dashboard_handler, .user_ctx = NULL};
+  httpd_register_uri_handler(server, &dataUri);
+  httpd_register_uri_handler(server, &latestUri);
+  httpd_register_uri_handler(server, &eventsUri);
+  httpd_register_uri_handler(server, &dashboardUri);
+
+  sink_config sinkConfig = {
+    .queueLength = LIVE_QUEUE,
+    .batchSize = 1,
+    .batchTimeout = 0,
+    .maxRetries = 0,
+    .priority = 2,
+    .stackSize = 4096,
+  };
+  if(!sink_exists("live") && !sink_register(new LiveSink(), &sinkConfig))
+    LOG_ERROR(LOG_HTTP, "Failed to start the live feed");
+  LOG_INFO(LOG_HTTP, "HTTP server listening on port %u", (unsigned) config.server_port);
+  return true;
+}
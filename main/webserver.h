@@ -0,0 +1,9 @@
+// Bytes handed to the HTTP server per chunk of an export
+#define EXPORT_CHUNK 1024
+// Browsers following the live feed at once
+#define LIVE_CLIENTS 4
+// Longest sample as JSON, and as a live event
+#define SAMPLE_JSON_MAX 320
+#define LIVE_EVENT_MAX (SAMPLE_JSON_MAX + 48)
+
+bool start_webserver();
@@ -0,0 +1,1125 @@
+/*
+  Ingestion gateway for a fleet of stations. Accepts the InfluxDB v2 write requests each
+  station's InfluxDB sink sends, drops points a station already delivered (resync replays records
+  the server may already have), coalesces the rest into large batches per bucket and forwards them
+  to InfluxDB over a few kept-alive connections.
+
+    g++ -O2 -std=c++17 -pthread -I../main gateway.cpp ../main/record.cpp -o gateway
+    ./gateway --listen 8086 --upstream influx.example.com:8086 --token <InfluxDB token>
+
+  Stations need no changes, `setDB <gateway address> 8086` points them at it. Org, bucket and
+  precision are kept per request, so stations writing to different buckets share the gateway.
+
+  Memory is bounded: once --max-buffer bytes are waiting to be forwarded, writes are answered
+  with 503 and Retry-After, and the stations keep their records queued since their InfluxDB sink
+  retries until it gets a 204. Deduplication remembers the last --dedup-window points by bucket,
+  series (which includes the station's location tag) and timestamp. Replays older than that are
+  forwarded again, which InfluxDB absorbs by overwriting the identical points.
+
+  Load test with hundreds of simulated stations, formatting records with the station's own line
+  protocol code, against this gateway and tools/influx_standin.py as InfluxDB:
+
+    ./influx_standin.py --port 9086 --report 0 &
+    ./gateway --listen 8086 --upstream 127.0.0.1:9086 --load-test 300 --duration 30 --replay 0.05
+
+  Progress is printed every --report seconds. A JSON summary is printed at exit (Ctrl-C,
+  or the end of the load test) and written to --json.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <getopt.h>
+#include <map>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <strings.h>
+#include <sys/socket.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "record.h"
+
+typedef std::chrono::steady_clock gatewayClock;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int) {
+  interrupted = 1;
+}
+
+static uint64_t nowMicros() {
+  static const gatewayClock::time_point start = gatewayClock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(gatewayClock::now() - start).count();
+}
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, double p) {
+  if(sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+/*
+  Buffered socket, with timeouts so a silent peer can't hold a thread forever
+*/
+class Connection {
+public:
+  explicit Connection(int fd = -1) : fd(fd) {}
+  ~Connection() { close(); }
+
+  bool open(const char* host, int port) {
+    char service[8];
+    struct addrinfo hints = {};
+    struct addrinfo* result;
+    close();
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if(getaddrinfo(host, service, &hints, &result) != 0)
+      return false;
+    for(struct addrinfo* address = result; address != NULL && fd < 0; address = address->ai_next) {
+      fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if(fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(result);
+    return fd >= 0;
+  }
+
+  void setTimeout(int seconds) {
+    struct timeval timeout = {seconds, 0};
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  void close() {
+    if(fd >= 0)
+      ::close(fd);
+    fd = -1;
+    start = end = 0;
+  }
+
+  bool isOpen() const { return fd >= 0; }
+
+  // Reads a line without its CRLF, false on timeout, disconnection or an overlong line
+  bool readLine(std::string& line) {
+    line.clear();
+    while(true) {
+      char* newline = (char*) memchr(buf + start, '\n', end - start);
+      if(newline != NULL) {
+        line.append(buf + start, newline - (buf + start));
+        start = newline - buf + 1;
+        if(!line.empty() && line.back() == '\r')
+          line.pop_back();
+        return true;
+      }
+      line.append(buf + start, end - start);
+      start = end;
+      if(line.size() > LINE_MAX_BYTES || !fill())
+        return false;
+    }
+  }
+
+  bool readBytes(size_t len, std::string& out) {
+    out.clear();
+    out.reserve(len);
+    while(out.size() < len) {
+      if(start == end && !fill())
+        return false;
+      size_t take = std::min(len - out.size(), end - start);
+      out.append(buf + start, take);
+      start += take;
+    }
+    return true;
+  }
+
+  bool write(const std::string& data) {
+    size_t sent = 0;
+    while(fd >= 0 && sent < data.size()) {
+      ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if(n <= 0)
+        return false;
+      sent += n;
+    }
+    return sent == data.size();
+  }
+
+private:
+  static const size_t LINE_MAX_BYTES = 8192;
+
+  bool fill() {
+    if(fd < 0)
+      return false;
+    ssize_t got = recv(fd, buf, sizeof(buf), 0);
+    if(got <= 0)
+      return false;
+    start = 0;
+    end = got;
+    return true;
+  }
+
+  int fd;
+  char buf[16384];
+  size_t start = 0;
+  size_t end = 0;
+};
+
+/*
+  Just enough HTTP/1.1 for the write API, on both sides
+*/
+struct Request {
+  std::string method;
+  std::string path;
+  std::map<std::string, std::string> params;
+  std::string authorization;
+  bool keepAlive = true;
+  std::string body;
+};
+
+struct Response {
+  int status = -1;
+  int retryAfter = 0;
+  bool keepAlive = true;
+  std::string body;
+};
+
+static std::string urlDecode(const std::string& text) {
+  std::string out;
+  for(size_t i = 0; i < text.size(); i++) {
+    if(text[i] == '%' && i + 2 < text.size()) {
+      out += (char) strtol(text.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += text[i] == '+' ? ' ' : text[i];
+    }
+  }
+  return out;
+}
+
+static bool headerIs(const std::string& line, const char* name, std::string* value) {
+  size_t len = strlen(name);
+  if(line.size() <= len || strncasecmp(line.c_str(), name, len) != 0 || line[len] != ':')
+    return false;
+  size_t begin = line.find_first_not_of(" \t", len + 1);
+  *value = begin == std::string::npos ? "" : line.substr(begin);
+  return true;
+}
+
+// 1 for a request, 0 if the peer closed the connection, -1 for a request that can't be served
+static int readRequest(Connection& conn, Request& request, size_t maxBody) {
+  std::string line;
+  std::string value;
+  if(!conn.readLine(line))
+    return 0;
+  size_t methodEnd = line.find(' ');
+  size_t targetEnd = line.find(' ', methodEnd + 1);
+  if(methodEnd == std::string::npos || targetEnd == std::string::npos)
+    return -1;
+  request.method = line.substr(0, methodEnd);
+  std::string target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+  request.keepAlive = line.compare(targetEnd + 1, std::string::npos, "HTTP/1.0") != 0;
+  size_t query = target.find('?');
+  request.path = target.substr(0, query);
+  while(query != std::string::npos) {
+    size_t next = target.find('&', query + 1);
+    std::string param = target.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+    size_t equals = param.find('=');
+    if(equals != std::string::npos)
+      request.params[urlDecode(param.substr(0, equals))] = urlDecode(param.substr(equals + 1));
+    query = next;
+  }
+
+  long contentLength = 0;
+  bool chunked = false;
+  while(true) {
+    if(!conn.readLine(line))
+      return 0;
+    if(line.empty())
+      break;
+    if(headerIs(line, "Content-Length", &value))
+      contentLength = atol(value.c_str());
+    else if(headerIs(line, "Authorization", &value))
+      request.authorization = value;
+    else if(headerIs(line, "Connection", &value))
+      request.keepAlive = strcasestr(value.c_str(), "close") == NULL;
+    else if(headerIs(line, "Transfer-Encoding", &value))
+      chunked = true;
+  }
+  // Stations always send a length, anything else isn't worth supporting
+  if(chunked || contentLength < 0 || (size_t) contentLength > maxBody)
+    return -1;
+  return conn.readBytes(contentLength, request.body) ? 1 : 0;
+}
+
+static bool sendResponse(Connection& conn, int status, const char* reason, const std::string& body,
+                         bool keepAlive, int retryAfter = 0) {
+  char header[256];
+  int len = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\n", status, reason);
+  if(retryAfter > 0)
+    len += snprintf(header + len, sizeof(header) - len, "Retry-After: %d\r\n", retryAfter);
+  if(!body.empty())
+    len += snprintf(header + len, sizeof(header) - len,
+                    "Content-Type: application/json\r\nContent-Length: %zu\r\n", body.size());
+  else if(status != 204)
+    len += snprintf(header + len, sizeof(header) - len, "Content-Length: 0\r\n");
+  snprintf(header + len, sizeof(header) - len, "%s\r\n", keepAlive ? "" : "Connection: close\r\n");
+  return conn.write(std::string(header) + body);
+}
+
+static std::string errorBody(const char* code, const std::string& message) {
+  std::string escaped;
+  for(char c : message) {
+    if(c == '"' || c == '\\')
+      escaped += '\\';
+    escaped += c;
+  }
+  return std::string("{\"code\":\"") + code + "\",\"message\":\"" + escaped + "\"}";
+}
+
+static bool readResponse(Connection& conn, Response& response) {
+  std::string line;
+  std::string value;
+  if(!conn.readLine(line) || line.compare(0, 7, "HTTP/1.") != 0 || line.size() < 12)
+    return false;
+  response.status = atoi(line.c_str() + 9);
+  response.keepAlive = true;
+  response.retryAfter = 0;
+  long contentLength = 0;
+  bool chunked = false;
+  while(true) {
+    if(!conn.readLine(line))
+      return false;
+    if(line.empty())
+      break;
+    if(headerIs(line, "Content-Length", &value))
+      contentLength = atol(value.c_str());
+    else if(headerIs(line, "Connection", &value))
+      response.keepAlive = strcasestr(value.c_str(), "close") == NULL;
+    else if(headerIs(line, "Retry-After", &value))
+      response.retryAfter = atoi(value.c_str());
+    else if(headerIs(line, "Transfer-Encoding", &value))
+      chunked = strcasestr(value.c_str(), "chunked") != NULL;
+  }
+  if(!chunked)
+    return conn.readBytes(contentLength, response.body);
+  response.body.clear();
+  std::string chunk;
+  while(true) {
+    if(!conn.readLine(line))
+      return false;
+    long size = strtol(line.c_str(), NULL, 16);
+    if(size <= 0)
+      return conn.readLine(line); // Trailer ends with an empty line
+    if(!conn.readBytes(size + 2, chunk))
+      return false;
+    response.body.append(chunk, 0, size);
+  }
+}
+
+/*
+  Batching and deduplication
+*/
+struct Target {
+  std::string org;
+  std::string bucket;
+  std::string precision;
+  bool operator<(const Target& other) const {
+    return std::tie(org, bucket, precision) < std::tie(other.org, other.bucket, other.precision);
+  }
+};
+
+struct Batch {
+  Target target;
+  std::string lines;
+  uint32_t points = 0;
+  uint64_t opened = 0;
+};
+
+struct Options {
+  int listenPort = 8086;
+  char upstreamHost[128] = "127.0.0.1";
+  int upstreamPort = 9086;
+  std::string token;
+  std::string stationToken;
+  int connections = 4;
+  size_t maxBuffer = 64 << 20;
+  size_t batchBytes = 1 << 20;
+  uint32_t batchPoints = 5000;
+  uint32_t flushMs = 1000;
+  size_t dedupWindow = 1 << 20;
+  size_t maxBody = 4 << 20;
+  int maxStations = 1024;
+  double report = 10;
+  int drainSeconds = 30;
+};
+
+struct Counters {
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> bytesIn{0};
+  std::atomic<uint64_t> pointsIn{0};
+  std::atomic<uint64_t> duplicates{0};
+  std::atomic<uint64_t> malformed{0};
+  std::atomic<uint64_t> rejected{0}; // Writes refused with 503 while the buffer was full
+  std::atomic<uint64_t> batches{0};
+  std::atomic<uint64_t> forwarded{0};
+  std::atomic<uint64_t> upstreamRetries{0};
+  std::atomic<uint64_t> upstreamDropped{0};
+  std::atomic<int> stations{0};
+  std::atomic<int> stationsPeak{0};
+};
+
+static uint64_t fnv1a(uint64_t hash, const char* data, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) data[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Index of the first unescaped separator outside a quoted string, npos if there's none
+static size_t findUnescaped(const std::string& line, char separator, size_t from) {
+  bool quoted = false;
+  for(size_t i = from; i < line.size(); i++) {
+    if(line[i] == '\\')
+      i++;
+    else if(line[i] == '"')
+      quoted = !quoted;
+    else if(line[i] == separator && !quoted)
+      return i;
+  }
+  return std::string::npos;
+}
+
+static bool precisionScale(const std::string& precision, int64_t* perSecond) {
+  static const struct { const char* name; int64_t perSecond; } scales[] = {
+    {"s", 1}, {"ms", 1000}, {"us", 1000000}, {"ns", 1000000000},
+  };
+  for(auto& scale : scales) {
+    if(precision == scale.name) {
+      *perSecond = scale.perSecond;
+      return true;
+    }
+  }
+  return false;
+}
+
+class Gateway {
+public:
+  explicit Gateway(const Options& options) : options(options) { seen.reserve(options.dedupWindow); }
+
+  Counters counters;
+
+  // Buffers a write request, returns the HTTP status to answer with
+  int write(const Target& target, const std::string& body, std::string& error) {
+    int64_t perSecond;
+    if(!precisionScale(target.precision, &perSecond)) {
+      error = "invalid precision " + target.precision;
+      return 400;
+    }
+    bool sealed = false;
+    bool bad = false;
+    std::unique_lock<std::mutex> guard(lock);
+    // Refuse before remembering anything, the station will send these points again
+    if(buffered + body.size() > options.maxBuffer) {
+      counters.rejected++;
+      error = "gateway buffer full";
+      return 503;
+    }
+    int64_t now = (int64_t) time(NULL) * perSecond;
+    size_t begin = 0;
+    for(int number = 1; begin < body.size(); number++) {
+      size_t end = body.find('\n', begin);
+      std::string line = body.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+      begin = end == std::string::npos ? body.size() : end + 1;
+      if(!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if(line.empty() || line[0] == '#')
+        continue;
+      counters.pointsIn++;
+
+      // measurement[,tags] fields [timestamp]
+      size_t seriesEnd = findUnescaped(line, ' ', 0);
+      size_t fieldsEnd = seriesEnd == std::string::npos ? seriesEnd : findUnescaped(line, ' ', seriesEnd + 1);
+      int64_t timestamp = now;
+      char* parsed = NULL;
+      if(fieldsEnd != std::string::npos)
+        timestamp = strtoll(line.c_str() + fieldsEnd + 1, &parsed, 10);
+      if(seriesEnd == 0 || seriesEnd == std::string::npos || seriesEnd + 1 >= line.size() || fieldsEnd == seriesEnd + 1 ||
+         (parsed != NULL && (*parsed != '\0' || parsed == line.c_str() + fieldsEnd + 1))) {
+        // Like InfluxDB, the valid points are still written and the first bad line is reported
+        counters.malformed++;
+        if(!bad)
+          error = "unable to parse line " + std::to_string(number);
+        bad = true;
+        continue;
+      }
+      if(!remember(target, line.c_str(), seriesEnd, timestamp)) {
+        counters.duplicates++;
+        continue;
+      }
+      // Stamped now rather than when InfluxDB gets it, which may be a while
+      if(fieldsEnd == std::string::npos)
+        line += " " + std::to_string(timestamp);
+
+      Batch& batch = filling[target];
+      if(batch.points == 0) {
+        batch.target = target;
+        batch.opened = nowMicros();
+      }
+      batch.lines += line;
+      batch.lines += '\n';
+      batch.points++;
+      buffered += line.size() + 1;
+      if(batch.lines.size() >= options.batchBytes || batch.points >= options.batchPoints) {
+        seal(target);
+        sealed = true;
+      }
+    }
+    bufferedPeak = std::max(bufferedPeak, buffered);
+    guard.unlock();
+    if(sealed)
+      ready.notify_one();
+    return bad ? 400 : 204;
+  }
+
+  // Seals batches that waited long enough, or all of them when shutting down
+  void sealOld(bool all) {
+    uint64_t now = nowMicros();
+    uint64_t wait = (uint64_t) options.flushMs * 1000;
+    bool sealed = false;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for(auto it = filling.begin(); it != filling.end();) {
+        Target target = (it++)->first;
+        if(all || now - filling[target].opened >= wait) {
+          seal(target);
+          sealed = true;
+        }
+      }
+    }
+    if(sealed)
+      ready.notify_all();
+  }
+
+  // Waits for a sealed batch, false once stopping
+  bool take(Batch& batch) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this]() { return !queue.empty() || stopping; });
+    if(stopping)
+      return false;
+    batch = std::move(queue.front());
+    queue.pop_front();
+    inFlight++;
+    return true;
+  }
+
+  // Back at the front, it's the oldest data
+  void retry(Batch&& batch) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queue.push_front(std::move(batch));
+      inFlight--;
+    }
+    ready.notify_one();
+  }
+
+  void done(const Batch& batch) {
+    std::lock_guard<std::mutex> guard(lock);
+    buffered -= batch.lines.size();
+    inFlight--;
+    drained.notify_all();
+  }
+
+  // Sends whatever is buffered, waiting at most the given time for InfluxDB to take it
+  bool drain(int seconds) {
+    uint64_t deadline = nowMicros() + (uint64_t) seconds * 1000000;
+    bool empty = false;
+    // Stations still finishing a request may open new batches meanwhile
+    while(!empty && nowMicros() < deadline) {
+      sealOld(true);
+      std::unique_lock<std::mutex> guard(lock);
+      empty = drained.wait_for(guard, std::chrono::milliseconds(100),
+                               [this]() { return queue.empty() && inFlight == 0 && filling.empty(); });
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    ready.notify_all();
+    return empty;
+  }
+
+  size_t bufferedBytes() {
+    std::lock_guard<std::mutex> guard(lock);
+    return buffered;
+  }
+
+  size_t bufferedBytesPeak() {
+    std::lock_guard<std::mutex> guard(lock);
+    return bufferedPeak;
+  }
+
+  // One of the kept-alive connections to InfluxDB
+  void forward() {
+    Connection upstream;
+    Batch batch;
+    uint32_t backoff = BACKOFF_MIN;
+    while(take(batch)) {
+      Response response;
+      bool sent = post(upstream, batch, response);
+      if(sent && response.status == 204) {
+        counters.batches++;
+        counters.forwarded += batch.points;
+        done(batch);
+        backoff = BACKOFF_MIN;
+        continue;
+      }
+      // The data itself was refused, sending it again won't help
+      if(sent && response.status >= 400 && response.status < 500 && response.status != 429) {
+        fprintf(stderr, "InfluxDB refused %u points with %d: %s\n", (unsigned) batch.points, response.status,
+                response.body.c_str());
+        counters.upstreamDropped += batch.points;
+        done(batch);
+        continue;
+      }
+      counters.upstreamRetries++;
+      if(!sent)
+        upstream.close();
+      uint32_t wait = std::max(backoff, (uint32_t) response.retryAfter * 1000);
+      retry(std::move(batch));
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+      backoff = std::min(backoff * 2, (uint32_t) BACKOFF_MAX);
+    }
+  }
+
+private:
+  static const uint32_t BACKOFF_MIN = 100;
+  static const uint32_t BACKOFF_MAX = 10000;
+
+  // False if the point was seen within the window. Eviction is first in, first out
+  bool remember(const Target& target, const char* series, size_t seriesLen, int64_t timestamp) {
+    uint64_t key = fnv1a(0xcbf29ce484222325ull, target.org.c_str(), target.org.size() + 1);
+    key = fnv1a(key, target.bucket.c_str(), target.bucket.size() + 1);
+    key = fnv1a(key, series, seriesLen);
+    key = fnv1a(key, (const char*) &timestamp, sizeof(timestamp));
+    if(!seen.insert(key).second)
+      return false;
+    order.push_back(key);
+    if(order.size() > options.dedupWindow) {
+      seen.erase(order.front());
+      order.pop_front();
+    }
+    return true;
+  }
+
+  void seal(const Target& target) {
+    auto it = filling.find(target);
+    queue.push_back(std::move(it->second));
+    filling.erase(it);
+  }
+
+  bool post(Connection& upstream, const Batch& batch, Response& response) {
+    char header[512];
+    snprintf(header, sizeof(header),
+             "POST /api/v2/write?org=%s&bucket=%s&precision=%s HTTP/1.1\r\n"
+             "Host: %s:%d\r\n"
+             "Authorization: Token %s\r\n"
+             "Content-Type: text/plain; charset=utf-8\r\n"
+             "Content-Length: %zu\r\n\r\n",
+             batch.target.org.c_str(), batch.target.bucket.c_str(), batch.target.precision.c_str(),
+             options.upstreamHost, options.upstreamPort, options.token.c_str(), batch.lines.size());
+    // A kept-alive connection may have been closed by the server meanwhile, try once more on a new one
+    for(int attempt = 0; attempt < 2; attempt++) {
+      if(!upstream.isOpen()) {
+        if(!upstream.open(options.upstreamHost, options.upstreamPort))
+          return false;
+        upstream.setTimeout(30);
+      }
+      if(upstream.write(std::string(header) + batch.lines) && readResponse(upstream, response)) {
+        if(!response.keepAlive)
+          upstream.close();
+        return true;
+      }
+      upstream.close();
+    }
+    return false;
+  }
+
+  const Options& options;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable drained;
+  std::map<Target, Batch> filling;
+  std::deque<Batch> queue;
+  int inFlight = 0;
+  bool stopping = false;
+  size_t buffered = 0;
+  size_t bufferedPeak = 0;
+  std::unordered_set<uint64_t> seen;
+  std::deque<uint64_t> order;
+};
+
+static void serveStation(Gateway* gateway, const Options* options, int fd) {
+  Connection conn(fd);
+  conn.setTimeout(60);
+  int active = ++gateway->counters.stations;
+  int peak = gateway->counters.stationsPeak;
+  while(active > peak && !gateway->counters.stationsPeak.compare_exchange_weak(peak, active)) {
+  }
+  while(!interrupted) {
+    Request request;
+    int read = readRequest(conn, request, options->maxBody);
+    if(read == 0)
+      break;
+    if(read < 0) {
+      sendResponse(conn, 400, "Bad Request", errorBody("invalid", "unsupported request"), false);
+      break;
+    }
+    gateway->counters.requests++;
+    gateway->counters.bytesIn += request.body.size();
+    if(request.path == "/health" || request.path == "/ping") {
+      if(!sendResponse(conn, request.path == "/ping" ? 204 : 200, request.path == "/ping" ? "No Content" : "OK",
+                       request.path == "/ping" ? "" : "{\"status\":\"pass\"}", request.keepAlive))
+        break;
+    } else if(request.method != "POST" || request.path != "/api/v2/write") {
+      if(!sendResponse(conn, 404, "Not Found", errorBody("not found", "path not found"), request.keepAlive))
+        break;
+    } else if(!options->stationToken.empty() && request.authorization != "Token " + options->stationToken) {
+      if(!sendResponse(conn, 401, "Unauthorized", errorBody("unauthorized", "unauthorized access"), request.keepAlive))
+        break;
+    } else if(request.params["org"].empty() || request.params["bucket"].empty()) {
+      if(!sendResponse(conn, 400, "Bad Request", errorBody("invalid", "org and bucket are required"), request.keepAlive))
+        break;
+    } else {
+      Target target = {request.params["org"], request.params["bucket"],
+                       request.params.count("precision") ? request.params["precision"] : "ns"};
+      std::string error;
+      int status = gateway->write(target, request.body, error);
+      bool sent;
+      if(status == 204)
+        sent = sendResponse(conn, 204, "No Content", "", request.keepAlive);
+      else if(status == 503)
+        sent = sendResponse(conn, 503, "Service Unavailable", errorBody("unavailable", error), request.keepAlive, 1);
+      else
+        sent = sendResponse(conn, 400, "Bad Request", errorBody("invalid", error), request.keepAlive);
+      if(!sent)
+        break;
+    }
+    if(!request.keepAlive)
+      break;
+  }
+  gateway->counters.stations--;
+}
+
+/*
+  Load test, each simulated station sends what its InfluxDB sink would, one record per request,
+  retrying until it's acknowledged. Some requests are followed by a replay of recent records, as
+  resync does after a reconnect, which the gateway should drop as duplicates.
+*/
+struct LoadOptions {
+  int stations = 0;
+  double duration = 30;
+  uint32_t intervalMs = 1000;
+  double replay = 0;
+  char host[128] = "127.0.0.1";
+  int port = 0;
+};
+
+struct LoadResults {
+  std::mutex lock;
+  std::vector<uint32_t> latencies;
+  std::map<int, uint64_t> statuses;
+  uint64_t requests = 0;
+  uint64_t uniquePoints = 0;
+  uint64_t replayedPoints = 0;
+  uint64_t connectFailures = 0;
+};
+
+#define LOAD_REPLAY_RECORDS 16
+
+static std::atomic<bool> loadDone(false);
+
+// Sends one write and waits for its answer, reconnecting if needed. Returns the status or -1
+static int loadWrite(Connection& conn, const LoadOptions& load, const std::string& body, LoadResults& results,
+                     std::vector<uint32_t>& latencies) {
+  char header[384];
+  snprintf(header, sizeof(header),
+           "POST /api/v2/write?org=weather-station-group&bucket=weather-records&precision=s HTTP/1.1\r\n"
+           "Host: %s:%d\r\n"
+           "Authorization: Token load-test\r\n"
+           "Content-Type: text/plain; charset=utf-8\r\n"
+           "Content-Length: %zu\r\n"
+           "Connection: keep-alive\r\n\r\n",
+           load.host, load.port, body.size());
+  if(!conn.isOpen()) {
+    if(!conn.open(load.host, load.port)) {
+      std::lock_guard<std::mutex> guard(results.lock);
+      results.connectFailures++;
+      return -1;
+    }
+    conn.setTimeout(10);
+  }
+  uint64_t start = nowMicros();
+  Response response;
+  if(!conn.write(std::string(header) + body) || !readResponse(conn, response)) {
+    conn.close();
+    return -1;
+  }
+  if(!response.keepAlive)
+    conn.close();
+  latencies.push_back((uint32_t) (nowMicros() - start));
+  std::lock_guard<std::mutex> guard(results.lock);
+  results.requests++;
+  results.statuses[response.status]++;
+  return response.status;
+}
+
+static void simulateStation(int index, const LoadOptions* load, LoadResults* results) {
+  Connection conn;
+  std::mt19937 random(index);
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::vector<uint32_t> latencies;
+  sensor_data recent[LOAD_REPLAY_RECORDS] = {};
+  int recentCount = 0;
+  char location[32];
+  char line[512];
+  uint64_t uniquePoints = 0;
+  uint64_t replayedPoints = 0;
+  snprintf(location, sizeof(location), "station-%03d", index);
+  // Every station samples every 10 s, starting at a shared time but out of phase
+  time_t timestamp = 1700000000 + index % 10;
+
+  // Stagger the start so the stations don't all write in lockstep
+  std::this_thread::sleep_for(std::chrono::milliseconds((uint32_t) (unit(random) * load->intervalMs)));
+  while(!loadDone) {
+    sensor_data data = {};
+    data.timestamp = timestamp;
+    data.rain_fall = index * 0.1f;
+    data.wind_speed = 5 + 3 * unit(random);
+    data.wind_direction = 45 * (int) (unit(random) * 8);
+    data.temperature = 20 + 5 * unit(random);
+    data.humidity = 60;
+    data.pressure = 1013.25; // hPa, like the BME280 reading
+    data.interval = 10;
+    data.init = true;
+    timestamp += 10;
+    size_t len = formatLineProtocol(&data, location, line, sizeof(line));
+    std::string body(line, len);
+    int lines = std::count(body.begin(), body.end(), '\n');
+
+    // Retried until acknowledged, like the sink does with SINK_RETRY_FOREVER
+    int status;
+    while((status = loadWrite(conn, *load, body, *results, latencies)) != 204 && !loadDone)
+      std::this_thread::sleep_for(std::chrono::milliseconds(status == 503 ? 1000 : 100));
+    if(status == 204)
+      uniquePoints += lines;
+    recent[recentCount++ % LOAD_REPLAY_RECORDS] = data;
+
+    if(unit(random) < load->replay) {
+      body.clear();
+      for(int i = 0; i < std::min(recentCount, LOAD_REPLAY_RECORDS); i++) {
+        len = formatLineProtocol(&recent[i], location, line, sizeof(line));
+        body.append(line, len);
+      }
+      if(loadWrite(conn, *load, body, *results, latencies) == 204)
+        replayedPoints += std::count(body.begin(), body.end(), '\n');
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(load->intervalMs));
+  }
+  std::lock_guard<std::mutex> guard(results->lock);
+  results->latencies.insert(results->latencies.end(), latencies.begin(), latencies.end());
+  results->uniquePoints += uniquePoints;
+  results->replayedPoints += replayedPoints;
+}
+
+static bool splitHostPort(const char* arg, char* host, size_t len, int* port) {
+  const char* colon = strrchr(arg, ':');
+  if(colon == NULL || (size_t) (colon - arg) >= len)
+    return false;
+  memcpy(host, arg, colon - arg);
+  host[colon - arg] = '\0';
+  *port = atoi(colon + 1);
+  return *port > 0;
+}
+
+// Dual stack where IPv6 is available, IPv4 only otherwise
+static int listenOn(int port) {
+  int on = 1;
+  int off = 0;
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  int bound;
+  if(fd >= 0) {
+    struct sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    bound = bind(fd, (struct sockaddr*) &address, sizeof(address));
+  } else {
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    bound = bind(fd, (struct sockaddr*) &address, sizeof(address));
+  }
+  if(bound != 0 || listen(fd, 512) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --listen PORT        port stations write to (8086)\n"
+          "  --upstream H:P       InfluxDB to forward to (127.0.0.1:9086)\n"
+          "  --token T            InfluxDB token used upstream\n"
+          "  --station-token T    token stations must present, any is accepted if unset\n"
+          "  --connections N      kept-alive connections to InfluxDB (4)\n"
+          "  --max-buffer MB      points waiting to be forwarded before writes get 503 (64)\n"
+          "  --batch-points N     points per forwarded batch (5000)\n"
+          "  --batch-kb KB        bytes per forwarded batch (1024)\n"
+          "  --flush-ms MS        longest a point waits for its batch to fill (1000)\n"
+          "  --dedup-window N     points remembered for deduplication (1048576)\n"
+          "  --max-stations N     concurrent station connections (1024)\n"
+          "  --report SEC         seconds between progress lines, 0 disables them (10)\n"
+          "  --drain SEC          longest wait to forward buffered points at exit (30)\n"
+          "  --json FILE          write the summary to FILE\n"
+          "Load test:\n"
+          "  --load-test N        simulate N stations writing to this gateway\n"
+          "  --target H:P         write to another gateway instead\n"
+          "  --duration SEC       length of the load test (30)\n"
+          "  --interval-ms MS     time between writes of a station (1000)\n"
+          "  --replay FRACTION    share of writes followed by a replay of recent records (0)\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  LoadOptions load;
+  const char* jsonPath = NULL;
+  bool remoteTarget = false;
+
+  static struct option longOptions[] = {
+    {"listen", required_argument, NULL, 'l'},
+    {"upstream", required_argument, NULL, 'u'},
+    {"token", required_argument, NULL, 't'},
+    {"station-token", required_argument, NULL, 'T'},
+    {"connections", required_argument, NULL, 'c'},
+    {"max-buffer", required_argument, NULL, 'm'},
+    {"batch-points", required_argument, NULL, 'p'},
+    {"batch-kb", required_argument, NULL, 'k'},
+    {"flush-ms", required_argument, NULL, 'f'},
+    {"dedup-window", required_argument, NULL, 'w'},
+    {"max-stations", required_argument, NULL, 's'},
+    {"report", required_argument, NULL, 'r'},
+    {"drain", required_argument, NULL, 'd'},
+    {"json", required_argument, NULL, 'j'},
+    {"load-test", required_argument, NULL, 'L'},
+    {"target", required_argument, NULL, 'G'},
+    {"duration", required_argument, NULL, 'D'},
+    {"interval-ms", required_argument, NULL, 'I'},
+    {"replay", required_argument, NULL, 'R'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int option;
+  while((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    switch(option) {
+      case 'l': options.listenPort = atoi(optarg); break;
+      case 'u':
+        if(!splitHostPort(optarg, options.upstreamHost, sizeof(options.upstreamHost), &options.upstreamPort)) {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      case 't': options.token = optarg; break;
+      case 'T': options.stationToken = optarg; break;
+      case 'c': options.connections = std::max(1, atoi(optarg)); break;
+      case 'm': options.maxBuffer = (size_t) atol(optarg) << 20; break;
+      case 'p': options.batchPoints = std::max(1, atoi(optarg)); break;
+      case 'k': options.batchBytes = (size_t) std::max(1L, atol(optarg)) << 10; break;
+      case 'f': options.flushMs = atoi(optarg); break;
+      case 'w': options.dedupWindow = std::max(1L, atol(optarg)); break;
+      case 's': options.maxStations = atoi(optarg); break;
+      case 'r': options.report = atof(optarg); break;
+      case 'd': options.drainSeconds = atoi(optarg); break;
+      case 'j': jsonPath = optarg; break;
+      case 'L': load.stations = atoi(optarg); break;
+      case 'G':
+        if(!splitHostPort(optarg, load.host, sizeof(load.host), &load.port)) {
+          usage(argv[0]);
+          return 2;
+        }
+        remoteTarget = true;
+        break;
+      case 'D': load.duration = atof(optarg); break;
+      case 'I': load.intervalMs = atoi(optarg); break;
+      case 'R': load.replay = atof(optarg); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(!remoteTarget)
+    load.port = options.listenPort;
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  static Gateway gateway(options);
+  int listener = -1;
+  std::vector<std::thread> forwarders;
+  if(!remoteTarget) {
+    listener = listenOn(options.listenPort);
+    if(listener < 0) {
+      fprintf(stderr, "Can't listen on port %d: %s\n", options.listenPort, strerror(errno));
+      return 1;
+    }
+    for(int i = 0; i < options.connections; i++)
+      forwarders.emplace_back(&Gateway::forward, &gateway);
+    printf("Listening on port %d, forwarding to %s:%d over %d connections\n", options.listenPort,
+           options.upstreamHost, options.upstreamPort, options.connections);
+  }
+
+  static LoadResults loadResults;
+  std::vector<std::thread> stations;
+  for(int i = 0; i < load.stations; i++)
+    stations.emplace_back(simulateStation, i, &load, &loadResults);
+  uint64_t loadStart = nowMicros();
+  uint64_t loadEnd = 0;
+
+  // Accept stations, seal batches that waited long enough and report progress
+  uint64_t nextReport = nowMicros() + (uint64_t) (options.report * 1e6);
+  uint64_t lastForwarded = 0;
+  uint64_t lastIn = 0;
+  uint64_t lastReport = nowMicros();
+  while(!interrupted) {
+    if(listener >= 0) {
+      struct pollfd waiting = {listener, POLLIN, 0};
+      if(poll(&waiting, 1, 100) > 0) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd >= 0 && gateway.counters.stations >= options.maxStations)
+          close(fd);
+        else if(fd >= 0)
+          std::thread(serveStation, &gateway, &options, fd).detach();
+      }
+      gateway.sealOld(false);
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if(load.stations > 0 && loadEnd == 0 && nowMicros() - loadStart >= load.duration * 1e6) {
+      loadDone = true;
+      for(std::thread& station : stations)
+        station.join();
+      loadEnd = nowMicros();
+      break;
+    }
+    if(options.report > 0 && nowMicros() >= nextReport) {
+      uint64_t now = nowMicros();
+      double elapsed = (now - lastReport) / 1e6;
+      uint64_t in = gateway.counters.pointsIn;
+      uint64_t forwarded = gateway.counters.forwarded;
+      printf("%.0f points/s in, %.0f points/s forwarded, %llu duplicates, %llu rejected writes, "
+             "%zu KB buffered, %d stations\n",
+             (in - lastIn) / elapsed, (forwarded - lastForwarded) / elapsed,
+             (unsigned long long) gateway.counters.duplicates, (unsigned long long) gateway.counters.rejected,
+             gateway.bufferedBytes() >> 10, gateway.counters.stations.load());
+      fflush(stdout);
+      lastIn = in;
+      lastForwarded = forwarded;
+      lastReport = now;
+      nextReport += (uint64_t) (options.report * 1e6);
+    }
+  }
+  if(listener >= 0)
+    close(listener);
+  if(load.stations > 0 && loadEnd == 0) {
+    loadDone = true;
+    for(std::thread& station : stations)
+      station.join();
+    loadEnd = nowMicros();
+  }
+  bool drained = remoteTarget || gateway.drain(options.drainSeconds);
+  for(std::thread& forwarder : forwarders)
+    forwarder.join();
+
+  Counters& counters = gateway.counters;
+  char* summary = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&summary, &len);
+  fprintf(out, "{\n");
+  if(!remoteTarget) {
+    fprintf(out, "  \"gateway\": {\"requests\": %llu, \"bytes_in\": %llu, \"points_in\": %llu, \"duplicates\": %llu, "
+            "\"malformed\": %llu, \"rejected_writes\": %llu,\n    \"batches\": %llu, \"points_forwarded\": %llu, "
+            "\"points_per_batch\": %.1f, \"upstream_retries\": %llu, \"upstream_dropped\": %llu, "
+            "\"buffer_peak_bytes\": %zu, \"stations_peak\": %d, \"drained\": %s}",
+            (unsigned long long) counters.requests, (unsigned long long) counters.bytesIn,
+            (unsigned long long) counters.pointsIn, (unsigned long long) counters.duplicates,
+            (unsigned long long) counters.malformed, (unsigned long long) counters.rejected,
+            (unsigned long long) counters.batches, (unsigned long long) counters.forwarded,
+            counters.batches ? (double) counters.forwarded / counters.batches : 0.0,
+            (unsigned long long) counters.upstreamRetries, (unsigned long long) counters.upstreamDropped,
+            gateway.bufferedBytesPeak(), counters.stationsPeak.load(), drained ? "true" : "false");
+  }
+  if(load.stations > 0) {
+    std::lock_guard<std::mutex> guard(loadResults.lock);
+    double elapsed = ((loadEnd ? loadEnd : nowMicros()) - loadStart) / 1e6;
+    std::sort(loadResults.latencies.begin(), loadResults.latencies.end());
+    fprintf(out, "%s  \"load_test\": {\"stations\": %d, \"elapsed_s\": %.3f, \"requests\": %llu, "
+            "\"requests_per_s\": %.1f, \"connect_failures\": %llu,\n    \"unique_points_acked\": %llu, "
+            "\"replayed_points_acked\": %llu,\n    \"statuses\": {",
+            remoteTarget ? "" : ",\n", load.stations, elapsed, (unsigned long long) loadResults.requests,
+            elapsed > 0 ? loadResults.requests / elapsed : 0.0, (unsigned long long) loadResults.connectFailures,
+            (unsigned long long) loadResults.uniquePoints, (unsigned long long) loadResults.replayedPoints);
+    bool first = true;
+    for(auto& status : loadResults.statuses) {
+      fprintf(out, "%s\"%d\": %llu", first ? "" : ", ", status.first, (unsigned long long) status.second);
+      first = false;
+    }
+    fprintf(out, "},\n    \"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+            percentile(loadResults.latencies, 0.5) / 1000.0, percentile(loadResults.latencies, 0.9) / 1000.0,
+            percentile(loadResults.latencies, 0.99) / 1000.0, percentile(loadResults.latencies, 1.0) / 1000.0);
+    // Every acknowledged record should reach InfluxDB exactly once
+    if(!remoteTarget)
+      fprintf(out, ",\n    \"points_missing\": %lld",
+              (long long) loadResults.uniquePoints - (long long) (counters.forwarded + counters.upstreamDropped));
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n}\n");
+  fclose(out);
+  fwrite(summary, 1, len, stdout);
+  if(jsonPath != NULL) {
+    FILE* file = fopen(jsonPath, "w");
+    if(file == NULL || fwrite(summary, 1, len, file) != len)
+      fprintf(stderr, "Failed to write %s\n", jsonPath);
+    if(file != NULL)
+      fclose(file);
+  }
+  free(summary);
+  // Station connections may still be blocked reading, don't wait for them
+  fflush(stdout);
+  _exit(drained ? 0 : 1);
+}
@@ -0,0 +1,239 @@
+/*
+  Fails if the station allocates from the heap once it has booted.
+
+    cd tools/hostsim
+    g++ -O2 -g -rdynamic -std=c++17 -pthread -Wno-write-strings -Wno-format-truncation -Iinclude -I../../main \
+        -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc \
+        alloc_test.cpp hostsim.cpp ../../main/{record,helper,sink,storage,wal,rollup,columnar,upload,network,logger,mqtt,sampling,history,boot,tasks}.cpp \
+        -o alloc_test
+    ./alloc_test [--samples N] [--influx H:P] [--mqtt H:P]
+
+  Brings the station up the way setup() does, then arms a counter on operator new and on malloc,
+  calloc and realloc called from station code, and runs the steady state: samples published the
+  way the sample timer does across a midnight, the sinks writing them, and the closed day
+  compacted. Allocations the shims make for what the SD and lwIP drivers own on the device (file
+  handles, resolver results) don't count. Every counted allocation is printed with its stack, and
+  the exit status is 1 if there were any.
+
+  --influx and --mqtt add those sinks, pointed at tools/influx_standin.py or a broker. Their
+  reconnects still allocate sockets inside lwIP on the device, which this can't see.
+*/
+#include <M5Core2.h>
+#include <atomic>
+#include <new>
+#include <execinfo.h>
+#include <getopt.h>
+
+#include "global.h"
+#include "sink.h"
+#include "storage.h"
+#include "network.h"
+#include "history.h"
+#include "sampling.h"
+#include "upload.h"
+#include "wal.h"
+#include "rollup.h"
+#include "columnar.h"
+#include "boot.h"
+#include "logger.h"
+#include "tasks.h"
+
+// Globals main.ino defines on the device
+SemaphoreHandle_t displayMutex = NULL;
+SemaphoreHandle_t storageMutex = NULL;
+SemaphoreHandle_t columnMutex = NULL;
+TimerHandle_t threadTimer = NULL;
+bool catchupActive = false;
+SFEWeatherMeterKit weatherMeterKit;
+BME280I2C bme;
+
+// Stacks printed in full, the rest are only counted
+#define REPORTED_ALLOCATIONS 8
+#define STACK_DEPTH 24
+
+static std::atomic<bool> armed(false);
+static std::atomic<unsigned> allocations(0);
+static thread_local bool reporting = false;
+
+static void counted(size_t size) {
+  if(!armed || reporting || hostsim_in_shim())
+    return;
+  unsigned index = allocations++;
+  if(index >= REPORTED_ALLOCATIONS)
+    return;
+  // Neither call allocates through anything counted here
+  reporting = true;
+  void* frames[STACK_DEPTH];
+  int depth = backtrace(frames, STACK_DEPTH);
+  dprintf(STDERR_FILENO, "Allocation of %zu bytes after init:\n", size);
+  backtrace_symbols_fd(frames + 1, depth - 1, STDERR_FILENO);
+  reporting = false;
+}
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  counted(size);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  counted(count * size);
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  counted(size);
+  return __real_realloc(ptr, size);
+}
+}
+
+static void* allocate(size_t size) {
+  counted(size);
+  void* ptr = __real_malloc(size == 0 ? 1 : size);
+  if(ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  counted(size);
+  return __real_malloc(size == 0 ? 1 : size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  counted(size);
+  return __real_malloc(size == 0 ? 1 : size);
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+static bool splitHostPort(const char* arg, char* host, size_t len, int* port) {
+  const char* colon = strrchr(arg, ':');
+  if(colon == NULL || (size_t) (colon - arg) >= len)
+    return false;
+  memcpy(host, arg, colon - arg);
+  host[colon - arg] = '\0';
+  *port = atoi(colon + 1);
+  return *port > 0;
+}
+
+// Waits until the sink has accounted for every sample, false if it didn't within the timeout
+static bool drained(const char* name, uint32_t total, uint32_t timeoutMs) {
+  for(uint32_t waited = 0; waited < timeoutMs; waited += 10) {
+    sink_stats stats;
+    if(!sink_get_stats(name, &stats) || stats.written + stats.dropped + stats.failed >= total)
+      return true;
+    delay(10);
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  int samples = 1000;
+  const char* influxArg = NULL;
+  const char* mqttArg = NULL;
+  static struct option options[] = {
+    {"samples", required_argument, NULL, 'n'},
+    {"influx", required_argument, NULL, 'i'},
+    {"mqtt", required_argument, NULL, 'm'},
+    {NULL, 0, NULL, 0},
+  };
+  int option;
+  while((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch(option) {
+      case 'n': samples = atoi(optarg); break;
+      case 'i': influxArg = optarg; break;
+      case 'm': mqttArg = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [--samples N] [--influx H:P] [--mqtt H:P]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  char scratch[] = "/tmp/alloc-test-XXXXXX";
+  if(mkdtemp(scratch) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  hostsim_sd_root(scratch);
+
+  // Same bring-up as setup() in main.ino, minus the sensors and the display
+  log_init();
+  log_set_level("all", "warn");
+  displayMutex = xSemaphoreCreateMutex();
+  storageMutex = xSemaphoreCreateMutex();
+  columnMutex = xSemaphoreCreateMutex();
+  // Never started, the test plays the timer itself
+  threadTimer = xTimerCreate("Sensor read", pdMS_TO_TICKS(sampling_interval() * 1000), pdTRUE, NULL, NULL);
+  tasks_init();
+  wal_recover();
+  rollup_recover();
+  upload_init();
+  init_sinks();
+  if(!start_csv_sink())
+    return 1;
+  if(influxArg != NULL) {
+    influx_config config;
+    influxDefaults(&config);
+    if(!splitHostPort(influxArg, config.host, sizeof(config.host), &config.port) || !start_influx_sink(&config))
+      return 1;
+  }
+  if(mqttArg != NULL) {
+    mqtt_config config;
+    mqttDefaults(&config);
+    if(!splitHostPort(mqttArg, config.host, sizeof(config.host), &config.port) || !start_mqtt_sink(&config))
+      return 1;
+  }
+  // Loaded before arming, its first call pulls in the unwinder
+  void* frames[1];
+  backtrace(frames, 1);
+  delay(200);
+
+  armed = true;
+  // Ten seconds apart from an hour before midnight, so the day log rolls over
+  struct tm start = {};
+  start.tm_year = 2024 - 1900;
+  start.tm_mon = 4;
+  start.tm_mday = 1;
+  start.tm_hour = 23;
+  start.tm_isdst = -1;
+  time_t timestamp = mktime(&start);
+  for(int i = 0; i < samples; i++) {
+    sensor_data data = {};
+    data.timestamp = timestamp + i * 10;
+    data.rain_fall = i * 0.01f;
+    data.wind_speed = 5 + (i % 7);
+    data.wind_direction = 45 * (i % 8);
+    data.temperature = 20 + (i % 50) * 0.1f;
+    data.humidity = 60;
+    data.pressure = 1013.25f - (i % 30) * 0.01f;
+    data.interval = sampling_interval();
+    data.init = true;
+    // What timer_pushData does with every sample
+    history_add(&data);
+    sink_publish(&data);
+    boot_heap_check();
+    sampling_update(&data);
+    // Sink queues are short, give them a moment like the real sample period does
+    if(i % 8 == 7)
+      delay(5);
+  }
+  bool complete = drained("csv", samples, 30000);
+  compactClosedDays();
+  armed = false;
+
+  unsigned total = allocations;
+  if(!complete)
+    fprintf(stderr, "The CSV sink didn't take every sample in time\n");
+  printf("%d samples, %u allocations after init, SD in %s\n", samples, total, scratch);
+  fflush(stdout);
+  // Sink tasks are still blocked on their queues, don't wait for them
+  _exit(total == 0 && complete ? 0 : 1);
+}
@@ -0,0 +1,900 @@
+/*
+  Host implementations of the FreeRTOS, Arduino, SD and WiFi APIs declared under include/. Tasks
+  and timers are threads, queues and semaphores are condition variables, the SD card is a
+  directory and WiFi clients are sockets. Scheduling is left to the host: tasks pinned to a core get
+  that CPU's affinity (modulo the CPUs there are), priorities are ignored, so only throughput,
+  queueing and core contention carry over to the device.
+*/
+#include <Arduino.h>
+#include <FS.h>
+#include <M5Core2.h>
+#include <WiFi.h>
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "webserver.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#undef truncate
+
+typedef std::chrono::steady_clock hostClock;
+static const hostClock::time_point bootTime = hostClock::now();
+
+int _daylight = 0;
+HardwareSerial Serial;
+M5Core2 M5;
+SDFS SD;
+WiFiClass WiFi;
+
+/*
+  Time
+*/
+static uint64_t elapsedMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(hostClock::now() - bootTime).count();
+}
+
+// Truncated to 32 bits like on the device, so wraparound arithmetic behaves the same
+unsigned long millis() {
+  return (uint32_t) (elapsedMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (uint32_t) elapsedMicros();
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void configTime(long, int, const char*, const char*, const char*) {}
+
+bool getLocalTime(struct tm* info, uint32_t) {
+  time_t now = time(NULL);
+  return localtime_r(&now, info) != NULL;
+}
+
+void RTC::GetTime(RTC_TimeTypeDef* out) {
+  time_t now = time(NULL);
+  struct tm date;
+  localtime_r(&now, &date);
+  out->Hours = date.tm_hour;
+  out->Minutes = date.tm_min;
+  out->Seconds = date.tm_sec;
+}
+
+void RTC::GetDate(RTC_DateTypeDef* out) {
+  time_t now = time(NULL);
+  struct tm date;
+  localtime_r(&now, &date);
+  out->WeekDay = date.tm_wday;
+  out->Month = date.tm_mon + 1;
+  out->Date = date.tm_mday;
+  out->Year = date.tm_year + 1900;
+}
+
+// Waits forever on portMAX_DELAY, like FreeRTOS
+template <typename Predicate>
+static bool waitFor(std::condition_variable& cond, std::unique_lock<std::mutex>& guard, TickType_t wait,
+                    Predicate ready) {
+  if(wait == portMAX_DELAY) {
+    cond.wait(guard, ready);
+    return true;
+  }
+  return cond.wait_for(guard, std::chrono::milliseconds(wait), ready);
+}
+
+/*
+  Critical sections
+*/
+void hostsim_critical_enter(portMUX_TYPE* mux) {
+  while(__atomic_exchange_n(&mux->locked, 1, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+void hostsim_critical_exit(portMUX_TYPE* mux) {
+  __atomic_store_n(&mux->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+  Tasks
+*/
+struct hostsim_task {
+  std::string name;
+  std::mutex lock;
+  std::condition_variable notified;
+  uint32_t notifications = 0;
+  std::atomic<UBaseType_t> priority{tskIDLE_PRIORITY};
+  BaseType_t core = tskNO_AFFINITY;
+  clockid_t cpuClock;
+  std::atomic<bool> running{false};
+};
+
+// Thrown by vTaskDelete(NULL) to unwind the task back to its thread
+struct task_deleted {};
+
+static thread_local hostsim_task* currentTask = NULL;
+// Every task ever started, handles are never freed
+static std::mutex tasksLock;
+static std::vector<hostsim_task*> tasks;
+
+// Done by the creator before it returns, so the new task can be looked up by name right away
+static void registerTask(hostsim_task* task, std::thread& thread) {
+  pthread_getcpuclockid(thread.native_handle(), &task->cpuClock);
+  if(task->core != tskNO_AFFINITY) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(task->core % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+    if(pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) != 0)
+      fprintf(stderr, "hostsim: couldn't pin task '%s' to CPU %d\n", task->name.c_str(), task->core);
+  }
+  std::lock_guard<std::mutex> guard(tasksLock);
+  tasks.push_back(task);
+}
+
+// The main thread and the timer service get a handle the first time they ask for one
+static hostsim_task* self() {
+  if(currentTask == NULL) {
+    currentTask = new hostsim_task();
+    currentTask->name = "main";
+  }
+  return currentTask;
+}
+
+static hostsim_task* startTask(TaskFunction_t code, const char* name, void* param, UBaseType_t priority,
+                               BaseType_t core) {
+  hostsim_task* task = new hostsim_task();
+  task->name = name;
+  task->priority = priority;
+  task->core = core;
+  task->running = true;
+  std::thread thread([task, code, param]() {
+    currentTask = task;
+    try {
+      code(param);
+    } catch(const task_deleted&) {
+    }
+    // The handle stays valid, whoever kept it may still notify it
+    task->running = false;
+  });
+  registerTask(task, thread);
+  thread.detach();
+  return task;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                       UBaseType_t priority, TaskHandle_t* created) {
+  return xTaskCreatePinnedToCore(code, name, stackSize, param, priority, created, tskNO_AFFINITY);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t, void* param,
+                                   UBaseType_t priority, TaskHandle_t* created, BaseType_t core) {
+  TaskHandle_t task = startTask(code, name, param, priority, core);
+  if(created != NULL)
+    *created = task;
+  return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                               UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer) {
+  return xTaskCreateStaticPinnedToCore(code, name, stackSize, param, priority, stack, buffer, tskNO_AFFINITY);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t code, const char* name, uint32_t, void* param,
+                                           UBaseType_t priority, StackType_t*, StaticTask_t*, BaseType_t core) {
+  return startTask(code, name, param, priority, core);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if(task == NULL || task == currentTask)
+    throw task_deleted();
+  fprintf(stderr, "hostsim: deleting task '%s' from another task is not supported\n", task->name.c_str());
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if(ticks == 0)
+    std::this_thread::yield();
+  else
+    delay(ticks);
+}
+
+TickType_t xTaskGetTickCount() {
+  return millis();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return self();
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) {
+  return 0;
+}
+
+TaskHandle_t xTaskGetHandle(const char* name) {
+  std::lock_guard<std::mutex> guard(tasksLock);
+  for(hostsim_task* task : tasks) {
+    if(task->running && task->name == name)
+      return task;
+  }
+  return NULL;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority) {
+  (task == NULL ? self() : task)->priority = priority;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+  return (task == NULL ? self() : task)->priority;
+}
+
+// Run time is thread CPU time against wall time, both in microseconds
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* status, UBaseType_t max, uint32_t* totalRunTime) {
+  UBaseType_t count = 0;
+  std::lock_guard<std::mutex> guard(tasksLock);
+  for(hostsim_task* task : tasks) {
+    timespec used;
+    if(count >= max || !task->running || clock_gettime(task->cpuClock, &used) != 0)
+      continue;
+    status[count].xHandle = task;
+    status[count].pcTaskName = task->name.c_str();
+    status[count].uxCurrentPriority = task->priority;
+    status[count].ulRunTimeCounter = (uint32_t) (used.tv_sec * 1000000ull + used.tv_nsec / 1000);
+    status[count].usStackHighWaterMark = 0;
+    status[count].xCoreID = task->core;
+    count++;
+  }
+  if(totalRunTime != NULL)
+    *totalRunTime = micros();
+  return count;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+  hostsim_task* task = self();
+  std::unique_lock<std::mutex> guard(task->lock);
+  if(!waitFor(task->notified, guard, wait, [task]() { return task->notifications > 0; }))
+    return 0;
+  uint32_t value = task->notifications;
+  task->notifications = clear ? 0 : value - 1;
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->notifications++;
+  task->notified.notify_all();
+  return pdPASS;
+}
+
+/*
+  Queues and semaphores
+*/
+struct hostsim_queue {
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  std::vector<uint8_t> items;
+  UBaseType_t head = 0;
+  UBaseType_t count = 0;
+  std::mutex lock;
+  std::condition_variable changed;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  hostsim_queue* queue = new hostsim_queue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  queue->items.resize((size_t) length * itemSize);
+  return queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t itemSize, uint8_t*, StaticQueue_t*) {
+  return xQueueCreate(length, itemSize);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  if(!waitFor(queue->changed, guard, wait, [queue]() { return queue->count < queue->length; }))
+    return pdFALSE;
+  if(queue->itemSize > 0) {
+    UBaseType_t slot = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->items[(size_t) slot * queue->itemSize], item, queue->itemSize);
+  }
+  queue->count++;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  if(!waitFor(queue->changed, guard, wait, [queue]() { return queue->count > 0; }))
+    return pdFALSE;
+  if(queue->itemSize > 0)
+    memcpy(item, &queue->items[(size_t) queue->head * queue->itemSize], queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->length - queue->count;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return xQueueCreate(1, 0);
+}
+
+// Created available, like FreeRTOS mutexes
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  xSemaphoreGive(mutex);
+  return mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t*) {
+  return xSemaphoreCreateMutex();
+}
+
+/*
+  Software timers
+*/
+struct hostsim_timer {
+  std::string name;
+  TickType_t period;
+  bool autoReload;
+  void* id;
+  TimerCallbackFunction_t callback;
+  bool active = false;
+  bool deleted = false;
+  hostClock::time_point due;
+};
+
+static std::mutex timerLock;
+static std::condition_variable timersChanged;
+static std::vector<hostsim_timer*> timers;
+static hostsim_timer* runningTimer = NULL;
+static std::once_flag timerServiceStarted;
+
+static void timerService() {
+  std::unique_lock<std::mutex> guard(timerLock);
+  while(true) {
+    hostsim_timer* next = NULL;
+    for(hostsim_timer* timer : timers) {
+      if(timer->active && (next == NULL || timer->due < next->due))
+        next = timer;
+    }
+    if(next == NULL) {
+      timersChanged.wait(guard);
+      continue;
+    }
+    if(hostClock::now() < next->due) {
+      timersChanged.wait_until(guard, next->due);
+      continue;
+    }
+    if(next->autoReload)
+      next->due += std::chrono::milliseconds(next->period);
+    else
+      next->active = false;
+    runningTimer = next;
+    guard.unlock();
+    next->callback(next);
+    guard.lock();
+    runningTimer = NULL;
+    if(next->deleted)
+      delete next;
+  }
+}
+
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, UBaseType_t autoReload, void* id,
+                           TimerCallbackFunction_t callback) {
+  // Same name and default priority as the ESP-IDF timer task, so task profiles find it
+  std::call_once(timerServiceStarted, []() { startTask([](void*) { timerService(); }, "Tmr Svc", NULL, 1, tskNO_AFFINITY); });
+  hostsim_timer* timer = new hostsim_timer();
+  timer->name = name;
+  timer->period = period;
+  timer->autoReload = autoReload;
+  timer->id = id;
+  timer->callback = callback;
+  std::lock_guard<std::mutex> guard(timerLock);
+  timers.push_back(timer);
+  return timer;
+}
+
+TimerHandle_t xTimerCreateStatic(const char* name, TickType_t period, UBaseType_t autoReload, void* id,
+                                 TimerCallbackFunction_t callback, StaticTimer_t*) {
+  return xTimerCreate(name, period, autoReload, id, callback);
+}
+
+BaseType_t xTimerStart(TimerHandle_t handle, TickType_t) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  timer->active = true;
+  timer->due = hostClock::now() + std::chrono::milliseconds(timer->period);
+  timersChanged.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t handle, TickType_t) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  timer->active = false;
+  timersChanged.notify_all();
+  return pdPASS;
+}
+
+// Also starts the timer, as in FreeRTOS
+BaseType_t xTimerChangePeriod(TimerHandle_t handle, TickType_t period, TickType_t) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  timer->period = period;
+  timer->active = true;
+  timer->due = hostClock::now() + std::chrono::milliseconds(period);
+  timersChanged.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t handle, TickType_t) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  timers.erase(std::find(timers.begin(), timers.end(), timer));
+  // A timer deleting itself from its callback is freed by the service once the callback returns
+  if(timer == runningTimer)
+    timer->deleted = true;
+  else
+    delete timer;
+  timersChanged.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t handle) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  return timer->active;
+}
+
+TickType_t xTimerGetPeriod(TimerHandle_t handle) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  std::lock_guard<std::mutex> guard(timerLock);
+  return timer->period;
+}
+
+void* pvTimerGetTimerID(TimerHandle_t handle) {
+  hostsim_timer* timer = (hostsim_timer*) handle;
+  return timer->id;
+}
+
+/*
+  Host-only allocations. std::string paths, shared file handles and resolver results stand in for
+  memory the SD and lwIP drivers own on the device, so they're done inside a ShimScope.
+*/
+static thread_local int shimDepth = 0;
+
+struct ShimScope {
+  ShimScope() { shimDepth++; }
+  ~ShimScope() { shimDepth--; }
+};
+
+bool hostsim_in_shim() {
+  return shimDepth > 0;
+}
+
+/*
+  SD card
+*/
+static std::string sdRoot = ".";
+static std::mutex writtenLock;
+static std::map<std::string, uint64_t> writtenBytes;
+
+struct hostsim_file {
+  std::string path; // As the station sees it, starting with /
+  std::string kind;
+  FILE* stream = NULL;
+  DIR* dir = NULL;
+  bool writing = false;
+  ~hostsim_file() {
+    if(stream != NULL)
+      fclose(stream);
+    if(dir != NULL)
+      closedir(dir);
+  }
+};
+
+static std::string hostPath(const char* path) {
+  return sdRoot + (path[0] == '/' ? "" : "/") + path;
+}
+
+// "/weather-data_2024-05-01.csv" counts as "weather-data.csv"
+static std::string fileKind(const std::string& path) {
+  std::string name = path.substr(path.rfind('/') + 1);
+  size_t date = name.find('_');
+  if(date == std::string::npos)
+    return name;
+  size_t extension = name.rfind('.');
+  return name.substr(0, date) + (extension != std::string::npos && extension > date ? name.substr(extension) : "");
+}
+
+void hostsim_sd_root(const char* dir) {
+  sdRoot = dir;
+}
+
+void hostsim_sd_written(void (*callback)(const char* kind, uint64_t bytes, void* ctx), void* ctx) {
+  std::lock_guard<std::mutex> guard(writtenLock);
+  for(auto& entry : writtenBytes)
+    callback(entry.first.c_str(), entry.second, ctx);
+}
+
+int hostsim_truncate(const char* path, off_t length) {
+  ShimScope shim;
+  if(strncmp(path, "/sd/", 4) == 0)
+    return truncate(hostPath(path + 3).c_str(), length);
+  return truncate(path, length);
+}
+
+// stdio needs a seek between reading and writing the same stream
+static void switchTo(hostsim_file* file, bool writing) {
+  if(file->writing != writing)
+    fseek(file->stream, 0, SEEK_CUR);
+  file->writing = writing;
+}
+
+File fs::FS::open(const char* path, const char* mode, bool) {
+  ShimScope shim;
+  std::shared_ptr<hostsim_file> file = std::make_shared<hostsim_file>();
+  file->path = path;
+  file->kind = fileKind(path);
+  std::string host = hostPath(path);
+  struct stat info;
+  if(stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    file->dir = opendir(host.c_str());
+  else
+    file->stream = fopen(host.c_str(), mode);
+  if(file->dir == NULL && file->stream == NULL)
+    return File();
+  return File(file);
+}
+
+bool fs::FS::exists(const char* path) {
+  ShimScope shim;
+  return access(hostPath(path).c_str(), F_OK) == 0;
+}
+
+bool fs::FS::remove(const char* path) {
+  ShimScope shim;
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+bool fs::FS::rename(const char* from, const char* to) {
+  ShimScope shim;
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+bool fs::FS::mkdir(const char* path) {
+  ShimScope shim;
+  return ::mkdir(hostPath(path).c_str(), 0755) == 0;
+}
+
+bool fs::FS::rmdir(const char* path) {
+  ShimScope shim;
+  return ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+uint64_t SDFS::cardSize() {
+  return totalBytes();
+}
+
+uint64_t SDFS::totalBytes() {
+  struct statvfs info;
+  return statvfs(sdRoot.c_str(), &info) == 0 ? (uint64_t) info.f_blocks * info.f_frsize : 0;
+}
+
+uint64_t SDFS::usedBytes() {
+  struct statvfs info;
+  return statvfs(sdRoot.c_str(), &info) == 0 ? (uint64_t) (info.f_blocks - info.f_bfree) * info.f_frsize : 0;
+}
+
+size_t File::write(const uint8_t* buf, size_t len) {
+  if(!impl || impl->stream == NULL)
+    return 0;
+  switchTo(impl.get(), true);
+  size_t written = fwrite(buf, 1, len, impl->stream);
+  ShimScope shim;
+  std::lock_guard<std::mutex> guard(writtenLock);
+  writtenBytes[impl->kind] += written;
+  return written;
+}
+
+size_t File::printf(const char* format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if(len < 0)
+    return 0;
+  return write((const uint8_t*) buf, min((size_t) len, sizeof(buf) - 1));
+}
+
+int File::read() {
+  if(!impl || impl->stream == NULL)
+    return -1;
+  switchTo(impl.get(), false);
+  int c = fgetc(impl->stream);
+  return c == EOF ? -1 : c;
+}
+
+size_t File::read(uint8_t* buf, size_t len) {
+  if(!impl || impl->stream == NULL)
+    return 0;
+  switchTo(impl.get(), false);
+  return fread(buf, 1, len, impl->stream);
+}
+
+// Like Stream::readBytesUntil, the terminator is consumed but not stored
+size_t File::readBytesUntil(char terminator, char* buf, size_t len) {
+  size_t n = 0;
+  while(n < len) {
+    int c = read();
+    if(c < 0 || c == terminator)
+      break;
+    buf[n++] = c;
+  }
+  return n;
+}
+
+int File::peek() {
+  int c = read();
+  if(c >= 0)
+    ungetc(c, impl->stream);
+  return c;
+}
+
+int File::available() {
+  return impl && impl->stream != NULL ? (int) (size() - position()) : 0;
+}
+
+void File::flush() {
+  if(impl && impl->stream != NULL)
+    fflush(impl->stream);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  if(!impl || impl->stream == NULL)
+    return false;
+  impl->writing = false;
+  return fseek(impl->stream, pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+size_t File::position() const {
+  return impl && impl->stream != NULL ? ftell(impl->stream) : 0;
+}
+
+size_t File::size() const {
+  if(!impl || impl->stream == NULL)
+    return 0;
+  struct stat info;
+  fflush(impl->stream);
+  return fstat(fileno(impl->stream), &info) == 0 ? info.st_size : 0;
+}
+
+// Only the name, like the ESP32 core since 2.0
+const char* File::name() const {
+  return impl ? impl->path.c_str() + impl->path.rfind('/') + 1 : "";
+}
+
+const char* File::path() const {
+  return impl ? impl->path.c_str() : "";
+}
+
+bool File::isDirectory() const {
+  return impl && impl->dir != NULL;
+}
+
+File File::openNextFile(const char* mode) {
+  ShimScope shim;
+  if(!impl || impl->dir == NULL)
+    return File();
+  struct dirent* entry;
+  while((entry = readdir(impl->dir)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    std::string child = impl->path + (impl->path.back() == '/' ? "" : "/") + entry->d_name;
+    return SD.open(child.c_str(), mode);
+  }
+  return File();
+}
+
+void File::rewindDirectory() {
+  if(impl && impl->dir != NULL)
+    rewinddir(impl->dir);
+}
+
+/*
+  Network
+*/
+static std::atomic<uint64_t> netSent(0);
+
+uint64_t hostsim_net_sent() {
+  return netSent;
+}
+
+String IPAddress::toString() const {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+  return String(buf);
+}
+
+int HardwareSerial::printf(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vprintf(format, args);
+  va_end(args);
+  return len;
+}
+
+static struct addrinfo* resolve(const char* host, uint16_t port, int type) {
+  struct addrinfo hints = {};
+  struct addrinfo* result = NULL;
+  char service[8];
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  snprintf(service, sizeof(service), "%u", port);
+  return getaddrinfo(host, service, &hints, &result) == 0 ? result : NULL;
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+  ShimScope shim;
+  stop();
+  struct addrinfo* addresses = resolve(host, port, SOCK_STREAM);
+  for(struct addrinfo* address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if(fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if(addresses != NULL)
+    freeaddrinfo(addresses);
+  return fd >= 0;
+}
+
+// Still connected while unread data is left, like the ESP32 client
+uint8_t WiFiClient::connected() {
+  if(fd < 0)
+    return 0;
+  char c;
+  ssize_t peeked = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if(peeked > 0)
+    return 1;
+  return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void WiFiClient::stop() {
+  if(fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+int WiFiClient::available() {
+  int pending = 0;
+  if(fd < 0 || ioctl(fd, FIONREAD, &pending) != 0)
+    return 0;
+  return pending;
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t* buf, size_t len) {
+  if(fd < 0)
+    return -1;
+  ssize_t got = recv(fd, buf, len, MSG_DONTWAIT);
+  return got > 0 ? (int) got : -1;
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t len) {
+  size_t sent = 0;
+  while(fd >= 0 && sent < len) {
+    ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if(n <= 0)
+      break;
+    sent += n;
+  }
+  netSent += sent;
+  return sent;
+}
+
+void WiFiClient::setNoDelay(bool noDelay) {
+  int flag = noDelay;
+  if(fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+WiFiUDP::~WiFiUDP() {
+  if(fd >= 0)
+    close(fd);
+}
+
+int WiFiUDP::beginPacket(const char* host, uint16_t port) {
+  ShimScope shim;
+  this->host = host;
+  this->port = port;
+  packet.clear();
+  return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t* buf, size_t len) {
+  ShimScope shim;
+  packet.append((const char*) buf, len);
+  return len;
+}
+
+int WiFiUDP::endPacket() {
+  ShimScope shim;
+  struct addrinfo* address = resolve(host.c_str(), port, SOCK_DGRAM);
+  if(address == NULL)
+    return 0;
+  if(fd < 0)
+    fd = socket(address->ai_family, SOCK_DGRAM, 0);
+  ssize_t sent = fd >= 0 ? sendto(fd, packet.data(), packet.size(), 0, address->ai_addr, address->ai_addrlen) : -1;
+  freeaddrinfo(address);
+  if(sent != (ssize_t) packet.size())
+    return 0;
+  netSent += sent;
+  return 1;
+}
+
+/*
+  Station modules not built on the host
+*/
+// The HTTP server is esp_http_server's, there's no web server on the host
+bool start_webserver() {
+  return false;
+}
+
+/*
+  ESP-IDF
+*/
+// There's no meaningful heap figure on the host
+uint32_t esp_get_free_heap_size(void) {
+  return 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+  return 0;
+}
+
+size_t heap_caps_get_free_size(uint32_t) {
+  return 0;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t) {
+  return 0;
+}
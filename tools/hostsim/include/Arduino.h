@@ -0,0 +1,78 @@
+#pragma once
+/*
+  Arduino core on Linux, enough for the station's storage, sink and network code to run
+  unmodified. See hostsim.cpp for the implementations.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+
+#define F(x) x
+#define PROGMEM
+
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// newlib's name for the DST flag
+extern int _daylight;
+
+void delay(uint32_t ms);
+unsigned long millis();
+unsigned long micros();
+void configTime(long gmtOffset, int daylightOffset, const char* server1, const char* server2 = NULL,
+                const char* server3 = NULL);
+bool getLocalTime(struct tm* info, uint32_t ms = 5000);
+
+class String {
+public:
+  String() {}
+  String(const char* str) : value(str != NULL ? str : "") {}
+  const char* c_str() const { return value.c_str(); }
+  size_t length() const { return value.size(); }
+  bool operator==(const char* other) const { return value == other; }
+
+private:
+  std::string value;
+};
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{a, b, c, d} {}
+  String toString() const;
+
+private:
+  uint8_t octets[4] = {0, 0, 0, 0};
+};
+
+class HardwareSerial {
+public:
+  void begin(unsigned long) {}
+  size_t write(const uint8_t* buf, size_t len) { return fwrite(buf, 1, len, stdout); }
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  void flush() { fflush(stdout); }
+};
+extern HardwareSerial Serial;
+
+// True while a shim allocates on behalf of what is driver or VFS memory on the device, so
+// allocation checks can leave it out
+bool hostsim_in_shim();
+
+// The log recovery truncates through the VFS path, which is mapped onto the host SD directory
+int hostsim_truncate(const char* path, off_t length);
+#define truncate hostsim_truncate
@@ -0,0 +1,71 @@
+#pragma once
+/*
+  SD card as a directory on the host, set with hostsim_sd_root. Every byte written is counted per
+  kind of file, so benchmarks can report the storage cost of a sample.
+*/
+#include <memory>
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct hostsim_file;
+
+class File {
+public:
+  File() {}
+  explicit File(std::shared_ptr<hostsim_file> impl) : impl(impl) {}
+  operator bool() const { return impl != nullptr; }
+
+  size_t write(const uint8_t* buf, size_t len);
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t print(const char* str) { return write((const uint8_t*) str, strlen(str)); }
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  int read();
+  size_t read(uint8_t* buf, size_t len);
+  size_t readBytes(char* buf, size_t len) { return read((uint8_t*) buf, len); }
+  size_t readBytesUntil(char terminator, char* buf, size_t len);
+  int peek();
+  int available();
+  void flush();
+  bool seek(uint32_t pos, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void close() { impl.reset(); }
+  const char* name() const;
+  const char* path() const;
+  bool isDirectory() const;
+  File openNextFile(const char* mode = FILE_READ);
+  void rewindDirectory();
+
+private:
+  std::shared_ptr<hostsim_file> impl;
+};
+
+namespace fs {
+class FS {
+public:
+  File open(const char* path, const char* mode = FILE_READ, bool create = false);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* from, const char* to);
+  bool mkdir(const char* path);
+  bool rmdir(const char* path);
+};
+}
+
+class SDFS : public fs::FS {
+public:
+  bool begin() { return true; }
+  uint64_t cardSize();
+  uint64_t totalBytes();
+  uint64_t usedBytes();
+};
+extern SDFS SD;
+
+void hostsim_sd_root(const char* dir);
+// Calls back with the bytes written to each kind of file, named after the path without its date
+void hostsim_sd_written(void (*callback)(const char* kind, uint64_t bytes, void* ctx), void* ctx);
@@ -0,0 +1,59 @@
+#pragma once
+// M5Core2 without a screen, the RTC reads the host clock
+#include "Arduino.h"
+#include "FS.h"
+
+#define BLACK 0x0000
+#define NAVY 0x000F
+#define DARKGREEN 0x03E0
+#define DARKGREY 0x7BEF
+#define BLUE 0x001F
+#define GREEN 0x07E0
+#define CYAN 0x07FF
+#define RED 0xF800
+#define YELLOW 0xFFE0
+#define WHITE 0xFFFF
+
+typedef struct {
+  uint8_t Hours;
+  uint8_t Minutes;
+  uint8_t Seconds;
+} RTC_TimeTypeDef;
+
+typedef struct {
+  uint8_t WeekDay;
+  uint8_t Month;
+  uint8_t Date;
+  uint16_t Year;
+} RTC_DateTypeDef;
+
+class RTC {
+public:
+  void GetTime(RTC_TimeTypeDef* time);
+  void GetDate(RTC_DateTypeDef* date);
+  void SetTime(RTC_TimeTypeDef*) {}
+  void SetDate(RTC_DateTypeDef*) {}
+};
+
+class M5Display {
+public:
+  int width() { return 320; }
+  int height() { return 240; }
+  void fillScreen(uint16_t) {}
+  void fillRect(int, int, int, int, uint16_t) {}
+  void setTextColor(uint16_t, uint16_t = 0) {}
+  void setTextSize(int) {}
+  void setCursor(int, int) {}
+  size_t print(const char*) { return 0; }
+  size_t println(const char*) { return 0; }
+  void printf(const char*, ...) {}
+};
+
+class M5Core2 {
+public:
+  void begin(bool = true, bool = true, bool = true, bool = true) {}
+  void update() {}
+  M5Display Lcd;
+  RTC Rtc;
+};
+extern M5Core2 M5;
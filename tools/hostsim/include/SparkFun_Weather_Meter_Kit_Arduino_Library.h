@@ -0,0 +1,10 @@
+#pragma once
+// Sensor declarations for global.h, the benchmark replays recorded samples instead
+#include "Arduino.h"
+
+class SFEWeatherMeterKit {
+public:
+  float getTotalRainfall() { return 0; }
+  float getWindSpeed() { return 0; }
+  float getWindDirection() { return 0; }
+};
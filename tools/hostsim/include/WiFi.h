@@ -0,0 +1,53 @@
+#pragma once
+// WiFi that is always connected, clients are plain host sockets
+#include "Arduino.h"
+
+#define WL_CONNECTED 3
+
+typedef enum { WIFI_MODE_NULL = 0, WIFI_MODE_STA, WIFI_MODE_AP, WIFI_MODE_APSTA } wifi_mode_t;
+
+class WiFiClient {
+public:
+  ~WiFiClient() { stop(); }
+  int connect(const char* host, uint16_t port);
+  uint8_t connected();
+  void stop();
+  int available();
+  int read();
+  int read(uint8_t* buf, size_t len);
+  size_t write(const uint8_t* buf, size_t len);
+  void setNoDelay(bool noDelay);
+
+private:
+  int fd = -1;
+};
+
+class WiFiUDP {
+public:
+  ~WiFiUDP();
+  int beginPacket(const char* host, uint16_t port);
+  size_t write(const uint8_t* buf, size_t len);
+  int endPacket();
+
+private:
+  int fd = -1;
+  std::string host;
+  uint16_t port = 0;
+  std::string packet;
+};
+
+class WiFiClass {
+public:
+  bool softAP(const char*, const char*) { return true; }
+  void begin(const char*, const char*) {}
+  void disconnect(bool = false, bool = false) {}
+  int status() { return WL_CONNECTED; }
+  bool isConnected() { return true; }
+  wifi_mode_t getMode() { return WIFI_MODE_STA; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  IPAddress softAPIP() { return IPAddress(127, 0, 0, 1); }
+};
+extern WiFiClass WiFi;
+
+// Bytes sent through every client and datagram so far
+uint64_t hostsim_net_sent();
@@ -0,0 +1,44 @@
+#pragma once
+/*
+  FreeRTOS on POSIX threads, just the parts the station uses. Ticks are milliseconds, every task is
+  a thread scheduled by the host. Pinned tasks get the matching CPU affinity, priorities are only
+  kept for reporting and stack sizes are ignored.
+*/
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t) 0xffffffff)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define pdTICKS_TO_MS(ticks) ((uint32_t) (ticks))
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY 0x7fffffff
+#define configMAX_PRIORITIES 25
+// uxTaskGetSystemState is available, run time counters are thread CPU time in microseconds
+#define configUSE_TRACE_FACILITY 1
+#define configGENERATE_RUN_TIME_STATS 1
+#define CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID 1
+
+// Spinlock, critical sections are short
+typedef struct {
+  int locked;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+void hostsim_critical_enter(portMUX_TYPE* mux);
+void hostsim_critical_exit(portMUX_TYPE* mux);
+#define portENTER_CRITICAL(mux) hostsim_critical_enter(mux)
+#define portEXIT_CRITICAL(mux) hostsim_critical_exit(mux)
+
+// Static creation allocates anyway, the buffers only need to exist
+typedef struct { uint8_t unused; } StaticTask_t;
+typedef struct { uint8_t unused; } StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct { uint8_t unused; } StaticTimer_t;
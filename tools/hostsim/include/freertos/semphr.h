@@ -0,0 +1,11 @@
+#pragma once
+#include "queue.h"
+
+// Semaphores are queues of empty items, like in FreeRTOS. Mutexes don't inherit priority
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buffer);
+SemaphoreHandle_t xSemaphoreCreateBinary();
+#define xSemaphoreTake(semaphore, wait) xQueueReceive(semaphore, NULL, wait)
+#define xSemaphoreGive(semaphore) xQueueSend(semaphore, NULL, 0)
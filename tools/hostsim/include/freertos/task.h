@@ -0,0 +1,37 @@
+#pragma once
+#include "FreeRTOS.h"
+
+typedef struct hostsim_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+typedef struct {
+  TaskHandle_t xHandle;
+  const char* pcTaskName;
+  UBaseType_t uxCurrentPriority;
+  uint32_t ulRunTimeCounter;
+  uint32_t usStackHighWaterMark; // Always 0, the host doesn't track it
+  BaseType_t xCoreID;
+} TaskStatus_t;
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                       UBaseType_t priority, TaskHandle_t* created);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                                   UBaseType_t priority, TaskHandle_t* created, BaseType_t core);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                               UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t code, const char* name, uint32_t stackSize, void* param,
+                                           UBaseType_t priority, StackType_t* stack, StaticTask_t* buffer,
+                                           BaseType_t core);
+// Only a task deleting itself is supported
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+// Tasks that are still running, the main thread isn't one of them
+TaskHandle_t xTaskGetHandle(const char* name);
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* status, UBaseType_t max, uint32_t* totalRunTime);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
@@ -0,0 +1,506 @@
+/*
+  Replays recorded weather-data_*.csv logs through the station's own sampling, storage and upload
+  code on Linux, faster than real time, and reports whether the pipeline kept up.
+
+    cd tools/hostsim
+    g++ -O2 -std=c++17 -pthread -Wno-write-strings -Wno-format-truncation -Iinclude -I../../main \
+        replay_bench.cpp hostsim.cpp ../../main/{record,helper,sink,storage,wal,rollup,columnar,upload,network,logger,mqtt,sampling,history,boot,tasks}.cpp \
+        -o replay_bench
+    ./replay_bench --speedup 1000 --influx 127.0.0.1:8086 --json result.json /path/to/sd/weather-data_*.csv
+
+  Every record goes through what the sample timer does on the device: history buffer, adaptive
+  sampling policy and publication to every sink. The CSV sink writes the log, superblock and
+  rollups into a scratch SD directory, so the input is never touched. --influx, --mqtt and --udp
+  add the network sinks, pointed at tools/influx_standin.py, a broker or a UDP listener.
+
+  Records are paced by their own timestamps divided by --speedup (10 to 10000 are the useful
+  range). sink_publish never waits, so with --speedup 0 the bench applies the backpressure
+  itself: each record waits until every sink's queue has room, giving up after
+  BACKPRESSURE_TIMEOUT so a dead sink can't stall the replay. That replays as fast as the sinks
+  take records, and a drop then means a sink really fell behind. The report has the sustained rate, how far the
+  replay fell behind its schedule, per sink queue high-water marks, drops and failures, latency
+  of each stage, the bytes written per sample and the CPU time of every task, as JSON on stdout and
+  in --json. --profile picks the task profile, as the tasks console command does.
+
+  Runs on host threads with host scheduling: tasks pinned to a core are pinned to that host CPU,
+  priorities are ignored, and a PC disk is much faster than an SD card. Use it to compare changes and find queueing limits, not to predict
+  absolute device timings.
+*/
+#include <M5Core2.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "helper.h"
+#include "sink.h"
+#include "storage.h"
+#include "network.h"
+#include "history.h"
+#include "sampling.h"
+#include "upload.h"
+#include "wal.h"
+#include "rollup.h"
+#include "columnar.h"
+#include "logger.h"
+#include "tasks.h"
+
+// Globals main.ino defines on the device
+SemaphoreHandle_t displayMutex = NULL;
+SemaphoreHandle_t storageMutex = NULL;
+SemaphoreHandle_t columnMutex = NULL;
+TimerHandle_t threadTimer = NULL;
+bool catchupActive = false;
+SFEWeatherMeterKit weatherMeterKit;
+BME280I2C bme;
+
+static const char* SINK_NAMES[] = {"csv", "influx", "mqtt", "udp"};
+#define SINK_NAME_COUNT (sizeof(SINK_NAMES) / sizeof(SINK_NAMES[0]))
+// Milliseconds the sink queues must stay empty before the replay counts as fully delivered
+#define DRAIN_QUIET 1500
+// Longest an unpaced record waits for queue room before it's published anyway, in milliseconds
+#define BACKPRESSURE_TIMEOUT 2000
+
+typedef std::chrono::steady_clock benchClock;
+static const benchClock::time_point benchStart = benchClock::now();
+
+static uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(benchClock::now() - benchStart).count();
+}
+
+// Latency samples of one stage, in microseconds
+struct Stage {
+  std::vector<uint32_t> samples;
+
+  void add(uint64_t us) { samples.push_back((uint32_t) std::min(us, (uint64_t) UINT32_MAX)); }
+
+  void json(FILE* out, const char* name) {
+    std::sort(samples.begin(), samples.end());
+    auto at = [this](double p) {
+      return samples.empty() ? 0.0 : samples[std::min(samples.size() - 1, (size_t) (p * samples.size()))] / 1000.0;
+    };
+    fprintf(out, "\"%s\": {\"count\": %zu, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+            name, samples.size(), at(0.5), at(0.9), at(0.99), at(1.0));
+  }
+};
+
+// What the sink observer saw for one sink
+struct SinkTrace {
+  Stage write;      // One writeBatch call
+  Stage endToEnd;   // Published to acknowledged by the sink, first delivery only
+  uint32_t attempts = 0;
+  uint32_t failures = 0;
+  uint32_t replayed = 0; // Records sent again by resync
+  time_t newest = 0;
+};
+
+static std::mutex traceLock;
+static std::unordered_map<time_t, uint64_t> publishedAt;
+static std::map<std::string, SinkTrace> traces;
+
+static void observe(const char* name, const sensor_data* batch, int count, bool ok, uint32_t elapsed) {
+  uint64_t now = nowMicros();
+  std::lock_guard<std::mutex> guard(traceLock);
+  SinkTrace& trace = traces[name];
+  trace.attempts++;
+  trace.write.add(elapsed);
+  if(!ok) {
+    trace.failures++;
+    return;
+  }
+  for(int i = 0; i < count; i++) {
+    if(batch[i].timestamp <= trace.newest) {
+      trace.replayed++;
+      continue;
+    }
+    trace.newest = batch[i].timestamp;
+    auto published = publishedAt.find(batch[i].timestamp);
+    if(published != publishedAt.end())
+      trace.endToEnd.add(now - published->second);
+  }
+}
+
+static bool splitHostPort(const char* arg, char* host, size_t len, int* port) {
+  const char* colon = strrchr(arg, ':');
+  if(colon == NULL || (size_t) (colon - arg) >= len)
+    return false;
+  memcpy(host, arg, colon - arg);
+  host[colon - arg] = '\0';
+  *port = atoi(colon + 1);
+  return *port > 0;
+}
+
+// Directories are searched for daily logs, files are taken as given
+static void collectInputs(const char* arg, std::vector<std::string>& inputs) {
+  struct stat info;
+  if(stat(arg, &info) != 0) {
+    fprintf(stderr, "Can't read %s\n", arg);
+    return;
+  }
+  if(!S_ISDIR(info.st_mode)) {
+    inputs.push_back(arg);
+    return;
+  }
+  DIR* dir = opendir(arg);
+  struct dirent* entry;
+  while(dir != NULL && (entry = readdir(dir)) != NULL) {
+    const char* name = entry->d_name;
+    size_t len = strlen(name);
+    if(strncmp(name, "weather-data_", 13) == 0 && len > 4 && strcmp(name + len - 4, ".csv") == 0)
+      inputs.push_back(std::string(arg) + "/" + name);
+  }
+  if(dir != NULL)
+    closedir(dir);
+}
+
+static std::vector<sensor_data> loadRecords(const std::vector<std::string>& inputs, uint32_t* malformed) {
+  std::vector<sensor_data> records;
+  char line[RECORD_LINE_MAX * 2];
+  for(const std::string& path : inputs) {
+    FILE* file = fopen(path.c_str(), "r");
+    if(file == NULL)
+      continue;
+    while(fgets(line, sizeof(line), file) != NULL) {
+      // Preallocated logs are padded with zeros past their last line
+      if(line[0] == '\0')
+        break;
+      line[strcspn(line, "\r\n")] = '\0';
+      sensor_data data = deserializeSensorData(line);
+      if(data.init)
+        records.push_back(data);
+      else
+        (*malformed)++;
+    }
+    fclose(file);
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const sensor_data& a, const sensor_data& b) { return a.timestamp < b.timestamp; });
+  // The same sample can't be published twice, the pipeline keys on timestamps
+  records.erase(std::unique(records.begin(), records.end(),
+                            [](const sensor_data& a, const sensor_data& b) { return a.timestamp == b.timestamp; }),
+                records.end());
+  return records;
+}
+
+static void writtenKind(const char* kind, uint64_t bytes, void* ctx) {
+  std::map<std::string, uint64_t>* written = (std::map<std::string, uint64_t>*) ctx;
+  (*written)[kind] = bytes;
+}
+
+// Waits until every sink has room in its queue, false if one still had none after timeoutMs
+static bool waitForQueueRoom(uint32_t timeoutMs) {
+  uint64_t deadline = nowMicros() + (uint64_t) timeoutMs * 1000;
+  while(true) {
+    bool room = true;
+    for(size_t i = 0; i < SINK_NAME_COUNT && room; i++) {
+      sink_stats stats;
+      if(sink_get_stats(SINK_NAMES[i], &stats) && stats.queued >= stats.capacity)
+        room = false;
+    }
+    if(room)
+      return true;
+    if(nowMicros() >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options] <weather-data_*.csv or directory>...\n"
+          "  --speedup N       replay N times faster than recorded, 0 for as fast as the sinks take it (1000)\n"
+          "  --sd DIR          scratch directory standing in for the SD card (new temporary one)\n"
+          "  --influx H:P      add the InfluxDB sink, e.g. tools/influx_standin.py\n"
+          "  --mqtt H:P        add the MQTT sink\n"
+          "  --udp H:P         add the UDP sink\n"
+          "  --limit N         replay at most N records\n"
+          "  --drain SEC       longest wait for the sinks to catch up at the end (60)\n"
+          "  --compact         compact the replayed days into columnar files afterwards\n"
+          "  --log LEVEL       station log level, none to debug (warn)\n"
+          "  --profile NAME    task profile: default, sampling or recovery (default)\n"
+          "  --json FILE       also write the report to FILE\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  double speedup = 1000;
+  const char* sdDir = NULL;
+  const char* influxArg = NULL;
+  const char* mqttArg = NULL;
+  const char* udpArg = NULL;
+  const char* jsonPath = NULL;
+  const char* logLevel = "warn";
+  const char* profile = NULL;
+  long limit = -1;
+  int drainSeconds = 60;
+  bool compact = false;
+
+  static struct option options[] = {
+    {"speedup", required_argument, NULL, 's'},
+    {"sd", required_argument, NULL, 'd'},
+    {"influx", required_argument, NULL, 'i'},
+    {"mqtt", required_argument, NULL, 'm'},
+    {"udp", required_argument, NULL, 'u'},
+    {"limit", required_argument, NULL, 'n'},
+    {"drain", required_argument, NULL, 'w'},
+    {"compact", no_argument, NULL, 'c'},
+    {"log", required_argument, NULL, 'l'},
+    {"profile", required_argument, NULL, 'p'},
+    {"json", required_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int option;
+  while((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch(option) {
+      case 's': speedup = atof(optarg); break;
+      case 'd': sdDir = optarg; break;
+      case 'i': influxArg = optarg; break;
+      case 'm': mqttArg = optarg; break;
+      case 'u': udpArg = optarg; break;
+      case 'n': limit = atol(optarg); break;
+      case 'w': drainSeconds = atoi(optarg); break;
+      case 'c': compact = true; break;
+      case 'l': logLevel = optarg; break;
+      case 'p': profile = optarg; break;
+      case 'j': jsonPath = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  std::vector<std::string> inputs;
+  for(int i = optind; i < argc; i++)
+    collectInputs(argv[i], inputs);
+  std::sort(inputs.begin(), inputs.end());
+  if(inputs.empty() || speedup < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  char scratch[] = "/tmp/replay-sd-XXXXXX";
+  if(sdDir == NULL && (sdDir = mkdtemp(scratch)) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  hostsim_sd_root(sdDir);
+
+  // Same bring-up as setup() in main.ino, minus the sensors and the display
+  log_init();
+  if(!log_set_level("all", logLevel))
+    fprintf(stderr, "Unknown log level %s\n", logLevel);
+  displayMutex = xSemaphoreCreateMutex();
+  storageMutex = xSemaphoreCreateMutex();
+  columnMutex = xSemaphoreCreateMutex();
+  // Never started, storage and upload only read its period
+  threadTimer = xTimerCreate("Sensor read", pdMS_TO_TICKS(sampling_interval() * 1000), pdTRUE, NULL, NULL);
+  tasks_init();
+  if(profile != NULL && !tasks_select(profile)) {
+    fprintf(stderr, "Unknown task profile %s\n", profile);
+    return 2;
+  }
+  wal_recover();
+  rollup_recover();
+  upload_init();
+  init_sinks();
+  sink_set_observer(&observe);
+  if(!start_csv_sink())
+    return 1;
+  if(influxArg != NULL) {
+    influx_config config;
+    influxDefaults(&config);
+    if(!splitHostPort(influxArg, config.host, sizeof(config.host), &config.port) || !start_influx_sink(&config))
+      return 1;
+  }
+  if(mqttArg != NULL) {
+    mqtt_config config;
+    mqttDefaults(&config);
+    if(!splitHostPort(mqttArg, config.host, sizeof(config.host), &config.port) || !start_mqtt_sink(&config))
+      return 1;
+  }
+  if(udpArg != NULL) {
+    udp_config config = {};
+    snprintf(config.location, sizeof(config.location), "Bench");
+    if(!splitHostPort(udpArg, config.host, sizeof(config.host), &config.port) || !start_udp_sink(&config))
+      return 1;
+  }
+
+  uint32_t malformed = 0;
+  std::vector<sensor_data> records = loadRecords(inputs, &malformed);
+  if(limit >= 0 && (size_t) limit < records.size())
+    records.resize(limit);
+  if(records.empty()) {
+    fprintf(stderr, "No records to replay\n");
+    return 1;
+  }
+  publishedAt.reserve(records.size());
+
+  // Replay, each record published when its turn comes at the chosen speed
+  Stage publish;
+  uint64_t maxLag = 0;
+  uint64_t intervalSum = 0;
+  uint32_t fastSamples = 0;
+  sampling_policy policy;
+  sampling_get_policy(&policy);
+  time_t firstTimestamp = records.front().timestamp;
+  // Run time counters start here, the report covers the replay and the drain
+  static task_usage usage[TASKS_MAX];
+  tasks_usage(usage, TASKS_MAX);
+  uint64_t replayStart = nowMicros();
+  uint64_t backpressureWait = 0;
+  uint32_t backpressureTimeouts = 0;
+  for(const sensor_data& record : records) {
+    if(speedup == 0) {
+      uint64_t waitStart = nowMicros();
+      if(!waitForQueueRoom(BACKPRESSURE_TIMEOUT))
+        backpressureTimeouts++;
+      backpressureWait += nowMicros() - waitStart;
+    }
+    if(speedup > 0) {
+      uint64_t due = replayStart + (uint64_t) ((record.timestamp - firstTimestamp) * 1e6 / speedup);
+      uint64_t now = nowMicros();
+      if(now < due)
+        std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+      else
+        maxLag = std::max(maxLag, now - due);
+    }
+    sensor_data data = record;
+    uint64_t start = nowMicros();
+    {
+      std::lock_guard<std::mutex> guard(traceLock);
+      publishedAt[data.timestamp] = start;
+    }
+    history_add(&data);
+    sink_publish(&data);
+    uint16_t next = sampling_update(&data);
+    publish.add(nowMicros() - start);
+    intervalSum += next;
+    if(next < policy.maxInterval)
+      fastSamples++;
+  }
+  uint64_t replayEnd = nowMicros();
+
+  /*
+    Wait for every sink to account for every record it was offered, and for resync to stop
+    refilling the queues: it moves from one gap to the next within milliseconds, so the queues
+    have to stay empty for a while before the upload counts as caught up.
+  */
+  uint64_t drainDeadline = replayEnd + (uint64_t) drainSeconds * 1000000;
+  uint64_t quietSince = 0;
+  uint64_t drainEnd = replayEnd;
+  while(nowMicros() < drainDeadline) {
+    bool settled = true;
+    for(size_t i = 0; i < SINK_NAME_COUNT; i++) {
+      sink_stats stats;
+      if(!sink_get_stats(SINK_NAMES[i], &stats))
+        continue;
+      std::lock_guard<std::mutex> guard(traceLock);
+      uint32_t firstDeliveries = stats.written - traces[SINK_NAMES[i]].replayed;
+      if(stats.queued > 0 || firstDeliveries + stats.failed + stats.dropped < records.size())
+        settled = false;
+    }
+    if(!settled)
+      quietSince = 0;
+    else if(quietSince == 0)
+      quietSince = drainEnd = nowMicros();
+    else if(nowMicros() - quietSince >= DRAIN_QUIET * 1000)
+      break;
+    delay(10);
+  }
+  if(quietSince == 0)
+    drainEnd = nowMicros();
+
+  Stage columnar;
+  if(compact) {
+    uint64_t start = nowMicros();
+    compactClosedDays();
+    columnar.add(nowMicros() - start);
+  }
+
+  std::map<std::string, uint64_t> written;
+  hostsim_sd_written(&writtenKind, &written);
+  uint64_t writtenTotal = 0;
+  for(auto& kind : written)
+    writtenTotal += kind.second;
+  double replaySeconds = (replayEnd - replayStart) / 1e6;
+  double totalSeconds = (drainEnd - replayStart) / 1e6;
+  size_t count = records.size();
+  int taskCount = tasks_usage(usage, TASKS_MAX);
+
+  // Give the log drain task a moment so its output doesn't land inside the report
+  delay(100);
+  char* buf = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&buf, &len);
+  fprintf(out, "{\n  \"input\": {\"files\": %zu, \"records\": %zu, \"malformed\": %u, \"span_s\": %ld},\n",
+          inputs.size(), count, (unsigned) malformed, (long) (records.back().timestamp - firstTimestamp));
+  fprintf(out, "  \"speedup\": %g,\n  \"sd\": \"%s\",\n", speedup, sdDir);
+  fprintf(out, "  \"replay_s\": %.3f,\n  \"total_s\": %.3f,\n", replaySeconds, totalSeconds);
+  fprintf(out, "  \"offered_samples_per_s\": %.1f,\n", replaySeconds > 0 ? count / replaySeconds : 0);
+  fprintf(out, "  \"sustained_samples_per_s\": %.1f,\n", totalSeconds > 0 ? count / totalSeconds : 0);
+  fprintf(out, "  \"max_schedule_lag_ms\": %.3f,\n", maxLag / 1000.0);
+  if(speedup == 0)
+    fprintf(out, "  \"backpressure\": {\"wait_s\": %.3f, \"timeouts\": %u},\n", backpressureWait / 1e6,
+            (unsigned) backpressureTimeouts);
+  fprintf(out, "  \"sampling\": {\"mean_next_interval_s\": %.2f, \"fast_fraction\": %.4f},\n",
+          (double) intervalSum / count, (double) fastSamples / count);
+  fprintf(out, "  \"stages\": {\n    ");
+  publish.json(out, "publish");
+  if(compact) {
+    fprintf(out, ",\n    ");
+    columnar.json(out, "compaction");
+  }
+  fprintf(out, "\n  },\n  \"sinks\": {");
+  bool first = true;
+  for(size_t i = 0; i < SINK_NAME_COUNT; i++) {
+    sink_stats stats;
+    if(!sink_get_stats(SINK_NAMES[i], &stats))
+      continue;
+    std::lock_guard<std::mutex> guard(traceLock);
+    SinkTrace& trace = traces[SINK_NAMES[i]];
+    fprintf(out, "%s\n    \"%s\": {\"written\": %u, \"dropped\": %u, \"failed\": %u, \"batches\": %u, "
+            "\"left_queued\": %u, \"queue_high_water\": %u, \"attempts\": %u, \"failed_attempts\": %u, "
+            "\"replayed\": %u,\n      ",
+            first ? "" : ",", SINK_NAMES[i], (unsigned) stats.written, (unsigned) stats.dropped,
+            (unsigned) stats.failed, (unsigned) stats.batches, (unsigned) stats.queued, (unsigned) stats.highWater,
+            (unsigned) trace.attempts, (unsigned) trace.failures, (unsigned) trace.replayed);
+    trace.write.json(out, "write_batch");
+    fprintf(out, ", ");
+    trace.endToEnd.json(out, "end_to_end");
+    fprintf(out, "}");
+    first = false;
+  }
+  fprintf(out, "\n  },\n  \"bytes_written\": {\"total\": %llu, \"per_sample\": %.1f",
+          (unsigned long long) writtenTotal, (double) writtenTotal / count);
+  for(auto& kind : written)
+    fprintf(out, ", \"%s\": %llu", kind.first.c_str(), (unsigned long long) kind.second);
+  fprintf(out, "},\n  \"bytes_sent\": {\"total\": %llu, \"per_sample\": %.1f},\n",
+          (unsigned long long) hostsim_net_sent(), (double) hostsim_net_sent() / count);
+  fprintf(out, "  \"task_profile\": \"%s\",\n  \"tasks\": {", tasks_profile());
+  for(int i = 0; i < taskCount; i++) {
+    fprintf(out, "%s\n    \"%s\": {\"core\": %d, \"priority\": %u, \"cpu_pct\": %.2f}", i == 0 ? "" : ",",
+            usage[i].name, usage[i].core, (unsigned) usage[i].priority, usage[i].cpu);
+  }
+  fprintf(out, "\n  }\n}\n");
+  fclose(out);
+
+  fwrite(buf, 1, len, stdout);
+  fflush(stdout);
+  if(jsonPath != NULL) {
+    FILE* file = fopen(jsonPath, "w");
+    if(file == NULL || fwrite(buf, 1, len, file) != len)
+      fprintf(stderr, "Failed to write %s\n", jsonPath);
+    if(file != NULL)
+      fclose(file);
+  }
+  free(buf);
+  // Sink tasks are still blocked on their queues, don't wait for them
+  _exit(0);
+}
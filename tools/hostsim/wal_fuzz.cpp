@@ -0,0 +1,316 @@
+/*
+  Power-cut fuzz test of the daily log recovery.
+
+    cd tools/hostsim
+    g++ -O2 -std=c++17 -pthread -Wno-write-strings -Wno-format-truncation -Iinclude -I../../main \
+        wal_fuzz.cpp hostsim.cpp ../../main/{record,helper,wal,logger}.cpp -o wal_fuzz
+    ./wal_fuzz [--iterations N] [--seed S]
+
+  Every iteration writes a log the way the CSV sink does (wal_begin, one write per batch,
+  wal_commit), half of them into a preallocated file, and keeps a copy of the superblock as it was
+  while each batch was written. It then cuts the power at a random byte: the log keeps what was
+  written up to there, the superblock is the one from the batch that was cut, and sometimes a
+  random byte past the checkpoint is flipped or the newest superblock slot is torn. After wal_recover:
+
+    - the log holds exactly the longest prefix of whole, intact lines, byte for byte, followed by
+      nothing (or only zero padding if it was preallocated)
+    - recovery scanned no more lines than can be written between two checkpoints
+
+  A first pass checks that unframeRecord rejects every truncated or bit-flipped framed line.
+  Exits 1 on the first failure, with the seed and iteration to reproduce it.
+*/
+#include <M5Core2.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "global.h"
+#include "record.h"
+#include "wal.h"
+#include "logger.h"
+
+// Globals main.ino defines on the device
+SemaphoreHandle_t displayMutex = NULL;
+SemaphoreHandle_t storageMutex = NULL;
+SemaphoreHandle_t columnMutex = NULL;
+TimerHandle_t threadTimer = NULL;
+bool catchupActive = false;
+SFEWeatherMeterKit weatherMeterKit;
+BME280I2C bme;
+
+#define SUPERBLOCK "/weather-data.sb"
+// Batch size of the CSV sink
+#define BATCH_MAX 8
+
+static std::string sdRoot;
+
+static std::string hostPath(const std::string& path) {
+  return sdRoot + path;
+}
+
+static std::string readHost(const std::string& path) {
+  std::string data;
+  FILE* file = fopen(hostPath(path).c_str(), "rb");
+  if(file == NULL)
+    return data;
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    data.append(buf, n);
+  fclose(file);
+  return data;
+}
+
+static void writeHost(const std::string& path, const std::string& data) {
+  FILE* file = fopen(hostPath(path).c_str(), "wb");
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+}
+
+// Superblock slot layout, see wal.cpp
+#define SLOT_SIZE 64
+#define SLOT_MAGIC 0x31425357
+
+typedef struct {
+  bool valid;
+  uint32_t sequence;
+  char path[40];
+  uint32_t committed;
+} superblock_slot;
+
+// Returns the newest valid slot, -1 if neither is
+static int readSlots(const std::string& superblock, superblock_slot* slots) {
+  int newest = -1;
+  for(int slot = 0; slot < 2; slot++) {
+    slots[slot].valid = false;
+    if(superblock.size() < (size_t) (slot + 1) * SLOT_SIZE)
+      continue;
+    const char* raw = superblock.data() + slot * SLOT_SIZE;
+    uint32_t magic, crc;
+    memcpy(&magic, raw, 4);
+    memcpy(&slots[slot].sequence, raw + 4, 4);
+    memcpy(slots[slot].path, raw + 8, 40);
+    memcpy(&slots[slot].committed, raw + 48, 4);
+    memcpy(&crc, raw + 52, 4);
+    slots[slot].valid = magic == SLOT_MAGIC && crc == record_crc32(raw, 52);
+    if(slots[slot].valid && (newest < 0 || slots[slot].sequence > slots[newest].sequence))
+      newest = slot;
+  }
+  return newest;
+}
+
+static sensor_data randomRecord(std::mt19937& random, time_t timestamp) {
+  std::uniform_real_distribution<float> unit(0, 1);
+  sensor_data data = {};
+  data.timestamp = timestamp;
+  data.rain_fall = unit(random) * 20;
+  data.wind_speed = unit(random) * 60;
+  data.wind_direction = 45 * (int) (unit(random) * 8);
+  data.temperature = unit(random) * 40 - 5;
+  data.humidity = unit(random) * 100;
+  data.pressure = 980 + unit(random) * 50;
+  data.interval = 10;
+  data.init = true;
+  return data;
+}
+
+static bool checkFraming(std::mt19937& random) {
+  char line[RECORD_LINE_MAX];
+  char copy[RECORD_LINE_MAX];
+  for(int n = 0; n < 200; n++) {
+    sensor_data data = randomRecord(random, 1714600000 + n);
+    size_t len = serializeSensorData(&data, line, sizeof(line)) - 1; // Without the newline
+    line[len] = '\0';
+    memcpy(copy, line, len + 1);
+    if(!unframeRecord(copy)) {
+      fprintf(stderr, "Intact line rejected: %s\n", line);
+      return false;
+    }
+    for(size_t cut = 0; cut < len; cut++) {
+      memcpy(copy, line, cut);
+      copy[cut] = '\0';
+      // Without the marker the line reads as an old unframed one, recovery rejects those itself
+      if(strstr(copy, ",*") != NULL && unframeRecord(copy)) {
+        fprintf(stderr, "Line cut at %zu accepted: %s\n", cut, line);
+        return false;
+      }
+    }
+    for(size_t at = 0; at < len; at++) {
+      memcpy(copy, line, len + 1);
+      copy[at] ^= 1 + random() % 255;
+      if(copy[at] == '\0' || copy[at] == '\n')
+        continue; // Ends the line early, covered by the cuts
+      if(strstr(copy, ",*") != NULL && unframeRecord(copy)) {
+        fprintf(stderr, "Line with byte %zu flipped accepted: %s\n", at, line);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+  One power cut. Returns false and explains why if recovery got it wrong.
+*/
+static bool runIteration(std::mt19937& random, int iteration) {
+  char path[40];
+  snprintf(path, sizeof(path), "/weather-data_fuzz-%06d.csv", iteration);
+  bool preallocated = random() % 2;
+  int records = 1 + random() % 400;
+
+  // Written lines, their end offsets and the superblock while each batch was being written
+  std::string written;
+  std::vector<uint32_t> lineEnds;
+  std::vector<size_t> batchEnds;
+  std::vector<std::string> superblocks;
+  char line[RECORD_LINE_MAX];
+  if(preallocated)
+    writeHost(path, std::string(records * RECORD_LINE_MAX, '\0'));
+  for(int i = 0; i < records;) {
+    int count = std::min(records - i, 1 + (int) (random() % BATCH_MAX));
+    uint32_t offset = wal_begin(path);
+    superblocks.push_back(readHost(SUPERBLOCK));
+    File file = SD.open(path, "r+");
+    file.seek(offset);
+    uint32_t end = offset;
+    for(int j = 0; j < count; j++) {
+      sensor_data data = randomRecord(random, 1714600000 + (i + j) * 10);
+      size_t len = serializeSensorData(&data, line, sizeof(line));
+      file.write((uint8_t*) line, len);
+      written.append(line, len);
+      end += len;
+      lineEnds.push_back(end);
+    }
+    file.close();
+    wal_commit(path, end, count);
+    i += count;
+    batchEnds.push_back(written.size());
+  }
+  superblocks.push_back(readHost(SUPERBLOCK));
+  std::string full = readHost(path);
+
+  // The cut lands in some batch, whose commit checkpoint never happened
+  size_t cut = random() % (written.size() + 1);
+  size_t batch = 0;
+  while(batch < batchEnds.size() && batchEnds[batch] <= cut)
+    batch++;
+  std::string superblock = superblocks[batch];
+  std::string damaged = full.substr(0, cut);
+  if(preallocated)
+    damaged += std::string(full.size() - cut, '\0');
+
+  // Where the scan starts, from the newest valid slot of the superblock we restore
+  superblock_slot slots[2];
+  int newest = readSlots(superblock, slots);
+  uint32_t committed = newest >= 0 ? slots[newest].committed : 0;
+  // Tearing the newest slot makes recovery fall back to the other one, if that's for the same log
+  bool torn = false;
+  if(newest >= 0 && slots[1 - newest].valid && strncmp(slots[1 - newest].path, path, 40) == 0 && random() % 5 == 0) {
+    superblock[newest * SLOT_SIZE + random() % 56] ^= 1 + random() % 255;
+    committed = slots[1 - newest].committed;
+    torn = true;
+  }
+  // Damage past the checkpoint, what's before it is trusted and never scanned
+  size_t flipped = SIZE_MAX;
+  if(cut > committed && random() % 3 == 0) {
+    flipped = committed + random() % (cut - committed);
+    damaged[flipped] ^= 1 + random() % 255;
+  }
+  writeHost(path, damaged);
+  writeHost(SUPERBLOCK, superblock);
+
+  // Longest run of whole lines, and none past a flipped byte
+  uint32_t expected = 0;
+  int expectedLines = 0;
+  for(uint32_t end : lineEnds) {
+    if(end > cut || (flipped != SIZE_MAX && end > flipped))
+      break;
+    expected = end;
+    expectedLines++;
+  }
+  int committedLines = 0;
+  while(committedLines < (int) lineEnds.size() && lineEnds[committedLines] <= committed)
+    committedLines++;
+  // Recovery doesn't look before the checkpoint
+  if(expected < committed) {
+    expected = committed;
+    expectedLines = committedLines;
+  }
+
+  uint32_t scanned = wal_recover();
+  std::string recovered = readHost(path);
+  char where[160];
+  snprintf(where, sizeof(where), "iteration %d (%s, %d records, cut at %zu of %zu, checkpoint %u, flipped %zd)",
+           iteration, preallocated ? "preallocated" : "appended", records, cut, written.size(),
+           (unsigned) committed, flipped == SIZE_MAX ? (ssize_t) -1 : (ssize_t) flipped);
+  if(recovered.compare(0, expected, full, 0, expected) != 0 || recovered.size() < expected) {
+    fprintf(stderr, "%s: valid prefix of %u bytes not kept\n", where, (unsigned) expected);
+    return false;
+  }
+  if(!preallocated && recovered.size() != expected) {
+    fprintf(stderr, "%s: log is %zu bytes, expected %u\n", where, recovered.size(), (unsigned) expected);
+    return false;
+  }
+  if(preallocated && recovered.find_first_not_of('\0', expected) != std::string::npos) {
+    fprintf(stderr, "%s: torn bytes left past %u at %zu\n", where, (unsigned) expected,
+            recovered.find_first_not_of('\0', expected));
+    return false;
+  }
+  if((int) scanned != expectedLines - committedLines) {
+    fprintf(stderr, "%s: scanned %u lines, expected %d\n", where, (unsigned) scanned,
+            expectedLines - committedLines);
+    return false;
+  }
+  // Lines written since the last checkpoint (or the one before if the last was torn) is the most a scan can see
+  if(scanned >= (torn ? 2 : 1) * (WAL_CHECKPOINT_RECORDS + BATCH_MAX)) {
+    fprintf(stderr, "%s: scanned %u lines, more than a checkpoint interval\n", where, (unsigned) scanned);
+    return false;
+  }
+  // The next write goes where the valid prefix ends
+  if(wal_begin(path) != expected) {
+    fprintf(stderr, "%s: next write at %u, expected %u\n", where, (unsigned) wal_begin(path), (unsigned) expected);
+    return false;
+  }
+  remove(hostPath(path).c_str());
+  return true;
+}
+
+int main(int argc, char** argv) {
+  int iterations = 2000;
+  unsigned seed = std::random_device()();
+  static struct option options[] = {
+    {"iterations", required_argument, NULL, 'n'},
+    {"seed", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0},
+  };
+  int option;
+  while((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch(option) {
+      case 'n': iterations = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "Usage: %s [--iterations N] [--seed S]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  char scratch[] = "/tmp/wal-fuzz-XXXXXX";
+  if(mkdtemp(scratch) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  sdRoot = scratch;
+  hostsim_sd_root(scratch);
+  log_init();
+  log_set_level("all", "none");
+  storageMutex = xSemaphoreCreateMutex();
+
+  std::mt19937 random(seed);
+  bool ok = checkFraming(random);
+  for(int i = 0; i < iterations && ok; i++)
+    ok = runIteration(random, i);
+  printf("%s: %d iterations, seed %u, SD in %s\n", ok ? "passed" : "FAILED", iterations, seed, scratch);
+  fflush(stdout);
+  _exit(ok ? 0 : 1);
+}
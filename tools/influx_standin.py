@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""
+Stand-in for the InfluxDB v2 write endpoint, for benchmarking the station's upload path.
+
+Implements POST /api/v2/write the way the InfluxDB sink uses it: org and bucket query
+parameters, "Authorization: Token ..." header, line protocol body, 204 on success. Every point
+is validated and counted. Faults are injected following a repeating schedule:
+
+    ./influx_standin.py --port 8086 --schedule "ok:60,latency=500:20,500:10,429:10,reset:5,slow:10"
+
+Schedule phases, each followed by its duration in seconds:
+    ok            answer normally
+    latency=<ms>  wait before answering
+    500, 503, 429 answer with that status (429 includes Retry-After)
+    reset         drop the connection with a TCP reset without answering
+    slow          read the body in small chunks with pauses, like a congested server
+
+Points/s, status counts and handling latency percentiles are printed every --report seconds,
+and a summary at exit (Ctrl-C or --duration). --json writes the summary as JSON for scripts.
+"""
+import argparse
+import json
+import re
+import signal
+import socket
+import struct
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+# measurement[,tag=value...] field=value[,field=value...] [timestamp]
+FIELD_VALUE = re.compile(r'^(-?\d+(\.\d+)?([eE][-+]?\d+)?|-?\d+[iu]|"(\\.|[^"\\])*"|[tTfF]|true|false|True|False|TRUE|FALSE)$')
+
+
+def split_unescaped(text, sep):
+    parts, current, escaped, quoted = [], [], False, False
+    for char in text:
+        if escaped:
+            current.append(char)
+            escaped = False
+        elif char == "\\":
+            current.append(char)
+            escaped = True
+        elif char == '"':
+            current.append(char)
+            quoted = not quoted
+        elif char == sep and not quoted:
+            parts.append("".join(current))
+            current = []
+        else:
+            current.append(char)
+    parts.append("".join(current))
+    return parts
+
+
+def validate_line(line):
+    """Returns None if the line is a valid point, otherwise the reason"""
+    sections = split_unescaped(line, " ")
+    if len(sections) not in (2, 3):
+        return "expected measurement, fields and optional timestamp"
+    key, fields = sections[0], sections[1]
+    if not key or key.startswith(","):
+        return "missing measurement"
+    for tag in split_unescaped(key, ",")[1:]:
+        if "=" not in tag or tag.startswith("=") or tag.endswith("="):
+            return "malformed tag %r" % tag
+    for field in split_unescaped(fields, ","):
+        name, _, value = field.partition("=")
+        if not name or not FIELD_VALUE.match(value):
+            return "malformed field %r" % field
+    if len(sections) == 3 and not re.match(r"^-?\d+$", sections[2]):
+        return "malformed timestamp %r" % sections[2]
+    return None
+
+
+class Schedule:
+    def __init__(self, spec):
+        self.phases = []
+        for item in filter(None, spec.split(",")):
+            mode, _, seconds = item.rpartition(":")
+            self.phases.append((mode, float(seconds)))
+        if not self.phases:
+            self.phases = [("ok", 1.0)]
+        self.cycle = sum(seconds for _, seconds in self.phases)
+        self.start = time.monotonic()
+
+    def current(self):
+        offset = (time.monotonic() - self.start) % self.cycle
+        for mode, seconds in self.phases:
+            if offset < seconds:
+                return mode
+            offset -= seconds
+        return self.phases[-1][0]
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.start = time.monotonic()
+        self.points = 0
+        self.requests = 0
+        self.bytes = 0
+        self.statuses = {}
+        self.latencies = []
+        self.window_points = 0
+        self.window_start = self.start
+
+    def record(self, status, points, length, latency):
+        with self.lock:
+            self.requests += 1
+            self.bytes += length
+            self.statuses[str(status)] = self.statuses.get(str(status), 0) + 1
+            self.latencies.append(latency)
+            if status == 204:
+                self.points += points
+                self.window_points += points
+
+    def summary(self):
+        with self.lock:
+            elapsed = time.monotonic() - self.start
+            ordered = sorted(self.latencies)
+
+            def percentile(p):
+                return round(ordered[min(len(ordered) - 1, int(p * len(ordered)))] * 1000, 2) if ordered else 0
+
+            return {
+                "elapsed_s": round(elapsed, 3),
+                "requests": self.requests,
+                "points": self.points,
+                "bytes": self.bytes,
+                "points_per_s": round(self.points / elapsed, 1) if elapsed > 0 else 0,
+                "statuses": dict(self.statuses),
+                "latency_ms": {"p50": percentile(0.5), "p90": percentile(0.9),
+                               "p99": percentile(0.99), "max": percentile(1.0)},
+            }
+
+    def window(self):
+        with self.lock:
+            now = time.monotonic()
+            rate = self.window_points / (now - self.window_start) if now > self.window_start else 0
+            self.window_points = 0
+            self.window_start = now
+            return rate
+
+
+class WriteHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # Keep-alive, like the station's sink
+
+    def log_message(self, format, *args):
+        if self.server.args.verbose:
+            sys.stderr.write("%s %s\n" % (self.address_string(), format % args))
+
+    def reply(self, status, message=None, headers=None):
+        body = json.dumps({"code": "invalid" if status == 400 else "error", "message": message}).encode() if message else b""
+        self.send_response(status)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        if body:
+            self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def read_body(self, length, slow):
+        if not slow:
+            return self.rfile.read(length)
+        chunks = []
+        while length > 0:
+            chunk = self.rfile.read(min(64, length))
+            if not chunk:
+                break
+            chunks.append(chunk)
+            length -= len(chunk)
+            time.sleep(0.02)
+        return b"".join(chunks)
+
+    def do_POST(self):
+        started = time.monotonic()
+        args = self.server.args
+        mode = self.server.schedule.current()
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        length = int(self.headers.get("Content-Length", 0))
+
+        if mode == "reset":
+            # SO_LINGER with a zero timeout turns close() into a RST
+            self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+            self.close_connection = True
+            self.connection.close()
+            self.server.stats.record("reset", 0, 0, time.monotonic() - started)
+            return
+
+        body = self.read_body(length, mode == "slow")
+        if mode.startswith("latency="):
+            time.sleep(float(mode.split("=", 1)[1]) / 1000)
+
+        status, message, points, headers = 204, None, 0, None
+        if url.path != "/api/v2/write":
+            status, message = 404, "path not found"
+        elif query.get("org", [None])[0] != args.org or query.get("bucket", [None])[0] != args.bucket:
+            status, message = 404, "organization or bucket not found"
+        elif args.token and self.headers.get("Authorization") != "Token " + args.token:
+            status, message = 401, "unauthorized access"
+        elif mode in ("500", "503"):
+            status, message = int(mode), "injected failure"
+        elif mode == "429":
+            status, message, headers = 429, "injected rate limit", {"Retry-After": "1"}
+        else:
+            for number, line in enumerate(body.decode("utf-8", "replace").split("\n"), 1):
+                line = line.strip()
+                if not line or line.startswith("#"):
+                    continue
+                reason = validate_line(line)
+                if reason:
+                    status, message = 400, "line %d: %s" % (number, reason)
+                    break
+                points += 1
+        self.reply(status, message, headers)
+        self.server.stats.record(status, points, len(body), time.monotonic() - started)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8086)
+    parser.add_argument("--org", default="weather-station-group")
+    parser.add_argument("--bucket", default="weather-records")
+    parser.add_argument("--token", default="", help="required token, any is accepted if empty")
+    parser.add_argument("--schedule", default="ok:1", help="repeating fault schedule, see above")
+    parser.add_argument("--report", type=float, default=10, help="seconds between progress reports, 0 disables them")
+    parser.add_argument("--duration", type=float, default=0, help="exit after this many seconds")
+    parser.add_argument("--json", help="write the summary to this file")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer((args.host, args.port), WriteHandler)
+    server.daemon_threads = True
+    server.args = args
+    server.schedule = Schedule(args.schedule)
+    server.stats = Stats()
+    stop = threading.Event()
+    signal.signal(signal.SIGINT, lambda *_: stop.set())
+    signal.signal(signal.SIGTERM, lambda *_: stop.set())
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("Listening on %s:%d, schedule %s" % (args.host, args.port, args.schedule), flush=True)
+
+    deadline = time.monotonic() + args.duration if args.duration else None
+    next_report = time.monotonic() + args.report
+    while not stop.is_set() and (deadline is None or time.monotonic() < deadline):
+        stop.wait(0.2)
+        if args.report and time.monotonic() >= next_report:
+            next_report += args.report
+            summary = server.stats.summary()
+            print("%.0f points/s now, %d points total, phase %s, statuses %s, p50 %.1f ms p99 %.1f ms" % (
+                server.stats.window(), summary["points"], server.schedule.current(), summary["statuses"],
+                summary["latency_ms"]["p50"], summary["latency_ms"]["p99"]), flush=True)
+    server.shutdown()
+
+    summary = server.stats.summary()
+    print(json.dumps(summary, indent=2))
+    if args.json:
+        with open(args.json, "w") as out:
+            json.dump(summary, out, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,189 @@
+/*
+  Publishes synthetic records through the station's MQTT publisher to a broker on Linux, and
+  reports throughput and PUBACK latency.
+
+    g++ -O2 -std=c++17 -I../main mqtt_bench.cpp ../main/mqtt.cpp ../main/record.cpp -o mqtt_bench
+    mosquitto -p 1883 &
+    ./mqtt_bench [host] [port] [records] [window] [records per message]
+
+  Killing the broker mid-run and starting it again exercises the outbox resend. Without a broker,
+  tools/mqtt_standin.py --drop-after N does the same on its first connection and counts the
+  records that arrived, so a resend that loses or repeats records shows up in its summary.
+
+  Records carry values as long as the station's, with the longest location the config allows.
+  Exits with 1 unless every record was acknowledged, so a message too small for its records fails.
+*/
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mqtt.h"
+
+class SocketTransport : public MqttTransport {
+public:
+  bool connect(const char* host, uint16_t port) {
+    char service[8];
+    struct addrinfo hints = {};
+    struct addrinfo* result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if(getaddrinfo(host, service, &hints, &result) != 0)
+      return false;
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(fd >= 0 && ::connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(result);
+    if(fd < 0)
+      return false;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return true;
+  }
+  void close() {
+    if(fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+  bool connected() { return fd >= 0; }
+  int read(uint8_t* buf, size_t len) {
+    ssize_t got = recv(fd, buf, len, MSG_DONTWAIT);
+    if(got > 0)
+      return got;
+    if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    return -1;
+  }
+  bool write(const uint8_t* buf, size_t len) {
+    countRecords((const char*) buf, len);
+    while(len > 0) {
+      ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+      if(sent <= 0)
+        return false;
+      buf += sent;
+      len -= sent;
+    }
+    return true;
+  }
+
+  // Timestamps of the records that went out, counted from the bme280 line of each
+  std::set<long long> published;
+
+private:
+  void countRecords(const char* buf, size_t len) {
+    const char* end = buf + len;
+    for(const char* line = buf; line < end; ) {
+      const char* newline = (const char*) memchr(line, '\n', end - line);
+      if(newline == NULL)
+        break;
+      const char* space = newline;
+      while(space > line && space[-1] != ' ')
+        space--;
+      if(newline - line > 24 && memcmp(line, "weather,sensor_id=bme280,", 25) == 0 && space > line)
+        published.insert(strtoll(space, NULL, 10));
+      line = newline + 1;
+    }
+  }
+
+  int fd = -1;
+};
+
+static uint32_t benchClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t) (now.tv_sec * 1000000ull + now.tv_nsec / 1000);
+}
+
+static void recordLatency(uint32_t latency, void* ctx) {
+  ((std::vector<uint32_t>*) ctx)->push_back(latency);
+}
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, double p) {
+  if(sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+int main(int argc, char** argv) {
+  const char* host = argc > 1 ? argv[1] : "localhost";
+  int port = argc > 2 ? atoi(argv[2]) : 1883;
+  int total = argc > 3 ? atoi(argv[3]) : 10000;
+  int window = argc > 4 ? atoi(argv[4]) : 8;
+  int perMessage = argc > 5 ? atoi(argv[5]) : 1;
+
+  static SocketTransport transport;
+  static MqttClient client(&transport, &benchClock);
+  // As long as a location gets, LINE_PROTOCOL_LOCATION_MAX characters
+  static MqttPublisher publisher(&client, &benchClock, "weather/bench", "backyard-station-north-fence-01",
+                                 window, perMessage);
+  std::vector<uint32_t> latencies;
+  publisher.onLatency(&recordLatency, &latencies);
+
+  if(!client.connect(host, port, "weather-bench", 30, NULL, NULL, 5000)) {
+    fprintf(stderr, "Failed to connect to %s:%d\n", host, port);
+    return 1;
+  }
+
+  // Fed in batches the size the sink task hands over
+  sensor_data batch[16] = {};
+  time_t timestamp = 1700000000;
+  int queued = 0;
+  int reconnects = 0;
+  uint32_t start = benchClock();
+  while(queued < total || publisher.pending() > 0) {
+    while(queued < total) {
+      int count = std::min(total - queued, 16);
+      for(int i = 0; i < count; i++) {
+        int n = queued + i;
+        batch[i].timestamp = timestamp + n;
+        batch[i].rain_fall = 1234.567 + n * 0.2794f; // mm since boot, a tipping bucket's step
+        batch[i].wind_speed = 12.345 + (n % 7);
+        batch[i].wind_direction = 337.5;
+        batch[i].temperature = -12.345 + (n % 50) * 0.1f;
+        batch[i].humidity = 98.765;
+        batch[i].pressure = 1013.25; // hPa, like the BME280 reading
+        batch[i].interval = 60;
+      }
+      if(!publisher.enqueue(batch, count))
+        break;
+      queued += count;
+    }
+    if(!publisher.pump()) {
+      fprintf(stderr, "Connection lost, %d messages pending\n", publisher.pending());
+      while(!client.connect(host, port, "weather-bench", 30, NULL, NULL, 5000))
+        sleep(1);
+      reconnects++;
+      publisher.resend();
+    }
+  }
+  double elapsed = (benchClock() - start) / 1e6;
+  client.disconnect();
+
+  const mqtt_stats* stats = publisher.stats();
+  std::sort(latencies.begin(), latencies.end());
+  printf("records %d, messages %u, resent %u, reconnects %d, window %d, records per message %d\n",
+         total, (unsigned) stats->published, (unsigned) stats->resent, reconnects, window, perMessage);
+  printf("elapsed %.3f s, %.0f records/s, %.0f messages/s\n", elapsed, total / elapsed, stats->acked / elapsed);
+  printf("ack latency us: mean %.0f, p50 %u, p90 %u, p99 %u, max %u\n",
+         stats->acked ? (double) stats->latencyTotal / stats->acked : 0.0,
+         percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+         (unsigned) stats->latencyMax);
+  if(transport.published.size() != (size_t) total || stats->records != (uint32_t) total || stats->unsent > 0) {
+    fprintf(stderr, "Only %zu of %d records published and %u acknowledged, %u didn't fit their message\n",
+            transport.published.size(), total, (unsigned) stats->records, (unsigned) stats->unsent);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+"""
+Stand-in for an MQTT 3.1.1 broker, for benchmarking the station's MQTT sink and tools/mqtt_bench.
+
+Implements the part of the protocol the station's publisher uses: CONNECT (answered with CONNACK),
+PUBLISH at QoS 0 and 1 (answered with PUBACK), PINGREQ and DISCONNECT. Nothing is forwarded to
+subscribers. Every payload is read as line protocol, and records are counted by their timestamp,
+so records published again after a reconnect show up as duplicates rather than new records.
+
+    ./mqtt_standin.py --port 1883 --drop-after 500
+    ./mqtt_bench 127.0.0.1 1883 10000 8 1
+
+--drop-after resets the first connection after that many publishes without acknowledging the
+last one, the way a broker restart or a WiFi dropout looks to the station. --ack-latency delays
+every PUBACK. Publishes/s are printed every --report seconds, and a summary at exit (Ctrl-C or
+--duration). --json writes the summary as JSON for scripts.
+"""
+import argparse
+import json
+import signal
+import socket
+import socketserver
+import struct
+import sys
+import threading
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK, PINGREQ, PINGRESP, DISCONNECT = 1, 2, 3, 4, 12, 13, 14
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.start = time.monotonic()
+        self.connections = 0
+        self.drops = 0
+        self.publishes = 0
+        self.dup_flagged = 0
+        self.bytes = 0
+        self.timestamps = set()
+        self.duplicate_records = 0
+        self.malformed = 0
+        self.window_publishes = 0
+        self.window_start = self.start
+
+    def publish(self, payload, dup):
+        with self.lock:
+            self.publishes += 1
+            self.window_publishes += 1
+            self.bytes += len(payload)
+            if dup:
+                self.dup_flagged += 1
+            # One line per sensor, all stamped with the record's timestamp
+            stamps = set()
+            for line in payload.decode("utf-8", "replace").split("\n"):
+                sections = line.strip().split(" ")
+                if len(sections) != 3 or not sections[2].lstrip("-").isdigit():
+                    if line.strip():
+                        self.malformed += 1
+                    continue
+                stamps.add(int(sections[2]))
+            for stamp in stamps:
+                if stamp in self.timestamps:
+                    self.duplicate_records += 1
+                else:
+                    self.timestamps.add(stamp)
+
+    def summary(self):
+        with self.lock:
+            elapsed = time.monotonic() - self.start
+            return {
+                "elapsed_s": round(elapsed, 3),
+                "connections": self.connections,
+                "dropped_connections": self.drops,
+                "publishes": self.publishes,
+                "dup_flagged": self.dup_flagged,
+                "records": len(self.timestamps),
+                "duplicate_records": self.duplicate_records,
+                "malformed_lines": self.malformed,
+                "bytes": self.bytes,
+            }
+
+    def window(self):
+        with self.lock:
+            now = time.monotonic()
+            rate = self.window_publishes / (now - self.window_start) if now > self.window_start else 0
+            self.window_publishes = 0
+            self.window_start = now
+            return rate
+
+
+class BrokerHandler(socketserver.BaseRequestHandler):
+    def read_exact(self, length):
+        data = b""
+        while len(data) < length:
+            chunk = self.request.recv(length - len(data))
+            if not chunk:
+                raise ConnectionError("closed")
+            data += chunk
+        return data
+
+    def read_packet(self):
+        first = self.read_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self.read_exact(1)[0]
+            length |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                break
+            shift += 7
+            if shift > 21:
+                raise ConnectionError("malformed remaining length")
+        return first >> 4, first & 0x0F, self.read_exact(length)
+
+    def reset(self):
+        # SO_LINGER with a zero timeout turns close() into a RST
+        self.request.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        self.request.close()
+
+    def handle(self):
+        server = self.server
+        args = server.args
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        with server.stats.lock:
+            server.stats.connections += 1
+            drop = args.drop_after > 0 and server.stats.connections == 1
+        publishes = 0
+        try:
+            while True:
+                kind, flags, body = self.read_packet()
+                if kind == CONNECT:
+                    self.request.sendall(bytes([CONNACK << 4, 2, 0, 0]))
+                elif kind == PUBLISH:
+                    qos = (flags >> 1) & 3
+                    topic_length = struct.unpack(">H", body[:2])[0]
+                    offset = 2 + topic_length
+                    packet_id = None
+                    if qos > 0:
+                        packet_id = struct.unpack(">H", body[offset:offset + 2])[0]
+                        offset += 2
+                    publishes += 1
+                    if drop and publishes >= args.drop_after:
+                        with server.stats.lock:
+                            server.stats.drops += 1
+                        self.reset()
+                        return
+                    server.stats.publish(body[offset:], bool(flags & 8))
+                    if packet_id is not None:
+                        if args.ack_latency:
+                            time.sleep(args.ack_latency / 1000)
+                        self.request.sendall(struct.pack(">BBH", PUBACK << 4, 2, packet_id))
+                elif kind == PINGREQ:
+                    self.request.sendall(bytes([PINGRESP << 4, 0]))
+                elif kind == DISCONNECT:
+                    return
+                elif args.verbose:
+                    sys.stderr.write("Ignoring packet type %d\n" % kind)
+        except (ConnectionError, OSError):
+            return
+
+
+class Broker(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--drop-after", type=int, default=0, help="reset the first connection after this many publishes")
+    parser.add_argument("--ack-latency", type=float, default=0, help="milliseconds to wait before every PUBACK")
+    parser.add_argument("--report", type=float, default=10, help="seconds between progress reports, 0 disables them")
+    parser.add_argument("--duration", type=float, default=0, help="exit after this many seconds")
+    parser.add_argument("--json", help="write the summary to this file")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    server = Broker((args.host, args.port), BrokerHandler)
+    server.args = args
+    server.stats = Stats()
+    stop = threading.Event()
+    signal.signal(signal.SIGINT, lambda *_: stop.set())
+    signal.signal(signal.SIGTERM, lambda *_: stop.set())
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("Listening on %s:%d" % (args.host, args.port), flush=True)
+
+    deadline = time.monotonic() + args.duration if args.duration else None
+    next_report = time.monotonic() + args.report
+    while not stop.is_set() and (deadline is None or time.monotonic() < deadline):
+        stop.wait(0.2)
+        if args.report and time.monotonic() >= next_report:
+            next_report += args.report
+            summary = server.stats.summary()
+            print("%.0f publishes/s now, %d records total, %d duplicate" % (
+                server.stats.window(), summary["records"], summary["duplicate_records"]), flush=True)
+    server.shutdown()
+
+    summary = server.stats.summary()
+    print(json.dumps(summary, indent=2))
+    if args.json:
+        with open(args.json, "w") as out:
+            json.dump(summary, out, indent=2)
+
+
+if __name__ == "__main__":
+    main()
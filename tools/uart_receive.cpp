@@ -0,0 +1,389 @@
+/*
+  Receiver for the station's exportSerial command. Runs the command over the console port,
+  switches to the transfer baud rate with it, decodes the frames back into CSV or line protocol
+  and reports the effective throughput.
+
+    g++ -O2 -std=c++17 -I../main uart_receive.cpp ../main/transfer.cpp ../main/record.cpp -o uart_receive
+    ./uart_receive --port /dev/ttyUSB0 --from "2024/05/01 00:00:00" --to "2024/05/14 23:59:59" --out may.csv
+
+  Records received so far are counted in <out>.offset after every frame. If the transfer is cut
+  short (cable pulled, a frame lost to noise), running the same command again with --resume
+  appends from there instead of starting over. Frames are only written in order, anything after
+  a lost frame is discarded and comes back on resume.
+
+  --input decodes a raw capture of the transfer instead of talking to a port.
+*/
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+#include "record.h"
+#include "transfer.h"
+
+typedef std::chrono::steady_clock receiveClock;
+
+// Give up when nothing decodable arrived for this long, in milliseconds
+#define RECEIVE_TIMEOUT 5000
+
+struct Options {
+  const char* port = NULL;
+  const char* input = NULL;
+  const char* from = NULL;
+  const char* to = NULL;
+  const char* out = NULL;
+  const char* location = "test";
+  bool lineProtocol = false;
+  bool resume = false;
+  int baud = 921600;
+  int consoleBaud = 115200;
+};
+
+struct Receiver {
+  FILE* out = NULL;
+  bool lineProtocol = false;
+  const char* location = "test";
+  std::string offsetPath;
+  uint32_t expected = 0;  // Offset of the next record to write
+  uint32_t total = 0;     // Records in the range, known once the end frame arrives
+  uint64_t frames = 0;
+  uint64_t badBytes = 0;  // Skipped while hunting for a frame
+  uint64_t wireBytes = 0;
+  uint64_t textBytes = 0; // Output written
+  bool started = false;
+  bool ended = false;
+  bool gap = false;
+  receiveClock::time_point first;
+  receiveClock::time_point last;
+};
+
+static double seconds(receiveClock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+static speed_t baudConstant(int baud) {
+  switch(baud) {
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    default: return 0;
+  }
+}
+
+static bool setBaud(int fd, int baud) {
+  struct termios tty;
+  speed_t speed = baudConstant(baud);
+  if(speed == 0 || tcgetattr(fd, &tty) != 0)
+    return false;
+  cfmakeraw(&tty);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cc[VMIN] = 0;
+  tty.c_cc[VTIME] = 0;
+  cfsetispeed(&tty, speed);
+  cfsetospeed(&tty, speed);
+  return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+// Bytes read within timeoutMs, 0 on timeout, -1 on error
+static ssize_t readSome(int fd, uint8_t* buf, size_t len, int timeoutMs) {
+  struct pollfd poller = {fd, POLLIN, 0};
+  int ready = poll(&poller, 1, timeoutMs);
+  if(ready <= 0)
+    return ready;
+  return read(fd, buf, len);
+}
+
+// Reads console text until a line containing needle, which is copied to line
+static bool waitForLine(int fd, const char* needle, char* line, size_t len, int timeoutMs) {
+  std::string text;
+  uint8_t buf[256];
+  auto deadline = receiveClock::now() + std::chrono::milliseconds(timeoutMs);
+  while(receiveClock::now() < deadline) {
+    ssize_t got = readSome(fd, buf, sizeof(buf), 100);
+    if(got < 0)
+      return false;
+    text.append((const char*) buf, got);
+    size_t found = text.find(needle);
+    size_t end = found == std::string::npos ? found : text.find('\n', found);
+    if(end != std::string::npos) {
+      snprintf(line, len, "%s", text.substr(found, end - found).c_str());
+      return true;
+    }
+  }
+  return false;
+}
+
+static void saveOffset(Receiver* receiver) {
+  FILE* file = fopen(receiver->offsetPath.c_str(), "w");
+  if(file != NULL) {
+    fprintf(file, "%u\n", (unsigned) receiver->expected);
+    fclose(file);
+  }
+}
+
+static void writeRecord(Receiver* receiver, const sensor_data* data) {
+  char line[LINE_PROTOCOL_MAX];
+  size_t len;
+  if(receiver->lineProtocol) {
+    len = formatLineProtocol(data, receiver->location, line, sizeof(line));
+  }
+  else {
+    // Plain payload, without the length and CRC frame of the station's log
+    len = serializeSensorData(data, line, sizeof(line));
+    if(len > 0) {
+      line[len - 1] = '\0';
+      unframeRecord(line);
+      len = strlen(line);
+      line[len++] = '\n';
+    }
+  }
+  fwrite(line, 1, len, receiver->out);
+  receiver->textBytes += len;
+}
+
+static void handleFrame(Receiver* receiver, const transfer_frame* frame) {
+  sensor_data records[TRANSFER_RECORDS_MAX];
+  receiver->frames++;
+  receiver->last = receiveClock::now();
+  if(frame->type == TRANSFER_START) {
+    if(!receiver->started)
+      receiver->first = receiver->last;
+    receiver->started = true;
+    return;
+  }
+  if(frame->type == TRANSFER_END) {
+    receiver->total = frame->offset;
+    receiver->ended = true;
+    return;
+  }
+  if(frame->offset != receiver->expected) {
+    // A frame went missing, nothing after it can be appended in order
+    if(frame->offset > receiver->expected && !receiver->gap)
+      fprintf(stderr, "Lost records %u to %u, resume to get the rest\n", (unsigned) receiver->expected,
+              (unsigned) frame->offset - 1);
+    receiver->gap |= frame->offset > receiver->expected;
+    return;
+  }
+  if(receiver->gap)
+    return;
+  int count = transfer_records(frame, records, TRANSFER_RECORDS_MAX);
+  if(count < 0) {
+    fprintf(stderr, "Malformed frame at record %u\n", (unsigned) frame->offset);
+    receiver->gap = true;
+    return;
+  }
+  for(int i = 0; i < count; i++)
+    writeRecord(receiver, &records[i]);
+  fflush(receiver->out);
+  receiver->expected += count;
+  saveOffset(receiver);
+}
+
+// Decodes every complete frame in buf and drops the bytes it used
+static void decode(Receiver* receiver, std::vector<uint8_t>& buf) {
+  size_t pos = 0;
+  while(pos < buf.size() && !receiver->ended) {
+    transfer_frame frame;
+    int used = transfer_decode(buf.data() + pos, buf.size() - pos, &frame);
+    if(used == 0)
+      break;
+    if(used < 0) {
+      receiver->badBytes++;
+      pos++;
+      continue;
+    }
+    handleFrame(receiver, &frame);
+    pos += used;
+  }
+  buf.erase(buf.begin(), buf.begin() + pos);
+}
+
+static void report(const Receiver* receiver) {
+  double elapsed = receiver->started ? seconds(receiver->last - receiver->first) : 0;
+  if(elapsed <= 0)
+    elapsed = 1e-6;
+  printf("Received %u records in %llu frames, %llu bytes on the wire, %llu bytes skipped\n",
+         (unsigned) receiver->expected, (unsigned long long) receiver->frames,
+         (unsigned long long) receiver->wireBytes, (unsigned long long) receiver->badBytes);
+  printf("%.1f s, %.0f B/s on the wire, %.0f records/s, %.0f B/s of %s output (%.1fx)\n", elapsed,
+         receiver->wireBytes / elapsed, receiver->expected / elapsed, receiver->textBytes / elapsed,
+         receiver->lineProtocol ? "line protocol" : "CSV",
+         receiver->wireBytes > 0 ? (double) receiver->textBytes / receiver->wireBytes : 0.0);
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s --port <device> --from <YYYY/MM/DD HH:MM:SS> --to <YYYY/MM/DD HH:MM:SS> --out <file>\n"
+          "          [--format csv|lp] [--location <tag>] [--baud <rate>] [--console-baud <rate>] [--resume]\n"
+          "       %s --input <capture> --out <file> [--format csv|lp] [--location <tag>]\n",
+          name, name);
+}
+
+static int receiveCapture(const Options& options, Receiver* receiver) {
+  FILE* capture = fopen(options.input, "rb");
+  if(capture == NULL) {
+    perror(options.input);
+    return 1;
+  }
+  std::vector<uint8_t> buf;
+  uint8_t chunk[4096];
+  size_t got;
+  while(!receiver->ended && (got = fread(chunk, 1, sizeof(chunk), capture)) > 0) {
+    buf.insert(buf.end(), chunk, chunk + got);
+    receiver->wireBytes += got;
+    decode(receiver, buf);
+  }
+  fclose(capture);
+  return 0;
+}
+
+static int receivePort(const Options& options, Receiver* receiver) {
+  char line[256];
+  int fd = open(options.port, O_RDWR | O_NOCTTY);
+  if(fd < 0 || !setBaud(fd, options.consoleBaud)) {
+    fprintf(stderr, "Couldn't open %s at %d baud\n", options.port, options.consoleBaud);
+    return 1;
+  }
+  if(baudConstant(options.baud) == 0) {
+    fprintf(stderr, "Unsupported baud rate %d\n", options.baud);
+    return 1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  snprintf(line, sizeof(line), "\nexportSerial \"%s\" \"%s\" --baud %d --offset %u\n", options.from, options.to,
+           options.baud, (unsigned) receiver->expected);
+  if(write(fd, line, strlen(line)) != (ssize_t) strlen(line) || !waitForLine(fd, "Sending ", line, sizeof(line), 5000)) {
+    fprintf(stderr, "The station didn't start the transfer\n");
+    return 1;
+  }
+  fprintf(stderr, "%s\n", line);
+  tcdrain(fd);
+  setBaud(fd, options.baud);
+
+  std::vector<uint8_t> buf;
+  uint8_t chunk[4096];
+  auto lastFrame = receiveClock::now();
+  uint64_t frames = 0;
+  while(!receiver->ended) {
+    ssize_t got = readSome(fd, chunk, sizeof(chunk), 100);
+    if(got < 0) {
+      perror(options.port);
+      break;
+    }
+    buf.insert(buf.end(), chunk, chunk + got);
+    receiver->wireBytes += got;
+    decode(receiver, buf);
+    if(receiver->frames != frames) {
+      frames = receiver->frames;
+      lastFrame = receiveClock::now();
+    }
+    else if(receiveClock::now() - lastFrame > std::chrono::milliseconds(RECEIVE_TIMEOUT)) {
+      fprintf(stderr, "Nothing received for %d ms, giving up\n", RECEIVE_TIMEOUT);
+      break;
+    }
+  }
+  // The station goes back to the console rate after the end frame and prints its own summary
+  setBaud(fd, options.consoleBaud);
+  if(receiver->ended && waitForLine(fd, "Sent ", line, sizeof(line), 3000))
+    fprintf(stderr, "Station: %s\n", line);
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  static struct option longOptions[] = {
+    {"port", required_argument, NULL, 'p'},
+    {"input", required_argument, NULL, 'i'},
+    {"from", required_argument, NULL, 'f'},
+    {"to", required_argument, NULL, 't'},
+    {"out", required_argument, NULL, 'o'},
+    {"format", required_argument, NULL, 'F'},
+    {"location", required_argument, NULL, 'l'},
+    {"baud", required_argument, NULL, 'b'},
+    {"console-baud", required_argument, NULL, 'c'},
+    {"resume", no_argument, NULL, 'r'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  int option;
+  while((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    switch(option) {
+      case 'p': options.port = optarg; break;
+      case 'i': options.input = optarg; break;
+      case 'f': options.from = optarg; break;
+      case 't': options.to = optarg; break;
+      case 'o': options.out = optarg; break;
+      case 'F':
+        if(strcmp(optarg, "lp") != 0 && strcmp(optarg, "csv") != 0) {
+          usage(argv[0]);
+          return 2;
+        }
+        options.lineProtocol = strcmp(optarg, "lp") == 0;
+        break;
+      case 'l': options.location = optarg; break;
+      case 'b': options.baud = atoi(optarg); break;
+      case 'c': options.consoleBaud = atoi(optarg); break;
+      case 'r': options.resume = true; break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+  if(options.out == NULL || (options.input == NULL && (options.port == NULL || options.from == NULL || options.to == NULL))) {
+    usage(argv[0]);
+    return 2;
+  }
+  // Longer ones wouldn't fit the line buffer, the station caps them the same way
+  if(strlen(options.location) > LINE_PROTOCOL_LOCATION_MAX) {
+    fprintf(stderr, "--location is longer than %d characters\n", LINE_PROTOCOL_LOCATION_MAX);
+    return 2;
+  }
+
+  Receiver receiver;
+  receiver.lineProtocol = options.lineProtocol;
+  receiver.location = options.location;
+  receiver.offsetPath = std::string(options.out) + ".offset";
+  if(options.resume) {
+    FILE* file = fopen(receiver.offsetPath.c_str(), "r");
+    unsigned offset = 0;
+    if(file != NULL) {
+      if(fscanf(file, "%u", &offset) == 1)
+        receiver.expected = offset;
+      fclose(file);
+    }
+  }
+  receiver.out = fopen(options.out, receiver.expected > 0 ? "a" : "w");
+  if(receiver.out == NULL) {
+    perror(options.out);
+    return 1;
+  }
+  if(receiver.expected == 0 && !options.lineProtocol)
+    fputs("time,rain_fall,wind_speed,wind_direction,temperature,humidity,pressure,interval\n", receiver.out);
+  else if(receiver.expected > 0)
+    fprintf(stderr, "Resuming after %u records\n", (unsigned) receiver.expected);
+
+  int result = options.input ? receiveCapture(options, &receiver) : receivePort(options, &receiver);
+  fclose(receiver.out);
+  if(result != 0)
+    return result;
+  report(&receiver);
+  if(!receiver.ended || receiver.gap || receiver.expected < receiver.total) {
+    fprintf(stderr, "Transfer incomplete at record %u, run again with --resume\n", (unsigned) receiver.expected);
+    return 1;
+  }
+  unlink(receiver.offsetPath.c_str());
+  return 0;
+}